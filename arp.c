@@ -6,6 +6,7 @@
 #include "platform.h"
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ether.h"
 #include "arp.h"
 #include "ip.h"
@@ -235,12 +236,14 @@ arp_reply(struct net_iface *iface, const uint8_t *tha, ip_addr_t tpa, const uint
 
 // this called when recieved arp request
 static void
-arp_input(const uint8_t *data, size_t len, struct net_device *dev)
+arp_input(struct pbuf *pb, struct net_device *dev)
 {
   struct arp_ether_ip *msg;
   ip_addr_t spa, tpa;
   int merge = 0; // update flag
   struct net_iface *iface;
+  const uint8_t *data = pb->data;
+  size_t len = pb->len;
 
   if (len < sizeof(*msg))
   {
@@ -1,4 +1,5 @@
 #include "net.h"
+#include "pbuf.h"
 #include "util.h"
 #include "platform/linux/platform.h"
 
@@ -6,10 +7,10 @@
 #define DUMMY_IRQ INTR_IRQ_BASE
 
 static int
-dummy_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+dummy_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-  debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, len);
-  debugdump(data, len);
+  debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, pb->len);
+  debugdump(pb->data, pb->len);
   // drop data
   intr_raise_irq(DUMMY_IRQ);
   return 0;
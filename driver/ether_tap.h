@@ -5,5 +5,7 @@
 
 extern struct net_device *
 ether_tap_init(const char *name, const char *addr);
+extern int
+ether_tap_set_coalesce(struct net_device *dev, unsigned int budget, unsigned int coalesce, int adaptive);
 
 #endif
\ No newline at end of file
@@ -1,11 +1,13 @@
 #include <string.h>
 
 #include "net.h"
+#include "pbuf.h"
 #include "util.h"
 #include "platform/linux/platform.h"
 
 #define LOOPBACK_MTU UINT16_MAX /* maximum size of IP datagram */
-#define LOOPBACK_QUEUE_LIMIT 16
+#define LOOPBACK_QUEUE_LIMIT 16 /* must be a power of two */
+#define LOOPBACK_BATCH 16
 #define LOOPBACK_IRQ (INTR_IRQ_BASE + 1)
 
 #define PRIV(x) ((loopback *)x->priv)
@@ -13,46 +15,23 @@
 typedef struct
 {
   int irq;
-  mutex_t mutex;
-  struct queue_head queue;
+  struct ring *queue; /* struct pbuf, produced by any thread that transmits */
 } loopback;
 
-struct loopback_queue_entry
-{
-  uint16_t type;
-  size_t len;
-  uint8_t data[]; /* flexible array member */
-};
-
 // send data to queue which exists in net_device.priv field(loopback)
 // and, raise irq by signal instead of hardware interruption
+// the packet buffer itself is queued (no copy)
 static int
-loopback_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+loopback_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-  struct loopback_queue_entry *entry;
-  unsigned int num;
-
-  mutex_lock(&PRIV(dev)->mutex);
-  if (PRIV(dev)->queue.num >= LOOPBACK_QUEUE_LIMIT)
+  pb->type = type;
+  if (ring_enqueue(PRIV(dev)->queue, pbuf_ref(pb)) == -1)
   {
-    mutex_unlock(&PRIV(dev)->mutex);
+    pbuf_free(pb);
     errorf("queue is full");
     return -1;
   }
-  entry = memory_alloc(sizeof(*entry) + len);
-  if (!entry)
-  {
-    mutex_unlock(&PRIV(dev)->mutex);
-    errorf("memory_alloc() failed");
-    return -1;
-  }
-  entry->type = type;
-  entry->len = len;
-  memcpy(entry->data, data, len);
-  queue_push(&PRIV(dev)->queue, entry);
-  num = PRIV(dev)->queue.num;
-  mutex_unlock(&PRIV(dev)->mutex);
-  debugf("loopback queue pushed (num:%u), dev=%s, type=0x%04x, len=%zd, irq=%d", num, dev->name, type, len, PRIV(dev)->irq);
+  debugf("loopback queue pushed (num:%u), dev=%s, type=0x%04x, len=%zd, irq=%d", ring_count(PRIV(dev)->queue), dev->name, type, pb->len, PRIV(dev)->irq);
   // hardware IRQ
   intr_raise_irq(PRIV(dev)->irq);
   return 0;
@@ -63,23 +42,25 @@ static int
 loopback_isr(unsigned int irq, void *id)
 {
   struct net_device *dev;
-  struct loopback_queue_entry *entry;
+  struct pbuf *pbs[LOOPBACK_BATCH];
+  unsigned int num, i;
 
   dev = (struct net_device *)id;
-  mutex_lock(&PRIV(dev)->mutex);
   while (1)
   {
-    entry = queue_pop(&PRIV(dev)->queue);
-    if (!entry)
+    num = ring_dequeue_burst(PRIV(dev)->queue, (void **)pbs, countof(pbs));
+    if (!num)
     {
       break;
     }
-    debugf("loopback queue popped (num:%u), dev=%s, type=0x%04x, len=%zd", PRIV(dev)->queue.num, dev->name, entry->type, entry->len);
-    debugdump(entry->data, entry->len);
-    net_input_handler(entry->type, entry->data, entry->len, dev);
-    memory_free(entry);
+    for (i = 0; i < num; i++)
+    {
+      debugf("loopback queue popped (num:%u), dev=%s, type=0x%04x, len=%zd", ring_count(PRIV(dev)->queue), dev->name, pbs[i]->type, pbs[i]->len);
+      debugdump(pbs[i]->data, pbs[i]->len);
+      net_input_handler(pbs[i]->type, pbs[i], dev);
+      pbuf_free(pbs[i]);
+    }
   }
-  mutex_unlock(&PRIV(dev)->mutex);
   return 0;
 }
 
@@ -114,8 +95,12 @@ loopback_init(void)
     return NULL;
   }
   lo->irq = LOOPBACK_IRQ;
-  mutex_init(&lo->mutex);
-  queue_init(&lo->queue);
+  lo->queue = ring_alloc(LOOPBACK_QUEUE_LIMIT);
+  if (!lo->queue)
+  {
+    errorf("ring_alloc() failed");
+    return NULL;
+  }
   dev->priv = lo;
 
   if (net_device_register(dev) == -1)
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ether.h"
 
 struct ether_hdr
@@ -73,59 +74,89 @@ ether_dump(const uint8_t *frame, size_t flen)
 }
 
 // helper of outputting ethernet frame
-int ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ether_transmit_func_t callback)
+// the header is prepended in the headroom of pb (no copy of the payload)
+int ether_transmit_helper(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst, ether_transmit_func_t callback)
 {
-  uint8_t frame[ETHER_FRAME_SIZE_MAX];
   struct ether_hdr *hdr;
-  size_t flen, pad = 0;
+  size_t len, pad = 0;
+  uint8_t *tail;
 
+  len = pb->len;
+  if (len < ETHER_PAYLOAD_SIZE_MIN)
+  {
+    pad = ETHER_PAYLOAD_SIZE_MIN - len;
+    tail = pbuf_put(pb, pad);
+    if (!tail)
+    {
+      errorf("pbuf_put() failure");
+      return -1;
+    }
+    memset(tail, 0, pad);
+  }
   // generate ethernet frame
-  hdr = (struct ether_hdr *)frame;
+  hdr = (struct ether_hdr *)pbuf_push(pb, sizeof(*hdr));
+  if (!hdr)
+  {
+    errorf("pbuf_push() failure");
+    return -1;
+  }
   memcpy(hdr->dst, dst, ETHER_ADDR_LEN);
   memcpy(hdr->src, dev->addr, ETHER_ADDR_LEN);
-
   hdr->type = hton16(type);
-  memcpy(hdr + 1, data, len);
 
-  if (len < ETHER_PAYLOAD_SIZE_MIN)
-  {
-    pad = ETHER_PAYLOAD_SIZE_MIN - len;
-  }
-  flen = sizeof(*hdr) + len + pad;
-  debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, flen);
-  ether_dump(frame, flen);
-  return callback(dev, frame, flen) == (ssize_t)flen ? 0 : -1;
+  debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, pb->len);
+  ether_dump(pb->data, pb->len);
+  return callback(dev, pb->data, pb->len) == (ssize_t)pb->len ? 0 : -1;
 }
 
 // helper of revcieving ehternet frame
 int ether_input_helper(struct net_device *dev, ether_input_func_t callback)
 {
-  uint8_t frame[ETHER_FRAME_SIZE_MAX];
+  struct pbuf *pb;
   ssize_t flen;
   struct ether_hdr *hdr;
   uint16_t type;
+  int ret;
 
+  pb = pbuf_alloc(0, ETHER_FRAME_SIZE_MAX);
+  if (!pb)
+  {
+    errorf("pbuf_alloc() failure");
+    return -1;
+  }
   // actual read process of ethernet frame
-  flen = callback(dev, frame, sizeof(frame));
+  flen = callback(dev, pb->data, pb->len);
+  if (flen == -1)
+  {
+    /* no frame (error is reported by the callback) */
+    pbuf_free(pb);
+    return -1;
+  }
   if (flen < (ssize_t)sizeof(*hdr))
   {
     errorf("too short");
+    pbuf_free(pb);
     return -1;
   }
-  hdr = (struct ether_hdr *)frame;
+  pbuf_trim(pb, flen);
+  hdr = (struct ether_hdr *)pb->data;
   // check destination is my mac address or broadcast
   if (memcmp(dev->addr, hdr->dst, ETHER_ADDR_LEN) != 0)
   {
     if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0)
     {
       // for other host
+      pbuf_free(pb);
       return -1;
     }
   }
   type = ntoh16(hdr->type);
   debugf("dev=%s, type=0x%04x, len=%zd", dev->name, type, flen);
-  ether_dump(frame, flen);
-  return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev);
+  ether_dump(pb->data, flen);
+  pbuf_pull(pb, sizeof(*hdr));
+  ret = net_input_handler(type, pb, dev);
+  pbuf_free(pb);
+  return ret;
 }
 
 void ether_setup_helper(struct net_device *dev)
@@ -3,11 +3,10 @@
 #include <string.h>
 
 #include "util.h"
+#include "pbuf.h"
 #include "ip.h"
 #include "icmp.h"
 
-#define ICMP_BUFSIZ IP_PAYLOAD_SIZE_MAX
-
 struct icmp_hdr
 {
   uint8_t type;
@@ -86,13 +85,14 @@ icmp_dump(const uint8_t *data, size_t len)
   funlockfile(stderr);
 }
 
-// data is ip payload (except header)
-// len is length of icmp data
-void icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+// pb->data is ip payload (except header)
+void icmp_input(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
   struct icmp_hdr *hdr;
   char addr1[IP_ADDR_STR_LEN];
   char addr2[IP_ADDR_STR_LEN];
+  const uint8_t *data = pb->data;
+  size_t len = pb->len;
 
   if (len < sizeof(*hdr))
   {
@@ -123,26 +123,35 @@ void icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, s
 
 int icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
 {
-  uint8_t buf[ICMP_BUFSIZ];
+  struct pbuf *pb;
   struct icmp_hdr *hdr;
   size_t msg_len;
   char addr1[IP_ADDR_STR_LEN];
   char addr2[IP_ADDR_STR_LEN];
+  int ret;
 
-  hdr = (struct icmp_hdr *)buf;
+  pb = pbuf_alloc(PBUF_HEADROOM, len);
+  if (!pb)
+  {
+    errorf("pbuf_alloc() failure");
+    return -1;
+  }
+  memcpy(pb->data, data, len);
+  hdr = (struct icmp_hdr *)pbuf_push(pb, sizeof(*hdr));
   hdr->type = type;
   hdr->code = code;
   hdr->sum = 0;
   hdr->values = values;
-  memcpy(hdr + 1, data, len);
-  msg_len = sizeof(*hdr) + len;
+  msg_len = pb->len;
   hdr->sum = cksum16((uint16_t *)hdr, msg_len, 0);
   debugf("%s => %s, type=%s(%u), len=%zu",
          ip_addr_ntop(src, addr1, sizeof(addr1)),
          ip_addr_ntop(dst, addr2, sizeof(addr2)),
          icmp_type_ntoa(hdr->type), hdr->type, msg_len);
   icmp_dump((uint8_t *)hdr, msg_len);
-  return ip_output(IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, src, dst);
+  ret = ip_output_pbuf(IP_PROTOCOL_ICMP, pb, src, dst);
+  pbuf_free(pb);
+  return ret;
 }
 
 int icmp_init(void)
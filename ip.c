@@ -8,6 +8,7 @@
 #include "util.h"
 #include "arp.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ip.h"
 
 struct ip_hdr
@@ -30,7 +31,7 @@ struct ip_protocol
 {
   struct ip_protocol *next;
   uint8_t type;
-  void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+  void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
 };
 
 struct ip_route
@@ -309,7 +310,7 @@ ip_iface_select(ip_addr_t addr)
 }
 
 /* NOTE: must not be call after net_run() */
-int ip_protocol_register(uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
+int ip_protocol_register(uint8_t type, void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
 {
   struct ip_protocol *entry;
 
@@ -338,18 +339,52 @@ int ip_protocol_register(uint8_t type, void (*handler)(const uint8_t *data, size
   return 0;
 }
 
+// hash of the flow (addresses and TCP/UDP ports) the packet belongs to, pb->data is ip header
+uint32_t
+ip_flow_hash(const struct pbuf *pb)
+{
+  /* the well-known default RSS key, which spreads ports well */
+  static const uint8_t key[40] = {
+      0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+      0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+      0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+      0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa};
+  struct ip_hdr *hdr;
+  uint8_t tuple[12]; /* src, dst, sport, dport */
+  size_t len = 8;
+  uint16_t hlen;
+
+  if (pb->len < IP_HDR_SIZE_MIN)
+  {
+    return 0;
+  }
+  hdr = (struct ip_hdr *)pb->data;
+  memcpy(tuple, &hdr->src, 4);
+  memcpy(tuple + 4, &hdr->dst, 4);
+  hlen = (hdr->vhl & 0x0f) << 2;
+  if ((hdr->protocol == IP_PROTOCOL_TCP || hdr->protocol == IP_PROTOCOL_UDP) &&
+      !(ntoh16(hdr->offset) & 0x3fff) && pb->len >= (size_t)hlen + 4)
+  {
+    /* both TCP and UDP header begin with source and destination port */
+    memcpy(tuple + 8, pb->data + hlen, 4);
+    len = 12;
+  }
+  return toeplitz_hash(key, sizeof(key), tuple, len);
+}
+
 // ip input handler, this called when recieve packet from net device
-// data is uint8_t data[], data is ip header and payload
-// len is net_protocol_queue_entry.len
+// pb->data is ip header and payload
 // dev is device recieved packet
 static void
-ip_input(const uint8_t data[], size_t len, struct net_device *dev)
+ip_input(struct pbuf *pb, struct net_device *dev)
 {
   struct ip_hdr *hdr;
   uint8_t v;
   uint16_t hlen, total, offset;
   struct ip_iface *iface;
   char addr[IP_ADDR_STR_LEN];
+  const uint8_t *data = pb->data;
+  size_t len = pb->len;
 
   if (len < IP_HDR_SIZE_MIN)
   {
@@ -411,7 +446,10 @@ ip_input(const uint8_t data[], size_t len, struct net_device *dev)
   {
     if (entry->type == hdr->protocol)
     {
-      entry->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
+      // strip the header and the trailing padding of link layer in place
+      pbuf_trim(pb, total);
+      pbuf_pull(pb, hlen);
+      entry->handler(pb, hdr->src, hdr->dst, iface);
       return;
     }
   }
@@ -419,10 +457,9 @@ ip_input(const uint8_t data[], size_t len, struct net_device *dev)
   /* unsupported protocol*/
 }
 
-// data is ip header + payload
-// len is total length of ip packet
+// pb->data is ip header + payload
 static int
-ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst)
+ip_output_device(struct ip_iface *iface, struct pbuf *pb, ip_addr_t dst)
 {
   uint8_t hwaddr[NET_DEVICE_ADDR_LEN];
   int ret;
@@ -444,28 +481,31 @@ ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_add
     }
   }
   debugf("ip output device done");
-  return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
+  return net_device_output_pbuf(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, pb, hwaddr);
 }
 
 // protocol is IP(1)
-// data is payload(start from offset)
-// len is sizeof(data)
+// pb->data is payload, the header is prepended in place
 // id is identification
 // offset is Fragment offset(at first 0)
 static ssize_t
-ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
+ip_output_core(struct ip_iface *iface, uint8_t protocol, struct pbuf *pb, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
 {
-  uint8_t buf[IP_TOTAL_SIZE_MAX]; // header + payload
   struct ip_hdr *hdr;
   uint16_t hlen, total;
   char addr[IP_ADDR_STR_LEN];
 
-  hdr = (struct ip_hdr *)buf;
-
   hlen = IP_HDR_SIZE_MIN;
+  hdr = (struct ip_hdr *)pbuf_push(pb, hlen);
+  if (!hdr)
+  {
+    errorf("pbuf_push() failure");
+    return -1;
+  }
+
   hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
   hdr->tos = 0;
-  total = hlen + len; // header + payload
+  total = pb->len; // header + payload
 
   // only translate multi bytes fields order
   // don't reorder IP Header entirely
@@ -479,13 +519,11 @@ ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, si
   hdr->src = src;
   hdr->dst = dst;
   hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
-  memcpy(hdr + 1, data, len); // add payload to right behind header
 
   debugf("dev=%s, dst=%s, protocol=%u, len=%u",
          NET_IFACE(iface)->dev->name, ip_addr_ntop(dst, addr, sizeof(addr)), protocol, total);
-  ip_dump(buf, total);
-  // buf's stack memory release when done ip_output_device
-  return ip_output_device(iface, buf, total, nexthop);
+  ip_dump(pb->data, total);
+  return ip_output_device(iface, pb, nexthop);
 }
 
 static uint16_t
@@ -501,16 +539,17 @@ ip_generate_id(void)
 }
 
 // protocol is IP(1)
-// data is payload(start from offset)
-// len is sizeof(data)
+// pb->data is payload, headroom must be left for the IP and link layer headers
+// NOTE: the caller keeps its reference of pb
 ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+ip_output_pbuf(uint8_t protocol, struct pbuf *pb, ip_addr_t src, ip_addr_t dst)
 {
   struct ip_route *route;
   struct ip_iface *iface;
   char addr[IP_ADDR_STR_LEN];
   ip_addr_t nexthop;
   uint16_t id;
+  size_t len;
 
   if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST)
   {
@@ -533,6 +572,7 @@ ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_a
   }
   // nexthop is not equal to dest of ip header
   nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
+  len = pb->len;
   if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len)
   {
     errorf("too long, dev=%s, mtu=%u < %zu",
@@ -540,7 +580,7 @@ ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_a
     return -1;
   }
   id = ip_generate_id();
-  if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1)
+  if (ip_output_core(iface, protocol, pb, iface->unicast, dst, nexthop, id, 0) == -1)
   {
     errorf("ip_output_core() failed");
     return -1;
@@ -548,6 +588,27 @@ ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_a
   return len;
 }
 
+// protocol is IP(1)
+// data is payload(start from offset)
+// len is sizeof(data)
+ssize_t
+ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+{
+  struct pbuf *pb;
+  ssize_t ret;
+
+  pb = pbuf_alloc(PBUF_HEADROOM, len);
+  if (!pb)
+  {
+    errorf("pbuf_alloc() failure");
+    return -1;
+  }
+  memcpy(pb->data, data, len);
+  ret = ip_output_pbuf(protocol, pb, src, dst);
+  pbuf_free(pb);
+  return ret;
+}
+
 // register protocol(net.c) to ip handler
 int ip_init(void)
 {
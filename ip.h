@@ -72,9 +72,14 @@ ip_iface_select(ip_addr_t addr);
 
 extern ssize_t
 ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+extern ssize_t
+ip_output_pbuf(uint8_t protocol, struct pbuf *pb, ip_addr_t src, ip_addr_t dst);
+
+extern uint32_t
+ip_flow_hash(const struct pbuf *pb);
 
 extern int
-ip_protocol_register(uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+ip_protocol_register(uint8_t type, void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
 
 extern int
 ip_init(void);
@@ -2,37 +2,56 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "net.h"
+#include "pbuf.h"
 #include "arp.h"
 #include "ip.h"
 #include "util.h"
 #include "platform/linux/platform.h"
 
+#define NET_PROTOCOL_QUEUE_SIZE 1024 /* must be a power of two */
+#define NET_SOFTIRQ_BATCH 32
+#define NET_BUSY_POLL_BUDGET 8
+
+#ifndef NET_WORKERS
+#define NET_WORKERS 0 /* 0: protocols are processed in the softirq (interrupt thread) */
+#endif
+#define NET_WORKERS_MAX 64
+#define NET_WORKER_QUEUE_SIZE 1024 /* must be a power of two */
+
+#define NET_TIMER_WHEEL_BITS 6
+#define NET_TIMER_WHEEL_SIZE (1 << NET_TIMER_WHEEL_BITS)
+#define NET_TIMER_WHEEL_MASK (NET_TIMER_WHEEL_SIZE - 1)
+#define NET_TIMER_WHEEL_LEVELS 4 /* 1ms resolution, up to 2^24 ms (about 4.6 hours) */
+#define NET_TIMER_WHEEL_RANGE(n) ((uint64_t)1 << (NET_TIMER_WHEEL_BITS * ((n) + 1)))
+
 // represents Layer3 protocols which be needed to be handled by NIC
 // this has handler, input queue(buffer), protocol type
 struct net_protocol
 {
   struct net_protocol *next; // next protocol
   uint16_t type;
-  struct queue_head queue;                                                  /* input queue */
-  void (*handler)(const uint8_t *data, size_t len, struct net_device *dev); // uint8 data[]は暗黙的にuint8_t *にキャストされる
+  struct ring *queue; /* input queue (struct pbuf), multiple devices may produce */
+  void (*handler)(struct pbuf *pb, struct net_device *dev);
 };
 
-// data which included metadata pushed protocol's input queue
-struct net_protocol_queue_entry
+/* hierarchical timing wheel, level n has slots of 64^n ticks */
+struct net_timer_wheel
 {
-  struct net_device *dev;
-  size_t len;
-  uint8_t data[];
+  mutex_t mutex;
+  uint64_t base; /* clock (msec) at tick 0 */
+  uint64_t tick; /* next tick to be processed */
+  struct net_timer *slots[NET_TIMER_WHEEL_LEVELS][NET_TIMER_WHEEL_SIZE];
 };
 
-struct net_timer
+/* periodic callback registered by net_timer_register() */
+struct net_timer_callback
 {
-  struct net_timer *next;
-  struct timeval interval;
-  struct timeval last;
+  struct net_timer timer;
   void (*handler)(void);
 };
 
@@ -43,11 +62,36 @@ struct net_event
   void *arg;
 };
 
+/* per-core protocol processing thread, every packet of a flow is dispatched to the same one */
+struct net_worker
+{
+  unsigned int index;
+  pthread_t tid;
+  struct ring *queue; /* input queue (struct pbuf) of all protocols */
+  mutex_t mutex;
+  struct sched_ctx ctx;
+  int sleeping;
+  int terminate;
+};
+
 static struct net_device *devices;     // list of devices to be controlled
 static struct net_protocol *protocols; // list of protocols to be controlled
-static struct net_timer *timers;
+static struct net_timer_wheel wheel = {.mutex = MUTEX_INITIALIZER};
 static struct net_event *events;
 
+static mutex_t softirq_mutex = MUTEX_INITIALIZER; /* the protocol queues have a single consumer at a time */
+
+static struct net_worker workers[NET_WORKERS_MAX];
+static unsigned int worker_num = NET_WORKERS;
+
+/* notifications deferred until the end of an input batch (of the calling thread) */
+static __thread struct
+{
+  int depth;
+  int softirq;
+  uint64_t workers; /* bitmap */
+} batch;
+
 // allocate net device memory
 struct net_device *
 net_device_alloc(void)
@@ -157,7 +201,8 @@ net_device_get_iface(struct net_device *dev, int family)
 
 // call net_device->ops->transmit(...) to transmit data to specified device
 // dst is hw address
-int net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+// NOTE: the caller keeps its reference of pb
+int net_device_output_pbuf(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
   if (!NET_DEVICE_IS_UP(dev))
   {
@@ -165,22 +210,40 @@ int net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data
     return -1;
   }
 
-  if (len > dev->mtu)
+  if (pb->len > dev->mtu)
   {
-    errorf("too long, dev=%s mtu=%u, len=%zu", dev->name, dev->mtu, len);
+    errorf("too long, dev=%s mtu=%u, len=%zu", dev->name, dev->mtu, pb->len);
   }
-  debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, len);
-  debugdump(data, len);
-  if (dev->ops->transmit(dev, type, data, len, dst) == -1)
+  debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, pb->len);
+  debugdump(pb->data, pb->len);
+  if (dev->ops->transmit(dev, type, pb, dst) == -1)
   {
-    errorf("device transmit failed, dev=%s, len=%zu", dev->name, len);
+    errorf("device transmit failed, dev=%s, len=%zu", dev->name, pb->len);
     return -1;
   }
   return 0;
 }
 
+// copy data into a packet buffer and transmit it
+int net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+{
+  struct pbuf *pb;
+  int ret;
+
+  pb = pbuf_alloc(PBUF_HEADROOM, len);
+  if (!pb)
+  {
+    errorf("pbuf_alloc() failure");
+    return -1;
+  }
+  memcpy(pb->data, data, len);
+  ret = net_device_output_pbuf(dev, type, pb, dst);
+  pbuf_free(pb);
+  return ret;
+}
+
 /* NOTE: must not be call after net_run() */
-int net_protocol_register(uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev))
+int net_protocol_register(uint16_t type, void (*handler)(struct pbuf *pb, struct net_device *dev))
 {
   struct net_protocol *proto;
 
@@ -198,6 +261,13 @@ int net_protocol_register(uint16_t type, void (*handler)(const uint8_t *data, si
     errorf("memory_alloc() failed");
     return -1;
   }
+  proto->queue = ring_alloc(NET_PROTOCOL_QUEUE_SIZE);
+  if (!proto->queue)
+  {
+    errorf("ring_alloc() failed");
+    memory_free(proto);
+    return -1;
+  }
   proto->type = type;
   proto->handler = handler;
   proto->next = protocols;
@@ -206,109 +276,553 @@ int net_protocol_register(uint16_t type, void (*handler)(const uint8_t *data, si
   return 0;
 }
 
-/* NOTE: must not be call after net_run() */
+/*
+ * Timer
+ *
+ * O(1) arm/cancel/expire with a hierarchical timing wheel (1 tick = 1ms).
+ */
+
+static uint64_t
+net_timer_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// current tick (msec), the same clock as the expiration of timers
+uint64_t
+net_timer_now(void)
+{
+  return net_timer_clock() - wheel.base;
+}
+
+/* NOTE: must be called after wheel.mutex locked */
+static void
+net_timer_link(struct net_timer *timer)
+{
+  struct net_timer **slot;
+  uint64_t delta;
+  int level;
+
+  if (timer->expire < wheel.tick)
+  {
+    timer->expire = wheel.tick; /* already expired, run on the next tick */
+  }
+  delta = timer->expire - wheel.tick;
+  if (delta >= NET_TIMER_WHEEL_RANGE(NET_TIMER_WHEEL_LEVELS - 1))
+  {
+    delta = NET_TIMER_WHEEL_RANGE(NET_TIMER_WHEEL_LEVELS - 1) - 1;
+    timer->expire = wheel.tick + delta;
+  }
+  for (level = 0; delta >= NET_TIMER_WHEEL_RANGE(level); level++)
+    ;
+  slot = &wheel.slots[level][(timer->expire >> (NET_TIMER_WHEEL_BITS * level)) & NET_TIMER_WHEEL_MASK];
+  timer->next = *slot;
+  if (timer->next)
+  {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+/* NOTE: must be called after wheel.mutex locked */
+static void
+net_timer_unlink(struct net_timer *timer)
+{
+  if (!timer->pprev)
+  {
+    return;
+  }
+  *timer->pprev = timer->next;
+  if (timer->next)
+  {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+void net_timer_init(struct net_timer *timer, void (*handler)(struct net_timer *timer, void *arg), void *arg)
+{
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expire = 0;
+  timer->interval = 0;
+  timer->handler = handler;
+  timer->arg = arg;
+}
+
+// (re)arm the timer to expire after msec, and every interval msec after that (0: one-shot)
+// returns 1 if it was already armed (i.e. the pending expiration is replaced), otherwise 0
+int net_timer_arm(struct net_timer *timer, unsigned int msec, unsigned int interval)
+{
+  uint64_t now;
+  int pending;
+
+  now = net_timer_now();
+  mutex_lock(&wheel.mutex);
+  pending = timer->pprev != NULL;
+  net_timer_unlink(timer);
+  timer->expire = now + msec;
+  timer->interval = interval;
+  net_timer_link(timer);
+  mutex_unlock(&wheel.mutex);
+  return pending;
+}
+
+/* returns 1 if the pending expiration is cancelled, otherwise 0 */
+/* NOTE: the handler may be running on the interrupt thread when this returns */
+int net_timer_cancel(struct net_timer *timer)
+{
+  int pending;
+
+  mutex_lock(&wheel.mutex);
+  pending = timer->pprev != NULL;
+  net_timer_unlink(timer);
+  mutex_unlock(&wheel.mutex);
+  return pending;
+}
+
+int net_timer_pending(struct net_timer *timer)
+{
+  int pending;
+
+  mutex_lock(&wheel.mutex);
+  pending = timer->pprev != NULL;
+  mutex_unlock(&wheel.mutex);
+  return pending;
+}
+
+/* NOTE: must be called after wheel.mutex locked */
+static void
+net_timer_cascade(int level)
+{
+  struct net_timer *timer, *next;
+  struct net_timer **slot;
+
+  slot = &wheel.slots[level][(wheel.tick >> (NET_TIMER_WHEEL_BITS * level)) & NET_TIMER_WHEEL_MASK];
+  timer = *slot;
+  *slot = NULL;
+  for (; timer; timer = next)
+  {
+    next = timer->next;
+    net_timer_link(timer); /* goes down to a lower level */
+  }
+}
+
+static void
+net_timer_callback(struct net_timer *timer, void *arg)
+{
+  ((struct net_timer_callback *)arg)->handler();
+}
+
 int net_timer_register(struct timeval interval, void (*handler)(void))
 {
-  struct net_timer *timer;
+  struct net_timer_callback *cb;
+  unsigned int msec;
 
-  timer = memory_alloc(sizeof(*timer));
-  if (!timer)
+  cb = memory_alloc(sizeof(*cb));
+  if (!cb)
   {
     errorf("memory_alloc() failure");
     return -1;
   }
-  timer->interval = interval;
-  gettimeofday(&timer->last, NULL);
-  timer->handler = handler;
-  timer->next = timers;
-  timers = timer;
+  cb->handler = handler;
+  msec = MAX(interval.tv_sec * 1000 + interval.tv_usec / 1000, 1);
+  net_timer_init(&cb->timer, net_timer_callback, cb);
+  net_timer_arm(&cb->timer, msec, msec);
   infof("registered: interval={%ld, %ld}", interval.tv_sec, interval.tv_usec);
   return 0;
 }
 
+// advance the wheel to the current time and run the expired timers
 int net_timer_handler(void)
 {
-  struct net_timer *timer;
-  struct timeval now, diff;
-
-  for (timer = timers; timer; timer = timer->next)
+  uint64_t now;
+  struct net_timer *timer, *expired;
+  struct net_timer **slot;
+  int level;
+
+  now = net_timer_now();
+  mutex_lock(&wheel.mutex);
+  while (wheel.tick <= now)
   {
-    gettimeofday(&now, NULL);
-    timersub(&now, &timer->last, &diff);
-    if (timercmp(&timer->interval, &diff, <) != 0)
-    { /* true (!0) or false (0) */
-      timer->handler();
-      timer->last = now;
+    for (level = 1; level < NET_TIMER_WHEEL_LEVELS; level++)
+    {
+      /* the lower level has gone around, bring down the timers of the next slot */
+      if (wheel.tick & ((uint64_t)NET_TIMER_WHEEL_RANGE(level - 1) - 1))
+      {
+        break;
+      }
+      net_timer_cascade(level);
+    }
+    /* detach the expired ones first, timers armed by the handlers go to later ticks */
+    slot = &wheel.slots[0][wheel.tick & NET_TIMER_WHEEL_MASK];
+    expired = *slot;
+    *slot = NULL;
+    if (expired)
+    {
+      expired->pprev = &expired;
+    }
+    wheel.tick++;
+    while ((timer = expired))
+    {
+      net_timer_unlink(timer);
+      if (timer->interval)
+      {
+        /* re-armed before the call, the handler can still cancel or re-arm it */
+        timer->expire += timer->interval;
+        net_timer_link(timer);
+      }
+      mutex_unlock(&wheel.mutex);
+      timer->handler(timer, timer->arg);
+      mutex_lock(&wheel.mutex);
     }
   }
+  mutex_unlock(&wheel.mutex);
   return 0;
 }
 
-// handler which called when net device recieved packet and interruptted by signal(imitate hardware interruption)
-int net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+static struct net_protocol *
+net_protocol_lookup(uint16_t type)
 {
   struct net_protocol *proto;
-  struct net_protocol_queue_entry *entry;
 
   for (proto = protocols; proto; proto = proto->next)
   {
     if (proto->type == type)
     {
-      // need to allocate struct + variable-length data size
-      entry = memory_alloc(sizeof(*entry) + len);
-      if (!entry)
-      {
-        errorf("memory_alloc() failed");
-        return -1;
-      }
+      return proto;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Worker (software RSS)
+ */
+
+static struct net_worker *
+net_worker_select(struct pbuf *pb)
+{
+  uint32_t hash = 0;
 
-      entry->dev = dev;
-      entry->len = len;
-      memcpy(entry->data, data, len);
+  if (pb->type == NET_PROTOCOL_TYPE_IP)
+  {
+    hash = ip_flow_hash(pb);
+  }
+  /* non-IP (e.g. ARP) always goes to the first worker */
+  return &workers[hash % worker_num];
+}
+
+static void
+net_worker_wakeup(struct net_worker *worker)
+{
+  /* pairs with the fence in net_worker_thread(), either sees the other's store */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&worker->sleeping, __ATOMIC_RELAXED))
+  {
+    mutex_lock(&worker->mutex);
+    worker->sleeping = 0;
+    sched_wakeup(&worker->ctx);
+    mutex_unlock(&worker->mutex);
+  }
+}
+
+static void *
+net_worker_thread(void *arg)
+{
+  struct net_worker *worker;
+  struct net_protocol *proto;
+  struct pbuf *pbs[NET_SOFTIRQ_BATCH];
+  unsigned int num, i;
 
-      if (!queue_push(&proto->queue, entry))
+  worker = (struct net_worker *)arg;
+  debugf("start..., worker=%u", worker->index);
+  while (!__atomic_load_n(&worker->terminate, __ATOMIC_ACQUIRE))
+  {
+    num = ring_dequeue_burst(worker->queue, (void **)pbs, countof(pbs));
+    if (!num)
+    {
+      mutex_lock(&worker->mutex);
+      __atomic_store_n(&worker->sleeping, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      while (worker->sleeping && !ring_count(worker->queue) && !worker->terminate)
       {
-        errorf("queue_push() failed");
-        memory_free(entry);
-        return -1;
+        sched_sleep(&worker->ctx, &worker->mutex, NULL);
       }
+      worker->sleeping = 0;
+      mutex_unlock(&worker->mutex);
+      continue;
+    }
+    for (i = 0; i < num; i++)
+    {
+      proto = net_protocol_lookup(pbs[i]->type);
+      if (proto)
+      {
+        proto->handler(pbs[i], pbs[i]->dev);
+      }
+      pbuf_free(pbs[i]);
+    }
+  }
+  /* discard the packets left behind */
+  while ((num = ring_dequeue_burst(worker->queue, (void **)pbs, countof(pbs))))
+  {
+    for (i = 0; i < num; i++)
+    {
+      pbuf_free(pbs[i]);
+    }
+  }
+  debugf("terminated, worker=%u", worker->index);
+  return NULL;
+}
+
+/* NOTE: must not be call after net_run() */
+int net_worker_setup(unsigned int num)
+{
+  if (num > NET_WORKERS_MAX)
+  {
+    errorf("too many workers, num=%u, max=%u", num, NET_WORKERS_MAX);
+    return -1;
+  }
+  worker_num = num;
+  return 0;
+}
+
+static int
+net_worker_run(void)
+{
+  struct net_worker *worker;
+  int err;
+
+  for (worker = workers; worker < workers + worker_num; worker++)
+  {
+    worker->index = indexof(workers, worker);
+    worker->queue = ring_alloc(NET_WORKER_QUEUE_SIZE);
+    if (!worker->queue)
+    {
+      errorf("ring_alloc() failure");
+      return -1;
+    }
+    mutex_init(&worker->mutex);
+    sched_ctx_init(&worker->ctx);
+    err = pthread_create(&worker->tid, NULL, net_worker_thread, worker);
+    if (err)
+    {
+      errorf("pthread_create() %s", strerror(err));
+      ring_free(worker->queue);
+      worker->queue = NULL;
+      return -1;
+    }
+  }
+  infof("running, workers=%u", worker_num);
+  return 0;
+}
+
+static void
+net_worker_shutdown(void)
+{
+  struct net_worker *worker;
+
+  for (worker = workers; worker < workers + worker_num; worker++)
+  {
+    if (!worker->queue)
+    {
+      break;
+    }
+    mutex_lock(&worker->mutex);
+    __atomic_store_n(&worker->terminate, 1, __ATOMIC_RELEASE);
+    sched_wakeup(&worker->ctx);
+    mutex_unlock(&worker->mutex);
+    pthread_join(worker->tid, NULL);
+    ring_free(worker->queue);
+    worker->queue = NULL;
+  }
+}
+
+// handler which called when net device recieved packet and interruptted by signal(imitate hardware interruption)
+// NOTE: the packet buffer is queued without copy, the caller keeps its reference of pb
+int net_input_handler(uint16_t type, struct pbuf *pb, struct net_device *dev)
+{
+  struct net_protocol *proto;
+  struct net_worker *worker;
 
-      debugf("protocol queue pushed ()num:%u. dev=%s, type=0x%04x, len=%zu",
-             proto->queue.num, dev->name, type, len);
-      debugdump(data, len);
-      intr_raise_irq(INTR_IRQ_SOFTIRQ);
+  proto = net_protocol_lookup(type);
+  if (!proto)
+  {
+    /* unsupported protocl */
+    return 0;
+  }
+  pb->dev = dev;
+  pb->type = type;
+  if (worker_num)
+  {
+    worker = net_worker_select(pb);
+    if (ring_enqueue(worker->queue, pbuf_ref(pb)) == -1)
+    {
+      errorf("queue is full, dev=%s, type=0x%04x, worker=%u", dev->name, type, worker->index);
+      pbuf_free(pb);
+      return -1;
+    }
+    debugf("worker queue pushed (num:%u), dev=%s, type=0x%04x, len=%zu, worker=%u",
+           ring_count(worker->queue), dev->name, type, pb->len, worker->index);
+    if (batch.depth)
+    {
+      batch.workers |= (uint64_t)1 << worker->index;
       return 0;
     }
+    net_worker_wakeup(worker);
+    return 0;
+  }
+  if (ring_enqueue(proto->queue, pbuf_ref(pb)) == -1)
+  {
+    errorf("queue is full, dev=%s, type=0x%04x", dev->name, type);
+    pbuf_free(pb);
+    return -1;
   }
-  /* unsupported protocl */
+
+  debugf("protocol queue pushed ()num:%u. dev=%s, type=0x%04x, len=%zu",
+         ring_count(proto->queue), dev->name, type, pb->len);
+  debugdump(pb->data, pb->len);
+  if (batch.depth)
+  {
+    batch.softirq = 1;
+    return 0;
+  }
+  intr_raise_irq(INTR_IRQ_SOFTIRQ);
   return 0;
 }
 
+// packets input until net_input_batch_end() are handed to the protocols with a single notification
+void net_input_batch_begin(void)
+{
+  batch.depth++;
+}
+
+void net_input_batch_end(void)
+{
+  unsigned int i;
+
+  if (--batch.depth)
+  {
+    return;
+  }
+  for (i = 0; batch.workers; i++)
+  {
+    if (batch.workers & ((uint64_t)1 << i))
+    {
+      batch.workers &= ~((uint64_t)1 << i);
+      net_worker_wakeup(&workers[i]);
+    }
+  }
+  if (batch.softirq)
+  {
+    batch.softirq = 0;
+    intr_raise_irq(INTR_IRQ_SOFTIRQ);
+  }
+}
+
 // handler which called when recieved software irq
 // this func convey data to protocol handler
-int net_softirq_handler(void)
+/* NOTE: must be called after softirq_mutex locked */
+static void
+net_softirq_process(void)
 {
   struct net_protocol *proto;
-  struct net_protocol_queue_entry *entry;
+  struct pbuf *pbs[NET_SOFTIRQ_BATCH];
+  unsigned int num, i;
 
   for (proto = protocols; proto; proto = proto->next)
   {
     while (1)
     {
-      entry = queue_pop(&proto->queue);
-      if (!entry)
+      num = ring_dequeue_burst(proto->queue, (void **)pbs, countof(pbs));
+      if (!num)
       {
         break;
       }
-      debugf("protocol queue popped (num:%u), dev=%s, type=0x%04x len=%zu", proto->queue.num, entry->dev->name, proto->type, entry->len);
-      debugdump(entry->data, entry->len);
-      proto->handler(entry->data, entry->len, entry->dev);
-      memory_free(entry);
+      for (i = 0; i < num; i++)
+      {
+        debugf("protocol queue popped (num:%u), dev=%s, type=0x%04x len=%zu", ring_count(proto->queue), pbs[i]->dev->name, proto->type, pbs[i]->len);
+        debugdump(pbs[i]->data, pbs[i]->len);
+        proto->handler(pbs[i], pbs[i]->dev);
+        pbuf_free(pbs[i]);
+      }
     }
   }
+}
+
+int net_softirq_handler(void)
+{
+  mutex_lock(&softirq_mutex);
+  net_softirq_process();
+  mutex_unlock(&softirq_mutex);
   return 0;
 }
 
+/*
+ * poll the devices and run the protocol input in the calling thread (busy polling)
+ * returns the number of frames input
+ *
+ * NOTE: with the workers, the protocol input still runs on them
+ */
+int net_busy_poll(void)
+{
+  struct net_device *dev;
+  int num = 0, ret;
+
+  net_input_batch_begin();
+  for (dev = devices; dev; dev = dev->next)
+  {
+    if (NET_DEVICE_IS_UP(dev) && dev->ops->poll)
+    {
+      ret = dev->ops->poll(dev, NET_BUSY_POLL_BUDGET);
+      if (ret > 0)
+      {
+        num += ret;
+      }
+    }
+  }
+  if (!worker_num && mutex_trylock(&softirq_mutex) == 0)
+  {
+    batch.softirq = 0; /* no need to raise, processed right here */
+    net_softirq_process();
+    mutex_unlock(&softirq_mutex);
+  }
+  net_input_batch_end();
+  return num;
+}
+
+/*
+ * busy polling for up to usec until cond(arg) gets true, returns whether it got true
+ * NOTE: must be called after mutex (which protects cond) locked, it is released while polling
+ */
+int net_busy_wait(unsigned int usec, mutex_t *mutex, int (*cond)(void *arg), void *arg)
+{
+  struct timeval now, deadline;
+
+  gettimeofday(&deadline, NULL);
+  timeval_add_usec(&deadline, usec);
+  while (!cond(arg))
+  {
+    gettimeofday(&now, NULL);
+    if (!timercmp(&now, &deadline, <))
+    {
+      return 0;
+    }
+    mutex_unlock(mutex);
+    if (!net_busy_poll())
+    {
+      sched_yield(); /* let the interrupt thread run (e.g. loopback) */
+    }
+    mutex_lock(mutex);
+  }
+  return 1;
+}
+
 /*
   NOTE: must not be call after net_run()
   alloc and register net event
@@ -355,6 +869,13 @@ int net_run(void)
     errorf("intr_run() failed");
     return -1;
   }
+  /* started after intr_run() to inherit the signal mask of the interrupt emulation */
+  if (net_worker_run() == -1)
+  {
+    errorf("net_worker_run() failure");
+    net_worker_shutdown();
+    return -1;
+  }
 
   debugf("open all devices...");
   for (dev = devices; dev; dev = dev->next)
@@ -375,12 +896,15 @@ void net_shutdown(void)
     net_device_close(dev);
   }
   intr_shutdown();
+  net_worker_shutdown();
+  memory_dump();
   debugf("shutting down");
 }
 
 // initialize entirely network device
 int net_init(void)
 {
+  wheel.base = net_timer_clock();
   if (intr_init() == -1)
   {
     errorf("intr_init() failed");
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <sys/time.h>
 
+#include "platform.h"
+
 #ifndef IFNAMSIZE
 #define IFNAMSIZE 16
 #endif
@@ -33,6 +35,8 @@
 #define NET_IFACE_FAMILY_IPV6 2
 #define NET_IFACE(x) ((struct net_iface *)(x))
 
+struct pbuf;
+
 // pseudo network device
 struct net_device
 {
@@ -60,7 +64,8 @@ struct net_device_ops
 {
   int (*open)(struct net_device *dev);
   int (*close)(struct net_device *dev);
-  int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+  int (*transmit)(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst); /* NOTE: must take its own reference to keep pb */
+  int (*poll)(struct net_device *dev, unsigned int budget);                                 /* optional, input frames in the calling thread */
 };
 
 struct net_iface
@@ -71,6 +76,22 @@ struct net_iface
   /* depends on implementation of protocols. */
 };
 
+/*
+ * Timer (embedded in the object that owns it, see net_timer_init())
+ *
+ * NOTE: handlers are called on the interrupt thread without any lock held,
+ *       a timer may be armed or cancelled from any thread (also from its handler).
+ */
+struct net_timer
+{
+  struct net_timer *next;
+  struct net_timer **pprev; /* NULL while not armed */
+  uint64_t expire;          /* tick (msec) */
+  unsigned int interval;    /* msec, 0 for one-shot */
+  void (*handler)(struct net_timer *timer, void *arg);
+  void *arg;
+};
+
 extern struct net_device *
 net_device_alloc(void);
 extern int
@@ -81,19 +102,41 @@ extern struct net_iface *
 net_device_get_iface(struct net_device *dev, int family);
 extern int
 net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+extern int
+net_device_output_pbuf(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst);
 
 extern int
-net_protocol_register(uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev));
+net_protocol_register(uint16_t type, void (*handler)(struct pbuf *pb, struct net_device *dev));
 
+extern void
+net_timer_init(struct net_timer *timer, void (*handler)(struct net_timer *timer, void *arg), void *arg);
+extern int
+net_timer_arm(struct net_timer *timer, unsigned int msec, unsigned int interval);
+extern int
+net_timer_cancel(struct net_timer *timer);
+extern int
+net_timer_pending(struct net_timer *timer);
+extern uint64_t
+net_timer_now(void);
 extern int
 net_timer_register(struct timeval interval, void (*handler)(void));
 extern int
 net_timer_handler(void);
 
 extern int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
+net_input_handler(uint16_t type, struct pbuf *pb, struct net_device *dev);
+extern void
+net_input_batch_begin(void);
+extern void
+net_input_batch_end(void);
+extern int
+net_busy_poll(void);
+extern int
+net_busy_wait(unsigned int usec, mutex_t *mutex, int (*cond)(void *arg), void *arg);
 extern int
 net_softirq_handler(void);
+extern int
+net_worker_setup(unsigned int num);
 
 extern int
 net_event_subscribe(void (*handler)(void *arg), void *arg);
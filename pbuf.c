@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "pbuf.h"
+
+struct pbuf *
+pbuf_alloc(size_t headroom, size_t len)
+{
+  struct pbuf *pb;
+  size_t size;
+
+  size = headroom + MAX(len, PBUF_DATA_MIN);
+  pb = memory_alloc_raw(sizeof(*pb) + size); /* the data area need not be zero-filled */
+  if (!pb)
+  {
+    errorf("memory_alloc_raw() failure");
+    return NULL;
+  }
+  pb->ref = 1;
+  pb->dev = NULL;
+  pb->type = 0;
+  pb->size = size;
+  pb->data = pb->buf + headroom;
+  pb->len = len;
+  return pb;
+}
+
+struct pbuf *
+pbuf_ref(struct pbuf *pb)
+{
+  __atomic_add_fetch(&pb->ref, 1, __ATOMIC_RELAXED);
+  return pb;
+}
+
+// drop a reference, the buffer is released with the last one
+void pbuf_free(struct pbuf *pb)
+{
+  if (!pb)
+  {
+    return;
+  }
+  if (__atomic_sub_fetch(&pb->ref, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    memory_free(pb);
+  }
+}
+
+// prepend len bytes (e.g. header) in front of the data
+uint8_t *
+pbuf_push(struct pbuf *pb, size_t len)
+{
+  if (PBUF_HEADROOM_LEN(pb) < len)
+  {
+    errorf("no headroom, headroom=%zu, len=%zu", PBUF_HEADROOM_LEN(pb), len);
+    return NULL;
+  }
+  pb->data -= len;
+  pb->len += len;
+  return pb->data;
+}
+
+// strip len bytes (e.g. header) from the front of the data
+uint8_t *
+pbuf_pull(struct pbuf *pb, size_t len)
+{
+  if (pb->len < len)
+  {
+    errorf("too short, len=%zu, pull=%zu", pb->len, len);
+    return NULL;
+  }
+  pb->data += len;
+  pb->len -= len;
+  return pb->data;
+}
+
+// append len bytes to the tail of the data, returns the head of appended area
+uint8_t *
+pbuf_put(struct pbuf *pb, size_t len)
+{
+  uint8_t *tail;
+
+  if (PBUF_TAILROOM_LEN(pb) < len)
+  {
+    errorf("no tailroom, tailroom=%zu, len=%zu", PBUF_TAILROOM_LEN(pb), len);
+    return NULL;
+  }
+  tail = pb->data + pb->len;
+  pb->len += len;
+  return tail;
+}
+
+// cut the data off at len bytes (e.g. trailing padding)
+int pbuf_trim(struct pbuf *pb, size_t len)
+{
+  if (pb->len < len)
+  {
+    return -1;
+  }
+  pb->len = len;
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef PBUF_H
+#define PBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+struct net_device;
+
+/* enough for link (14) + IP (20) + TCP with options (60) headers */
+#define PBUF_HEADROOM 128
+/* small buffers always get room for the minimum link-layer frame (padding) */
+#define PBUF_DATA_MIN 64
+
+/*
+ * Packet buffer
+ *
+ * Reference counted buffer with reserved headroom. Each layer prepends (pbuf_push)
+ * or strips (pbuf_pull) its header in place, so the payload is copied only once.
+ *
+ * NOTE: whoever holds a reference must release it with pbuf_free(). A callee that
+ *       wants to keep the buffer after returning must take its own reference.
+ */
+struct pbuf
+{
+  struct queue_entry link; /* for the queue of the current owner (one queue at a time) */
+  int ref;
+  struct net_device *dev; /* receiving device (input) */
+  uint16_t type;          /* protocol type (same value as the Ethernet types) */
+  size_t size;            /* capacity of buf */
+  uint8_t *data;          /* head of valid data */
+  size_t len;             /* length of valid data */
+  uint8_t buf[];
+};
+
+#define PBUF_HEADROOM_LEN(x) ((size_t)((x)->data - (x)->buf))
+#define PBUF_TAILROOM_LEN(x) ((x)->size - PBUF_HEADROOM_LEN(x) - (x)->len)
+
+extern struct pbuf *
+pbuf_alloc(size_t headroom, size_t len);
+extern struct pbuf *
+pbuf_ref(struct pbuf *pb);
+extern void
+pbuf_free(struct pbuf *pb);
+
+extern uint8_t *
+pbuf_push(struct pbuf *pb, size_t len);
+extern uint8_t *
+pbuf_pull(struct pbuf *pb, size_t len);
+extern uint8_t *
+pbuf_put(struct pbuf *pb, size_t len);
+extern int
+pbuf_trim(struct pbuf *pb, size_t len);
+
+#endif
@@ -1,4 +1,3 @@
-#define _GNU_SOURCE /* for F_SETSIG */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -24,11 +23,22 @@
 #define CLONE_DEVICE "/dev/net/tun"
 #define ETHER_TAP_IRQ (INTR_IRQ_BASE + 2)
 
+#define ETHER_TAP_BUDGET 64 /* default max frames per poll */
+#define ETHER_TAP_LOAD_SHIFT 3
+
 struct ether_tap
 {
   char name[IFNAMSIZ]; // name of TAP device
   int fd;
   unsigned int irq; // irq number
+  /* NAPI-like polling */
+  unsigned int budget;   /* max frames per poll */
+  unsigned int coalesce; /* msec to defer the next poll instead of re-enabling irq (0: disabled) */
+  int adaptive;          /* coalesce only while loaded */
+  unsigned int load;     /* moving average of frames per poll (scaled by 2^ETHER_TAP_LOAD_SHIFT) */
+  int dry;               /* no more frames in the fd (or reading it failed) */
+  struct net_timer timer;
+  mutex_t mutex; /* one poller at a time (the isr or a busy polling thread) */
 };
 
 #define PRIV(x) ((struct ether_tap *)x->priv)
@@ -72,7 +82,7 @@ ether_tap_open(struct net_device *dev)
   struct ifreq ifr = {};
 
   tap = PRIV(dev);
-  tap->fd = open(CLONE_DEVICE, O_RDWR);
+  tap->fd = open(CLONE_DEVICE, O_RDWR | O_NONBLOCK); /* frames are read until it runs dry */
   if (tap->fd == -1)
   {
     errorf("open: %s, dev=%s", strerror(errno), dev->name);
@@ -88,24 +98,10 @@ ether_tap_open(struct net_device *dev)
     close(tap->fd);
     return -1;
   }
-  /* set asynchronous I/O signal delivery destination */
-  if (fcntl(tap->fd, F_SETOWN, getpid()) == -1)
-  {
-    errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-    close(tap->fd);
-    return -1;
-  }
-  /* enable asynchronous I/O */
-  if (fcntl(tap->fd, F_SETFL, O_ASYNC) == -1)
+  /* raise irq when frames arrive (depends on the interrupt backend) */
+  if (intr_watch_fd(tap->irq, tap->fd) == -1)
   {
-    errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-    close(tap->fd);
-    return -1;
-  }
-  /* use other signal instead of SIGIO */
-  if (fcntl(tap->fd, F_SETSIG, tap->irq) == -1)
-  {
-    errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
+    errorf("intr_watch_fd() failure, dev=%s", dev->name);
     close(tap->fd);
     return -1;
   }
@@ -126,6 +122,7 @@ ether_tap_open(struct net_device *dev)
 static int
 ether_tap_close(struct net_device *dev)
 {
+  net_timer_cancel(&PRIV(dev)->timer);
   close(PRIV(dev)->fd);
   return 0;
 }
@@ -136,9 +133,9 @@ ether_tap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
   return write(PRIV(dev)->fd, frame, flen);
 }
 
-int ether_tap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+int ether_tap_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-  return ether_transmit_helper(dev, type, buf, len, dst, ether_tap_write);
+  return ether_transmit_helper(dev, type, pb, dst, ether_tap_write);
 }
 
 static ssize_t
@@ -149,15 +146,83 @@ ether_tap_read(struct net_device *dev, uint8_t *buf, size_t size)
   len = read(PRIV(dev)->fd, buf, size);
   if (len <= 0)
   {
-    if (len == -1 && errno != EINTR)
+    if (len == -1 && errno == EINTR)
     {
-      errorf("read: %s, dev=%s", strerror(errno), dev->name);
+      return -1;
     }
+    if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      errorf("read: %s, dev=%s", len ? strerror(errno) : "EOF", dev->name);
+    }
+    /* nothing more to read now (a broken fd is not retried until the next irq) */
+    PRIV(dev)->dry = 1;
     return -1;
   }
   return len;
 }
 
+// read up to budget frames, and hand them to the protocols at once (returns -1 if polled by another thread)
+static int
+ether_tap_poll_frames(struct net_device *dev, unsigned int budget, int *dry)
+{
+  struct ether_tap *tap;
+  unsigned int num = 0;
+
+  tap = PRIV(dev);
+  if (mutex_trylock(&tap->mutex) != 0)
+  {
+    return -1;
+  }
+  tap->dry = 0;
+  net_input_batch_begin();
+  while (num < budget)
+  {
+    if (ether_input_helper(dev, ether_tap_read) == -1 && tap->dry)
+    {
+      break;
+    }
+    num++;
+  }
+  net_input_batch_end();
+  *dry = tap->dry;
+  mutex_unlock(&tap->mutex);
+  return num;
+}
+
+// busy polling from a thread waiting for data
+static int
+ether_tap_poll(struct net_device *dev, unsigned int budget)
+{
+  int num, dry;
+
+  num = ether_tap_poll_frames(dev, budget, &dry);
+  if (num != -1 && !dry)
+  {
+    /* make sure the rest is not left behind once the busy polling stops */
+    intr_raise_irq(PRIV(dev)->irq);
+  }
+  return num;
+}
+
+static int
+ether_tap_readable(struct net_device *dev)
+{
+  struct pollfd pfd;
+
+  pfd.fd = PRIV(dev)->fd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) > 0;
+}
+
+static void
+ether_tap_timer(struct net_timer *timer, void *arg)
+{
+  struct net_device *dev;
+
+  dev = (struct net_device *)arg;
+  intr_raise_irq(PRIV(dev)->irq);
+}
+
 // this is called when isr signal recieved
 // irq is irq number
 // id is net_device(set when called intr.c: intr_thread())
@@ -165,31 +230,60 @@ static int
 ether_tap_isr(unsigned int irq, void *id)
 {
   struct net_device *dev;
-  struct pollfd pfd;
-  int ret;
+  struct ether_tap *tap;
+  int num, dry = 1;
 
   dev = (struct net_device *)id;
-  pfd.fd = PRIV(dev)->fd;
-  pfd.events = POLLIN;
-  while (1)
+  tap = PRIV(dev);
+  if (net_timer_pending(&tap->timer))
   {
-    ret = poll(&pfd, 1, 0);
-    if (ret == -1)
-    {
-      if (errno == EINTR)
-      {
-        continue;
-      }
-      errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-      return -1;
-    }
-    if (ret == 0)
-    {
-      // no frames to input immediately
-      break;
-    }
-    ether_input_helper(dev, ether_tap_read);
+    /* coalescing, the timer polls */
+    return 0;
+  }
+  /* no more irq while polling */
+  intr_mask_fd(tap->irq, tap->fd);
+  num = ether_tap_poll_frames(dev, tap->budget, &dry);
+  if (num != -1)
+  {
+    /* otherwise a busy polling thread is reading it, just re-enable irq below */
+    tap->load += num - (tap->load >> ETHER_TAP_LOAD_SHIFT);
+  }
+  if (!dry)
+  {
+    /* budget exhausted, poll again after the other irqs have had their turn */
+    intr_raise_irq(tap->irq);
+    return 0;
   }
+  if (tap->coalesce && (!tap->adaptive || (tap->load >> ETHER_TAP_LOAD_SHIFT) >= tap->budget / 4))
+  {
+    /* under load, let frames accumulate to poll them in a batch */
+    net_timer_arm(&tap->timer, tap->coalesce, 0);
+    return 0;
+  }
+  intr_unmask_fd(tap->irq, tap->fd);
+  if (ether_tap_readable(dev))
+  {
+    /* arrived before re-enabled */
+    intr_mask_fd(tap->irq, tap->fd);
+    intr_raise_irq(tap->irq);
+  }
+  return 0;
+}
+
+// configure the polling, budget: max frames per poll, coalesce: msec to defer polls (0: disabled)
+int ether_tap_set_coalesce(struct net_device *dev, unsigned int budget, unsigned int coalesce, int adaptive)
+{
+  struct ether_tap *tap;
+
+  if (!budget)
+  {
+    errorf("budget must be positive, dev=%s", dev->name);
+    return -1;
+  }
+  tap = PRIV(dev);
+  tap->budget = budget;
+  tap->coalesce = coalesce;
+  tap->adaptive = adaptive;
   return 0;
 }
 
@@ -197,6 +291,7 @@ static struct net_device_ops ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
     .transmit = ether_tap_transmit,
+    .poll = ether_tap_poll,
 };
 
 // generate net_device of ethernet, setup common helper parameters and driver ops
@@ -231,6 +326,9 @@ ether_tap_init(const char *name, const char *addr)
   strncpy(tap->name, name, sizeof(tap->name) - 1);
   tap->fd = -1; // invalid initial value
   tap->irq = ETHER_TAP_IRQ;
+  tap->budget = ETHER_TAP_BUDGET;
+  mutex_init(&tap->mutex);
+  net_timer_init(&tap->timer, ether_tap_timer, dev);
   dev->priv = tap; // set ether_tap struct instance to device's private area
   if (net_device_register(dev) == -1)
   {
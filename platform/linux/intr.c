@@ -1,5 +1,8 @@
+#define _GNU_SOURCE /* for F_SETSIG */
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
@@ -58,6 +61,57 @@ int intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *de
   return 0;
 }
 
+// raise irq whenever fd becomes readable (asynchronous I/O signal)
+int intr_watch_fd(unsigned int irq, int fd)
+{
+  /* set asynchronous I/O signal delivery destination */
+  if (fcntl(fd, F_SETOWN, getpid()) == -1)
+  {
+    errorf("fcntl(F_SETOWN): %s", strerror(errno));
+    return -1;
+  }
+  /* use other signal instead of SIGIO */
+  if (fcntl(fd, F_SETSIG, irq) == -1)
+  {
+    errorf("fcntl(F_SETSIG): %s", strerror(errno));
+    return -1;
+  }
+  /* enable asynchronous I/O */
+  return intr_unmask_fd(irq, fd);
+}
+
+static int
+intr_async_fd(int fd, int enable)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags == -1)
+  {
+    errorf("fcntl(F_GETFL): %s", strerror(errno));
+    return -1;
+  }
+  flags = enable ? flags | O_ASYNC : flags & ~O_ASYNC;
+  if (fcntl(fd, F_SETFL, flags) == -1)
+  {
+    errorf("fcntl(F_SETFL): %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// stop raising irq for fd (e.g. while the driver is polling it)
+int intr_mask_fd(unsigned int irq, int fd)
+{
+  return intr_async_fd(fd, 0);
+}
+
+/* NOTE: no irq for data which has arrived while masked, the caller must check it after this */
+int intr_unmask_fd(unsigned int irq, int fd)
+{
+  return intr_async_fd(fd, 1);
+}
+
 // initialize signal imitates interruption
 int intr_init(void)
 {
@@ -0,0 +1,403 @@
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "net.h"
+#include "util.h"
+#include "platform/linux/platform.h"
+
+/*
+ * Interrupt emulation (epoll backend)
+ *
+ * Same interface as the signal backend (intr.c), but the interrupt thread blocks in
+ * epoll_wait(). Raised IRQs are eventfd writes, the 1ms tick is a timerfd and device
+ * fds are watched directly, so no signal is delivered and no system call is restarted.
+ */
+
+#define INTR_EVENTS_MAX 16
+
+struct irq_entry
+{
+  struct irq_entry *next;
+  unsigned int irq;
+  int (*handler)(unsigned int irq, void *dev);
+  int flags;
+  char name[16];
+  void *dev;
+};
+
+/* something the interrupt thread waits on */
+struct irq_source
+{
+  struct irq_source *next;
+  unsigned int irq;
+  int fd;
+  int counter; /* eventfd/timerfd, must be drained on every wakeup */
+};
+
+static struct irq_entry *irqs;
+static struct irq_source *sources; /* eventfds for raising IRQs (one per number) */
+static struct irq_source *watches; /* fds watched by intr_watch_fd() */
+static mutex_t mutex = MUTEX_INITIALIZER;
+
+static int epfd = -1;
+static struct irq_source tick, terminate;
+
+static pthread_t tid;
+static pthread_barrier_t barrier;
+
+static int
+intr_source_add(struct irq_source *src, unsigned int irq, int fd, int counter)
+{
+  struct epoll_event ev = {};
+
+  src->irq = irq;
+  src->fd = fd;
+  src->counter = counter;
+  ev.events = EPOLLIN; /* level-triggered, handlers need not drain the fd completely */
+  ev.data.ptr = src;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+  {
+    errorf("epoll_ctl: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* NOTE: must be called after mutex locked */
+static struct irq_source *
+intr_source_lookup(unsigned int irq)
+{
+  struct irq_source *src;
+
+  for (src = sources; src; src = src->next)
+  {
+    if (src->irq == irq)
+    {
+      return src;
+    }
+  }
+  return NULL;
+}
+
+/* NOTE: must be called after mutex locked */
+static struct irq_source *
+intr_source_get(unsigned int irq)
+{
+  struct irq_source *src;
+  int fd;
+
+  src = intr_source_lookup(irq);
+  if (src)
+  {
+    return src;
+  }
+  src = memory_alloc(sizeof(*src));
+  if (!src)
+  {
+    errorf("memory_alloc() failure");
+    return NULL;
+  }
+  fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1)
+  {
+    errorf("eventfd: %s", strerror(errno));
+    memory_free(src);
+    return NULL;
+  }
+  if (intr_source_add(src, irq, fd, 1) == -1)
+  {
+    close(fd);
+    memory_free(src);
+    return NULL;
+  }
+  src->next = sources;
+  sources = src;
+  return src;
+}
+
+// register new irq and handler
+int intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev), int flags, const char *name, void *dev)
+{
+  struct irq_entry *entry;
+
+  debugf("irq=%u, flags=%d, name=%s", irq, flags, name);
+  for (entry = irqs; entry; entry = entry->next)
+  {
+    if (entry->irq == irq)
+    {
+      if (entry->flags ^ INTR_IRQ_SHARED || flags ^ INTR_IRQ_SHARED)
+      {
+        errorf("conflicts with already registered IRQs");
+        return -1;
+      }
+    }
+  }
+  mutex_lock(&mutex);
+  if (!intr_source_get(irq))
+  {
+    mutex_unlock(&mutex);
+    errorf("intr_source_get() failure");
+    return -1;
+  }
+  mutex_unlock(&mutex);
+  entry = memory_alloc(sizeof(*entry));
+  if (!entry)
+  {
+    errorf("memory_alloc() failed");
+    return -1;
+  }
+  entry->irq = irq;
+  entry->handler = handler;
+  entry->flags = flags;
+  strncpy(entry->name, name, sizeof(entry->name) - 1);
+  entry->dev = dev;
+  entry->next = irqs;
+  irqs = entry;
+  debugf("registered: irq=%u, name=%s", irq, name);
+  return 0;
+}
+
+// raise irq whenever fd becomes readable (the handler is responsible for reading it)
+int intr_watch_fd(unsigned int irq, int fd)
+{
+  struct irq_source *src;
+
+  src = memory_alloc(sizeof(*src));
+  if (!src)
+  {
+    errorf("memory_alloc() failure");
+    return -1;
+  }
+  if (intr_source_add(src, irq, fd, 0) == -1)
+  {
+    memory_free(src);
+    return -1;
+  }
+  /* released with the process */
+  mutex_lock(&mutex);
+  src->next = watches;
+  watches = src;
+  mutex_unlock(&mutex);
+  return 0;
+}
+
+static int
+intr_modify_fd(unsigned int irq, int fd, uint32_t events)
+{
+  struct irq_source *src;
+  struct epoll_event ev = {};
+
+  mutex_lock(&mutex);
+  for (src = watches; src; src = src->next)
+  {
+    if (src->irq == irq && src->fd == fd)
+    {
+      break;
+    }
+  }
+  mutex_unlock(&mutex);
+  if (!src)
+  {
+    errorf("not watched, irq=%u, fd=%d", irq, fd);
+    return -1;
+  }
+  ev.events = events;
+  ev.data.ptr = src;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+  {
+    errorf("epoll_ctl: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// stop raising irq for fd (e.g. while the driver is polling it)
+int intr_mask_fd(unsigned int irq, int fd)
+{
+  return intr_modify_fd(irq, fd, 0);
+}
+
+/* level-triggered, data which has arrived while masked raises irq right away */
+int intr_unmask_fd(unsigned int irq, int fd)
+{
+  return intr_modify_fd(irq, fd, EPOLLIN);
+}
+
+int intr_raise_irq(unsigned int irq)
+{
+  struct irq_source *src;
+  uint64_t val = 1;
+
+  mutex_lock(&mutex);
+  src = intr_source_lookup(irq);
+  mutex_unlock(&mutex);
+  if (!src)
+  {
+    errorf("not registered, irq=%u", irq);
+    return -1;
+  }
+  if (write(src->fd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+  {
+    errorf("write: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void
+intr_dispatch(unsigned int irq)
+{
+  struct irq_entry *entry;
+
+  if (irq == INTR_IRQ_SOFTIRQ)
+  {
+    net_softirq_handler();
+    return;
+  }
+  if (irq == INTR_IRQ_EVENT)
+  {
+    net_event_handler();
+    return;
+  }
+  for (entry = irqs; entry; entry = entry->next)
+  {
+    if (entry->irq == irq)
+    {
+      debugf("irq=%d, name=%s", entry->irq, entry->name);
+      entry->handler(entry->irq, entry->dev);
+    }
+  }
+}
+
+// func which go on another thread for waiting events
+static void *
+intr_thread(void *arg)
+{
+  struct epoll_event events[INTR_EVENTS_MAX];
+  struct irq_source *src;
+  uint64_t val;
+  int done = 0, n, i;
+
+  debugf("start...");
+  pthread_barrier_wait(&barrier);
+  while (!done)
+  {
+    n = epoll_wait(epfd, events, countof(events), -1);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      errorf("epoll_wait: %s", strerror(errno));
+      break;
+    }
+    for (i = 0; i < n; i++)
+    {
+      src = events[i].data.ptr;
+      if (src->counter)
+      {
+        /* collapse repeated raises into one call, as pending signals do */
+        if (read(src->fd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+        {
+          errorf("read: %s", strerror(errno));
+        }
+      }
+      if (src == &terminate)
+      {
+        done = 1;
+        continue;
+      }
+      if (src == &tick)
+      {
+        net_timer_handler();
+        continue;
+      }
+      intr_dispatch(src->irq);
+    }
+  }
+  debugf("terminated");
+  return NULL;
+}
+
+int intr_run(void)
+{
+  struct timespec ts = {0, 1000000}; // 1ms
+  struct itimerspec interval = {ts, ts};
+  int err;
+
+  if (timerfd_settime(tick.fd, 0, &interval, NULL) == -1)
+  {
+    errorf("timerfd_settime: %s", strerror(errno));
+    return -1;
+  }
+  err = pthread_create(&tid, NULL, intr_thread, NULL);
+  if (err)
+  {
+    errorf("pthread_create() %s", strerror(err));
+    return -1;
+  }
+  pthread_barrier_wait(&barrier);
+  return 0;
+}
+
+void intr_shutdown(void)
+{
+  uint64_t val = 1;
+
+  if (pthread_equal(tid, pthread_self()) != 0)
+  {
+    return;
+  }
+  if (write(terminate.fd, &val, sizeof(val)) == -1)
+  {
+    errorf("write: %s", strerror(errno));
+    return;
+  }
+  pthread_join(tid, NULL);
+}
+
+// initialize epoll instance imitates interrupt controller
+int intr_init(void)
+{
+  int fd;
+
+  tid = pthread_self();
+  pthread_barrier_init(&barrier, NULL, 2);
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1)
+  {
+    errorf("epoll_create1: %s", strerror(errno));
+    return -1;
+  }
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1 || intr_source_add(&tick, SIGALRM, fd, 1) == -1)
+  {
+    errorf("timerfd setup failure");
+    return -1;
+  }
+  fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1 || intr_source_add(&terminate, SIGHUP, fd, 1) == -1)
+  {
+    errorf("eventfd setup failure");
+    return -1;
+  }
+  /* software interrupts are raised through the same path as device IRQs */
+  mutex_lock(&mutex);
+  if (!intr_source_get(INTR_IRQ_SOFTIRQ) || !intr_source_get(INTR_IRQ_EVENT))
+  {
+    mutex_unlock(&mutex);
+    errorf("intr_source_get() failure");
+    return -1;
+  }
+  mutex_unlock(&mutex);
+  return 0;
+}
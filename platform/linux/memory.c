@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "platform.h"
+
+#include "util.h"
+
+/*
+ * Memory pool
+ *
+ * Fixed-size object pools per size class, each with a per-thread cache.
+ * Requests larger than the biggest class fall back to malloc().
+ */
+
+#define MEMORY_MAGIC 0x6d656d6f
+#define MEMORY_CLASS_LARGE UINT32_MAX
+
+#define MEMORY_CLASS_NUM 8
+#define MEMORY_SLAB_SIZE (64 * 1024) /* bytes carved from malloc() at once */
+#define MEMORY_CACHE_SIZE 32         /* max objects cached per thread and class */
+#define MEMORY_CACHE_BATCH (MEMORY_CACHE_SIZE / 2)
+
+/* placed right before every object, keeps the object 16 bytes aligned */
+struct memory_hdr
+{
+  uint32_t cls;
+  uint32_t magic;
+  uint64_t size; /* requested size */
+};
+
+struct memory_object
+{
+  struct memory_object *next; /* valid only while the object is free */
+};
+
+struct memory_pool
+{
+  size_t size;        /* object size (without header) */
+  unsigned int limit; /* max number of objects, allocation fails beyond it */
+  mutex_t mutex;
+  struct memory_object *free;
+  unsigned int total;  /* carved objects */
+  unsigned int used;   /* objects handed out */
+  unsigned int hwm;    /* high-water mark of used */
+  unsigned int failed; /* failures by exhaustion */
+};
+
+struct memory_cache
+{
+  int registered;
+  unsigned int num[MEMORY_CLASS_NUM];
+  struct memory_object *objs[MEMORY_CLASS_NUM][MEMORY_CACHE_SIZE];
+};
+
+static struct memory_pool pools[MEMORY_CLASS_NUM] = {
+    {.size = 32, .limit = 65536, .mutex = MUTEX_INITIALIZER},
+    {.size = 64, .limit = 65536, .mutex = MUTEX_INITIALIZER},
+    {.size = 128, .limit = 32768, .mutex = MUTEX_INITIALIZER},
+    {.size = 256, .limit = 16384, .mutex = MUTEX_INITIALIZER},
+    {.size = 512, .limit = 16384, .mutex = MUTEX_INITIALIZER},
+    {.size = 1024, .limit = 16384, .mutex = MUTEX_INITIALIZER},
+    {.size = 2048, .limit = 16384, .mutex = MUTEX_INITIALIZER}, /* e.g. pbuf of an Ethernet frame */
+    {.size = 4096, .limit = 4096, .mutex = MUTEX_INITIALIZER},
+};
+
+static struct
+{
+  unsigned int used;
+  unsigned int hwm;
+} large;
+
+static __thread struct memory_cache cache;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void
+memory_hwm_update(unsigned int *hwm, unsigned int used)
+{
+  unsigned int cur;
+
+  cur = __atomic_load_n(hwm, __ATOMIC_RELAXED);
+  while (cur < used)
+  {
+    if (__atomic_compare_exchange_n(hwm, &cur, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      break;
+    }
+  }
+}
+
+static int
+memory_class(size_t size)
+{
+  int cls;
+
+  for (cls = 0; cls < (int)countof(pools); cls++)
+  {
+    if (size <= pools[cls].size)
+    {
+      return cls;
+    }
+  }
+  return -1;
+}
+
+/* NOTE: must be called after pool->mutex locked */
+static int
+memory_pool_grow(struct memory_pool *pool, int cls)
+{
+  size_t stride;
+  unsigned int num, i;
+  uint8_t *slab;
+  struct memory_hdr *hdr;
+  struct memory_object *obj;
+
+  if (pool->total >= pool->limit)
+  {
+    return -1;
+  }
+  stride = sizeof(*hdr) + pool->size;
+  num = MIN(MAX(MEMORY_SLAB_SIZE / stride, 1), pool->limit - pool->total);
+  slab = malloc(stride * num);
+  if (!slab)
+  {
+    return -1;
+  }
+  for (i = 0; i < num; i++)
+  {
+    hdr = (struct memory_hdr *)(slab + stride * i);
+    hdr->cls = cls;
+    hdr->magic = MEMORY_MAGIC;
+    obj = (struct memory_object *)(hdr + 1);
+    obj->next = pool->free;
+    pool->free = obj;
+  }
+  pool->total += num;
+  return 0;
+}
+
+static void
+memory_cache_flush(struct memory_cache *c, int cls, unsigned int num)
+{
+  struct memory_pool *pool;
+  struct memory_object *obj;
+
+  pool = &pools[cls];
+  mutex_lock(&pool->mutex);
+  while (num-- && c->num[cls])
+  {
+    obj = c->objs[cls][--c->num[cls]];
+    obj->next = pool->free;
+    pool->free = obj;
+  }
+  mutex_unlock(&pool->mutex);
+}
+
+static void
+memory_cache_destructor(void *arg)
+{
+  struct memory_cache *c;
+  int cls;
+
+  c = (struct memory_cache *)arg;
+  for (cls = 0; cls < (int)countof(pools); cls++)
+  {
+    memory_cache_flush(c, cls, MEMORY_CACHE_SIZE);
+  }
+}
+
+static void
+memory_key_create(void)
+{
+  pthread_key_create(&key, memory_cache_destructor);
+}
+
+// return the cached objects of the exiting thread to the pools
+static void
+memory_cache_register(void)
+{
+  pthread_once(&once, memory_key_create);
+  pthread_setspecific(key, &cache);
+  cache.registered = 1;
+}
+
+static int
+memory_cache_refill(int cls)
+{
+  struct memory_pool *pool;
+  struct memory_object *obj;
+
+  pool = &pools[cls];
+  mutex_lock(&pool->mutex);
+  while (cache.num[cls] < MEMORY_CACHE_BATCH)
+  {
+    if (!pool->free && memory_pool_grow(pool, cls) == -1)
+    {
+      break;
+    }
+    obj = pool->free;
+    pool->free = obj->next;
+    cache.objs[cls][cache.num[cls]++] = obj;
+  }
+  if (!cache.num[cls])
+  {
+    pool->failed++;
+    mutex_unlock(&pool->mutex);
+    return -1;
+  }
+  mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+// allocate memory without zero-filling (for callers that initialize every field)
+void *
+memory_alloc_raw(size_t size)
+{
+  struct memory_hdr *hdr;
+  struct memory_pool *pool;
+  int cls;
+
+  cls = memory_class(size);
+  if (cls == -1)
+  {
+    hdr = malloc(sizeof(*hdr) + size);
+    if (!hdr)
+    {
+      return NULL;
+    }
+    hdr->cls = MEMORY_CLASS_LARGE;
+    hdr->magic = MEMORY_MAGIC;
+    hdr->size = size;
+    memory_hwm_update(&large.hwm, __atomic_add_fetch(&large.used, 1, __ATOMIC_RELAXED));
+    return hdr + 1;
+  }
+  if (!cache.registered)
+  {
+    memory_cache_register();
+  }
+  pool = &pools[cls];
+  if (!cache.num[cls] && memory_cache_refill(cls) == -1)
+  {
+    /* fail fast, no fallback to malloc() */
+    errorf("pool exhausted, size=%zu, limit=%u", pool->size, pool->limit);
+    return NULL;
+  }
+  hdr = (struct memory_hdr *)cache.objs[cls][--cache.num[cls]] - 1;
+  hdr->size = size;
+  memory_hwm_update(&pool->hwm, __atomic_add_fetch(&pool->used, 1, __ATOMIC_RELAXED));
+  return hdr + 1;
+}
+
+void *
+memory_alloc(size_t size)
+{
+  void *ptr;
+
+  ptr = memory_alloc_raw(size);
+  if (ptr)
+  {
+    memset(ptr, 0, size);
+  }
+  return ptr;
+}
+
+void memory_free(void *ptr)
+{
+  struct memory_hdr *hdr;
+  int cls;
+
+  if (!ptr)
+  {
+    return;
+  }
+  hdr = (struct memory_hdr *)ptr - 1;
+  if (hdr->magic != MEMORY_MAGIC)
+  {
+    errorf("invalid pointer, ptr=%p", ptr);
+    return;
+  }
+  if (hdr->cls == MEMORY_CLASS_LARGE)
+  {
+    __atomic_sub_fetch(&large.used, 1, __ATOMIC_RELAXED);
+    free(hdr);
+    return;
+  }
+  cls = hdr->cls;
+  __atomic_sub_fetch(&pools[cls].used, 1, __ATOMIC_RELAXED);
+  if (!cache.registered)
+  {
+    memory_cache_register();
+  }
+  if (cache.num[cls] == MEMORY_CACHE_SIZE)
+  {
+    memory_cache_flush(&cache, cls, MEMORY_CACHE_BATCH);
+  }
+  cache.objs[cls][cache.num[cls]++] = ptr;
+}
+
+void memory_dump(void)
+{
+  struct memory_pool *pool;
+
+  for (pool = pools; pool < tailof(pools); pool++)
+  {
+    infof("size=%zu, limit=%u, total=%u, used=%u, hwm=%u, failed=%u",
+          pool->size, pool->limit, pool->total,
+          __atomic_load_n(&pool->used, __ATOMIC_RELAXED), pool->hwm, pool->failed);
+  }
+  infof("size=large, used=%u, hwm=%u", __atomic_load_n(&large.used, __ATOMIC_RELAXED), large.hwm);
+}
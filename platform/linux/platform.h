@@ -16,17 +16,14 @@
  * Memory
  */
 
-static inline void *
-memory_alloc(size_t size)
-{
-  return calloc(1, size);
-}
-
-static inline void
-memory_free(void *ptr)
-{
-  free(ptr);
-}
+extern void *
+memory_alloc(size_t size);
+extern void *
+memory_alloc_raw(size_t size);
+extern void
+memory_free(void *ptr);
+extern void
+memory_dump(void);
 
 /*
  * Mutex
@@ -54,7 +51,11 @@ mutex_unlock(mutex_t *mutex)
   return pthread_mutex_unlock(mutex);
 }
 
-#endif
+static inline int
+mutex_trylock(mutex_t *mutex)
+{
+  return pthread_mutex_trylock(mutex);
+}
 
 /*
  * Interrupt
@@ -63,7 +64,17 @@ mutex_unlock(mutex_t *mutex)
 extern int
 intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *id), int flags, const char *name, void *dev);
 extern int
+intr_watch_fd(unsigned int irq, int fd);
+extern int
+intr_mask_fd(unsigned int irq, int fd);
+extern int
+intr_unmask_fd(unsigned int irq, int fd);
+extern int
+intr_raise_irq(unsigned int irq);
+extern int
 intr_run(void);
+extern void
+intr_shutdown(void);
 extern int
 intr_init(void);
 
@@ -88,4 +99,6 @@ sched_sleep(struct sched_ctx *ctx, mutex_t *mutex, const struct timespec *abstim
 extern int
 sched_wakeup(struct sched_ctx *ctx);
 extern int
-sched_interrupt(struct sched_ctx *ctx);
\ No newline at end of file
+sched_interrupt(struct sched_ctx *ctx);
+
+#endif
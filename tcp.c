@@ -4,10 +4,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/random.h>
 #include <errno.h>
 
 #include "platform.h"
 #include "util.h"
+#include "pbuf.h"
 #include "ip.h"
 #include "tcp.h"
 
@@ -21,7 +23,89 @@
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y) ? 1 : 0)
 
-#define TCP_PCB_SIZE 16
+/* sequence number comparison (modulo 2^32) */
+#define TCP_SEQ_LT(x, y) ((int32_t)((x) - (y)) < 0)
+#define TCP_SEQ_LEQ(x, y) ((int32_t)((x) - (y)) <= 0)
+
+#define TCP_PCB_SIZE 16          /* initial size of the ID table, doubled as needed */
+#define TCP_PCB_SIZE_MAX 1048576 /* max number of PCBs (connections and listeners) */
+
+#define TCP_BACKLOG_MAX 4096 /* per listener, for each of the SYN-RECEIVED and the accept queues */
+
+/* SYN cookie: | count (5 bits) | MSS index (3 bits) | MAC (24 bits) | */
+#define TCP_COOKIE_PERIOD_SHIFT 6 /* the count advances every 64 seconds */
+#define TCP_COOKIE_AGE_MAX 1      /* periods a cookie stays valid after the one it was made in */
+#define TCP_COOKIE_TS_BITS 6      /* the options encoded in the low bits of TSval */
+
+/* TIME-WAIT */
+#define TCP_TIMEWAIT_TIMEOUT 60000    /* milli seconds, 2MSL (with the MSL of 30 seconds) */
+#define TCP_TIMEWAIT_MAX 262144       /* entries, beyond this a connection is released without it */
+#define TCP_TIMEWAIT_REUSE_DELAY 1000 /* milli seconds before an active open may take over the 4-tuple */
+#define TCP_TIMEWAIT_HASH_SIZE 64     /* initial, doubled when the load exceeds 1 */
+#define TCP_TIMEWAIT_REAP_SLACK 100   /* milli seconds the reaper waits for more to expire with the first */
+
+#define TCP_TW_F_TS 0x01      /* the connection has used timestamps */
+#define TCP_TW_F_RESTART 0x02 /* the timeout has been restarted by a retransmitted FIN */
+#define TCP_TW_F_DEAD 0x04    /* taken over by a new connection, freed by the reaper */
+
+#define TCP_LISTEN_HASH_SIZE 64                   /* must be a power of 2 */
+#define TCP_ESTABLISHED_HASH_SIZE 64              /* initial, doubled when the load exceeds 1 */
+#define TCP_ESTABLISHED_HASH_SIZE_MAX (1 << 20)
+
+#define TCP_PCB_HASHED_LISTEN 1
+#define TCP_PCB_HASHED_ESTABLISHED 2
+
+#define TCP_RCVBUF_INIT 16384          /* initial window (more than 10 full-sized segments) */
+#define TCP_RCVBUF_MAX (4 << 20)       /* with window scaling */
+#define TCP_RCVBUF_MAX_NOSCALE 65535   /* limited by the 16-bit window field */
+#define TCP_RCVBUF_MEM_MAX (64 << 20)  /* total of the receive buffers holding data */
+
+#define TCP_SNDBUF_INIT 65536          /* initial, and again after a drain */
+#define TCP_SNDBUF_MAX (4 << 20)       /* two windows of TCP_RCVBUF_MAX peers, in flight and the next one */
+#define TCP_SNDBUF_MEM_MAX (64 << 20)  /* total of the send buffers grown beyond TCP_SNDBUF_INIT */
+
+#define TCP_CA_OPEN 0
+#define TCP_CA_LOSS 1 /* after RTO, until data beyond the outstanding at that time is acknowledged */
+#define TCP_CA_RECOVERY 2 /* fast recovery (RFC 6582), likewise */
+
+#define TCP_DUPACK_THRESH 3
+
+#define TCP_CC_PRIV_SIZE 128 /* private area of the congestion control */
+
+#define TCP_PACING_SLACK 1000 /* micro seconds ahead of the schedule a segment may go (the timer tick) */
+
+#define TCP_ABC_LIMIT 2 /* segments an ACK may grow cwnd by in slow start (RFC 3465), one covers two when delayed */
+
+#define TCP_DELACK_TIMEOUT 40     /* milli seconds, default */
+#define TCP_DELACK_TIMEOUT_MAX 40 /* within the minimum RTO of the peers */
+#define TCP_QUICKACKS 16          /* segments acknowledged right away at the start and after a hole */
+
+/* options (RFC 793, 2018, 7323) */
+#define TCP_OPT_EOL 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_WSCALE 3
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK 5
+#define TCP_OPT_TS 8
+
+#define TCP_OPT_LEN_MAX 40
+#define TCP_SACK_BLOCKS_MAX 4 /* fits in the option space (3 with timestamps) */
+
+#define TCP_OPT_F_MSS 0x01
+#define TCP_OPT_F_WSCALE 0x02
+#define TCP_OPT_F_SACK_PERM 0x04
+#define TCP_OPT_F_TS 0x08
+#define TCP_OPT_F_SACK 0x10
+
+#define TCP_MSS_DEFAULT 536 /* when the peer does not tell (RFC 1122) */
+#define TCP_WSCALE 7        /* ours, enough for TCP_RCVBUF_MAX */
+#define TCP_WSCALE_MAX 14
+
+#define TCP_OOO_MEM_RATIO 2 /* held out of order (with the overhead) per byte of the receive buffer */
+
+#define TCP_FIN_REQUESTED 1 /* by close, sent after the data in the send buffer */
+#define TCP_FIN_SENT 2
 
 #define TCP_PCB_STATE_FREE 0
 #define TCP_PCB_STATE_CLOSED 1
@@ -36,8 +120,12 @@
 #define TCP_PCB_STATE_CLOSE_WAIT 10
 #define TCP_PCB_STATE_LAST_ACK 11
 
-#define TCP_DEFAULT_RTO 200000     /* micro seconds */
-#define TCP_RETRANSMIT_DEADLINE 12 /* seconds */
+/* RTO (RFC 6298), micro seconds */
+#define TCP_RTO_INIT 1000000
+#define TCP_RTO_MIN 200000 /* least margin over SRTT, above the delayed ACK timeouts of the peers (up to 200ms) */
+#define TCP_RTO_MAX 60000000
+#define TCP_RETRIES_SYN 6 /* backoffs of the handshake, about 2 minutes */
+#define TCP_RETRIES 15 /* backoffs of the data, reaching TCP_RTO_MAX (RFC 1122 4.2.3.5) */
 
 struct pseudo_hdr
 {
@@ -61,17 +149,80 @@ struct tcp_hdr
   uint16_t up;
 };
 
+struct tcp_sack_block
+{
+  uint32_t left;
+  uint32_t right; /* the sequence number right after the block */
+};
+
+struct tcp_options
+{
+  int flags; /* TCP_OPT_F_XXX, the ones present */
+  uint16_t mss;
+  uint8_t wscale;
+  uint32_t tsval;
+  uint32_t tsecr;
+  int nsack;
+  struct tcp_sack_block sack[TCP_SACK_BLOCKS_MAX];
+};
+
 struct tcp_segment_info
 {
   uint32_t seq;
   uint32_t ack;
   uint16_t len;
-  uint16_t wnd;
+  uint16_t wnd; /* as in the header (not scaled) */
   uint16_t up;
+  struct tcp_options opt;
+};
+
+struct tcp_pcb;
+
+/* what an ACK for new data tells */
+struct tcp_rate_sample
+{
+  uint32_t acked;           /* bytes newly acknowledged */
+  unsigned int rtt;         /* micro seconds (0: ambiguous) */
+  uint64_t prior_delivered; /* delivered when the latest one acknowledged was sent */
+  uint64_t delivered;       /* bytes delivered since then */
+  uint64_t interval;        /* micro seconds it took (0: no rate sample) */
+};
+
+/*
+ * congestion control algorithm
+ *
+ * ack:     new data acknowledged
+ * loss:    congestion detected by duplicate ACKs, set ssthresh (the recovery is done by the caller)
+ * timeout: RTO expired, set ssthresh (cwnd falls back to one segment)
+ * cwnd:    the window to send with (optional, cc.cwnd if NULL)
+ */
+struct tcp_congestion_ops
+{
+  const char *name;
+  void (*init)(struct tcp_pcb *pcb);
+  void (*ack)(struct tcp_pcb *pcb, const struct tcp_rate_sample *rs);
+  void (*loss)(struct tcp_pcb *pcb);
+  void (*timeout)(struct tcp_pcb *pcb);
+  uint32_t (*cwnd)(struct tcp_pcb *pcb);
 };
 
 struct tcp_pcb
 {
+  mutex_t mutex; /* protects the members below (except ref and the hash links) */
+  int ref;       /* the table, the armed RTO timer and the users of select/get */
+  int id;
+  struct tcp_pcb *hnext; /* hash chain (protected by table.mutex) */
+  struct tcp_pcb **hpprev;
+  int hashed;
+  struct tcp_pcb *parent; /* the listener until accepted (a reference, for the children of tcp_listen) */
+  struct queue_entry alink; /* in the accept queue of the listener */
+  struct
+  {
+    unsigned int max;          /* 0: not by tcp_listen, the listener itself becomes the connection */
+    unsigned int syn;          /* children in SYN-RECEIVED (atomic) */
+    struct queue_head accept;  /* established children not accepted yet (each with a reference) */
+    time_t cookie;             /* when a SYN cookie was sent last (ACKs are checked for one until it expires) */
+  } backlog;
   int state; // connection state
   struct ip_endpoint local;
   struct ip_endpoint foreign;
@@ -79,8 +230,9 @@ struct tcp_pcb
   {
     uint32_t nxt; // not send yet ACK num
     uint32_t una; // already sent ACK num
-    uint16_t wnd;
+    uint32_t wnd; /* scaled */
     uint16_t up;
+    uint8_t wscale; /* the peer's shift */
     uint32_t wl1;
     uint32_t wl2;
   } snd;
@@ -88,35 +240,162 @@ struct tcp_pcb
   struct
   {
     uint32_t nxt;
-    uint16_t wnd;
+    uint32_t wnd;
     uint16_t up;
+    uint8_t wscale; /* ours */
+    uint32_t adv; /* right edge of the advertised window (must not move back) */
   } rcv;
   uint32_t irs;
   uint16_t mtu;
-  uint16_t mss;
-  uint8_t buf[65535]; /* receive buffer */
+  uint16_t mss;      /* payload of a full-sized segment (without the options) */
+  uint16_t mss_peer; /* told by the peer in SYN */
+  int options;       /* TCP_OPT_F_XXX, offered until SYN is received, then negotiated */
+  uint32_t ts_recent; /* TSval to echo (RFC 7323) */
+  struct
+  {
+    uint8_t *data; /* ring, allocated only while it holds data */
+    size_t size;   /* capacity (the window offered when empty) */
+    size_t head;
+    size_t len;
+    size_t target; /* auto-tuned size, shrinking waits for the advertised window to be used */
+    struct timeval time;
+    size_t copied; /* read by the user since time */
+    size_t space;  /* read by the user in the last measurement */
+  } rcvbuf;
+  struct
+  {
+    struct tcp_ooo_entry *head;
+    size_t mem;    /* charged for the ranges held, with the overhead */
+    uint32_t last; /* the latest segment held, reported first in SACK */
+  } ooo; /* segments beyond RCV.NXT, held until the gap is filled */
+  struct
+  {
+    uint8_t *data; /* ring, allocated only while it holds data (or streaming) */
+    size_t size;   /* grows while the window outruns it */
+    size_t head;   /* SND.UNA */
+    size_t len;    /* in flight and not sent yet */
+    struct timeval time;
+    size_t acked; /* acknowledged since time */
+    size_t space; /* acknowledged in the last measurement */
+  } sndbuf;
+  int fin;
+  struct
+  {
+    uint32_t seq; /* measuring until the data reaches this (the edge of the window) */
+    struct timeval time;
+    unsigned int rtt; /* micro seconds, smoothed (0: no sample yet) */
+  } rcvrtt;
+  struct
+  {
+    unsigned int srtt;     /* micro seconds (0: no sample yet) */
+    unsigned int rttvar;   /* micro seconds */
+    unsigned int rto;      /* micro seconds, doubled on each expiration until new data is acknowledged */
+    unsigned int backoffs; /* expirations since new data was acknowledged */
+  } rtt;
+  struct
+  {
+    const struct tcp_congestion_ops *ops;
+    int state;
+    uint32_t cwnd;     /* bytes */
+    uint32_t ssthresh; /* bytes */
+    uint32_t high;     /* SND.NXT when the loss was detected */
+    unsigned int dupacks;
+    size_t lost;       /* bytes to be retransmitted, not counted in the pipe */
+    size_t sacked;     /* bytes selectively acknowledged, not counted in the pipe either */
+    uint32_t high_rxt; /* end of the highest one retransmitted in the recovery (RFC 6675 HighRxt) */
+    uint64_t delivered; /* bytes acknowledged in total */
+    uint64_t delivered_time;
+    uint64_t pacing_rate; /* bytes per second (0: not paced) */
+    uint64_t pacing_next; /* micro seconds, when the next segment is due */
+    uint64_t priv[TCP_CC_PRIV_SIZE / sizeof(uint64_t)];
+  } cc;
   struct sched_ctx ctx;
   struct queue_head queue; /* retransmit queue */
+  struct net_timer timer;  /* RTO timer, armed while the retransmit queue is not empty */
+  struct net_timer pacer;  /* armed while a segment waits for its pacing time */
+  struct net_timer acker;  /* armed while an ACK is delayed */
+  struct
+  {
+    unsigned int timeout; /* milli seconds (0: disabled) */
+    size_t pending;       /* bytes received and not acknowledged yet */
+    size_t rcv_mss;       /* the largest segment received */
+    unsigned int quick;   /* segments to acknowledge right away */
+  } delack;
+  unsigned int busy_poll;  /* usec to poll before sleeping in receive (0: disabled) */
+};
+
+/* out-of-order range, the ranges in the queue are sorted and never overlap or touch */
+struct tcp_ooo_entry
+{
+  struct tcp_ooo_entry *next;
+  uint32_t seq;
+  size_t len;
+  size_t size; /* of data, grown as the following segments are appended */
+  int fin;     /* FIN follows the text */
+  uint8_t data[];
 };
 
 struct tcp_queue_entry
 {
+  struct queue_entry link;
   struct timeval first; // first sending time
   struct timeval last;  // last sending time
-  unsigned int rto;     /* micro seconds */
+  unsigned int retries; /* an ACK for a retransmitted one is ambiguous for RTT (Karn) */
+  int lost;             /* to be retransmitted (by the ACK clock, as cwnd allows) */
+  int sacked;           /* has arrived, beyond a hole */
+  uint64_t delivered;   /* of the PCB at the last sending, for the delivery rate */
+  uint64_t delivered_time;
   uint32_t seq;
   uint8_t flg;
-  size_t len; // data's length
-  uint8_t data[];
+  size_t len; // data's length (the data itself is in the send buffer)
+};
+
+/* what is left of a connection in TIME-WAIT (the PCB is released) */
+struct tcp_timewait
+{
+  struct tcp_timewait *hnext; /* hash chain (protected by table.mutex, as all the members) */
+  struct tcp_timewait **hpprev;
+  struct queue_entry link; /* in the reaping queue */
+  struct ip_endpoint local;
+  struct ip_endpoint foreign;
+  uint32_t snd_nxt;
+  uint32_t rcv_nxt;
+  uint32_t ts_recent;
+  uint32_t ts_stamp; /* tcp_ts_now() when entered */
+  uint64_t expire;   /* net_timer_now() */
+  uint16_t wnd;      /* as advertised last */
+  uint8_t flags;     /* TCP_TW_F_XXX */
 };
 
-static mutex_t mutex = MUTEX_INITIALIZER;
-static struct tcp_pcb pcbs[TCP_PCB_SIZE];
+static struct
+{
+  mutex_t mutex; /* protects the table (never held while locking a PCB) */
+  uint32_t secret; /* hash seed */
+  struct tcp_pcb **ids; /* ID -> PCB */
+  unsigned int size;
+  unsigned int count;
+  unsigned int hint; /* where to search a free ID next */
+  struct
+  {
+    struct tcp_pcb **buckets;
+    unsigned int size;
+    unsigned int count;
+  } established; /* 4-tuple hash */
+  struct tcp_pcb *listen[TCP_LISTEN_HASH_SIZE]; /* (addr, port) hash */
+  struct
+  {
+    struct tcp_timewait **buckets;
+    unsigned int size;
+    unsigned int count;      /* hashed (the dead ones wait in the queue) */
+    struct queue_head queue; /* in the order of expiration, except the restarted ones */
+    struct net_timer reaper; /* armed while the queue is not empty */
+  } timewait; /* 4-tuple hash */
+} table = {.mutex = MUTEX_INITIALIZER};
 
 static char *
 tcp_flg_ntoa(uint8_t flg)
 {
-  static char str[9];
+  static __thread char str[9];
 
   snprintf(str, sizeof(str), "--%c%c%c%c%c%c",
            TCP_FLG_ISSET(flg, TCP_FLG_URG) ? 'U' : '-',
@@ -150,250 +429,3440 @@ tcp_dump(const uint8_t *data, size_t len)
   funlockfile(stderr);
 }
 
+static void
+tcp_retransmit_timer(struct net_timer *timer, void *arg);
+static void
+tcp_pacing_timer(struct net_timer *timer, void *arg);
+static void
+tcp_segment_arrives(struct tcp_pcb *pcb, struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
+static void
+tcp_delack_timer(struct net_timer *timer, void *arg);
+static void
+tcp_delack_sent(struct tcp_pcb *pcb);
+static void
+tcp_retransmit_fast(struct tcp_pcb *pcb);
+static void
+tcp_rcvbuf_free(struct tcp_pcb *pcb);
+static void
+tcp_sndbuf_free(struct tcp_pcb *pcb);
+static void
+tcp_ooo_purge(struct tcp_pcb *pcb);
+static int
+tcp_ooo_sack(struct tcp_pcb *pcb, struct tcp_sack_block *blocks, int max);
+
+static const struct tcp_congestion_ops tcp_newreno;
+
 /*
  * TCP Protocol Control Block (PCB)
  *
- * NOTE: TCP PCB functions must be called after mutex locked
+ * PCBs are allocated on demand. The table maps connection IDs to PCBs, and demuxes
+ * incoming segments with a 4-tuple hash for connections and an (addr, port) hash
+ * for listeners (falling back to the wildcard address).
+ *
+ * Each PCB has its own mutex, so segments of different connections are processed
+ * in parallel (e.g. by the per-core workers). The functions returning a PCB return
+ * it locked with a reference taken, release both with tcp_pcb_unlock(). At most one
+ * PCB is locked at a time (except a child created under its listener, which nobody
+ * else holds yet), and table.mutex is never held while locking a PCB.
+ *
+ * NOTE: TCP PCB functions (except alloc/select/get) must be called after pcb->mutex locked
  */
 
-static struct tcp_pcb *
-tcp_pcb_alloc(void)
+static void
+tcp_pcb_free(struct tcp_pcb *pcb)
 {
-  struct tcp_pcb *pcb;
+  memory_free(pcb);
+}
+
+static void
+tcp_pcb_hold(struct tcp_pcb *pcb)
+{
+  __atomic_add_fetch(&pcb->ref, 1, __ATOMIC_RELAXED);
+}
+
+// drop a reference, the PCB is freed with the last one
+static void
+tcp_pcb_drop(struct tcp_pcb *pcb)
+{
+  if (__atomic_sub_fetch(&pcb->ref, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    tcp_pcb_free(pcb);
+  }
+}
+
+static void
+tcp_pcb_unlock(struct tcp_pcb *pcb)
+{
+  mutex_unlock(&pcb->mutex);
+  tcp_pcb_drop(pcb);
+}
+
+static uint32_t
+tcp_pcb_hash(ip_addr_t laddr, uint16_t lport, ip_addr_t faddr, uint16_t fport)
+{
+  uint32_t h;
+
+  h = (table.secret ^ laddr) * 0x9e3779b1;
+  h = (h ^ faddr) * 0x85ebca6b;
+  h = (h ^ ((uint32_t)lport << 16 | fport)) * 0xc2b2ae35;
+  return h ^ (h >> 16);
+}
+
+/* NOTE: must be called after table.mutex locked */
+static void
+tcp_pcb_link(struct tcp_pcb **bucket, struct tcp_pcb *pcb)
+{
+  pcb->hnext = *bucket;
+  if (pcb->hnext)
+  {
+    pcb->hnext->hpprev = &pcb->hnext;
+  }
+  pcb->hpprev = bucket;
+  *bucket = pcb;
+}
+
+/* NOTE: must be called after table.mutex locked */
+static void
+tcp_pcb_unlink(struct tcp_pcb *pcb)
+{
+  if (!pcb->hpprev)
+  {
+    return;
+  }
+  *pcb->hpprev = pcb->hnext;
+  if (pcb->hnext)
+  {
+    pcb->hnext->hpprev = pcb->hpprev;
+  }
+  if (pcb->hashed == TCP_PCB_HASHED_ESTABLISHED)
+  {
+    table.established.count--;
+  }
+  pcb->hnext = NULL;
+  pcb->hpprev = NULL;
+  pcb->hashed = 0;
+}
+
+/* NOTE: must be called after table.mutex locked */
+static void
+tcp_pcb_grow_established(void)
+{
+  struct tcp_pcb **buckets, *pcb, *next;
+  unsigned int size, i;
 
-  for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
+  size = table.established.size * 2;
+  buckets = memory_alloc(sizeof(*buckets) * size);
+  if (!buckets)
+  {
+    /* keep the current size, the chains just get longer */
+    return;
+  }
+  for (i = 0; i < table.established.size; i++)
   {
-    if (pcb->state == TCP_PCB_STATE_FREE)
+    for (pcb = table.established.buckets[i]; pcb; pcb = next)
     {
-      pcb->state = TCP_PCB_STATE_CLOSED;
-      sched_ctx_init(&pcb->ctx);
-      return pcb;
+      next = pcb->hnext;
+      tcp_pcb_link(&buckets[tcp_pcb_hash(pcb->local.addr, pcb->local.port, pcb->foreign.addr, pcb->foreign.port) & (size - 1)], pcb);
     }
   }
-  return NULL;
+  memory_free(table.established.buckets);
+  table.established.buckets = buckets;
+  table.established.size = size;
+  debugf("resized, buckets=%u", size);
 }
 
+// (re)index the PCB by its current state and endpoints
 static void
-tcp_pcb_release(struct tcp_pcb *pcb)
+tcp_pcb_rehash(struct tcp_pcb *pcb)
 {
-  char ep1[IP_ENDPOINT_STR_LEN];
-  char ep2[IP_ENDPOINT_STR_LEN];
+  struct tcp_pcb **bucket;
 
-  // if there is task using PCB, can't release at this timing
-  // so wakeup another task
-  if (sched_ctx_destroy(&pcb->ctx) == -1)
+  mutex_lock(&table.mutex);
+  tcp_pcb_unlink(pcb);
+  switch (pcb->state)
   {
-    sched_wakeup(&pcb->ctx);
-    return;
+  case TCP_PCB_STATE_FREE:
+  case TCP_PCB_STATE_CLOSED:
+    break;
+  case TCP_PCB_STATE_LISTEN:
+    bucket = &table.listen[tcp_pcb_hash(pcb->local.addr, pcb->local.port, IP_ADDR_ANY, 0) & (TCP_LISTEN_HASH_SIZE - 1)];
+    tcp_pcb_link(bucket, pcb);
+    pcb->hashed = TCP_PCB_HASHED_LISTEN;
+    break;
+  default:
+    if (table.established.count >= table.established.size && table.established.size < TCP_ESTABLISHED_HASH_SIZE_MAX)
+    {
+      tcp_pcb_grow_established();
+    }
+    bucket = &table.established.buckets[tcp_pcb_hash(pcb->local.addr, pcb->local.port, pcb->foreign.addr, pcb->foreign.port) & (table.established.size - 1)];
+    tcp_pcb_link(bucket, pcb);
+    pcb->hashed = TCP_PCB_HASHED_ESTABLISHED;
+    table.established.count++;
+    break;
   }
-  debugf("released, local=%s, foreign=%s",
-         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-  memset(pcb, 0, sizeof(*pcb));
+  mutex_unlock(&table.mutex);
 }
 
-static struct tcp_pcb *
-tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
+/* NOTE: must be called after table.mutex locked */
+static int
+tcp_pcb_id_alloc(struct tcp_pcb *pcb)
 {
-  struct tcp_pcb *pcb, *listen_pcb = NULL;
+  struct tcp_pcb **ids;
+  unsigned int size, i, id;
 
-  for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
+  if (table.count == table.size)
   {
-    if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port)
+    if (table.size == TCP_PCB_SIZE_MAX)
     {
-      if (!foreign)
-      {
-        return pcb;
-      }
-      if (pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port)
-      {
-        return pcb;
-      }
-      if (pcb->state == TCP_PCB_STATE_LISTEN)
-      {
-        if (pcb->foreign.addr == IP_ADDR_ANY && pcb->foreign.port == 0)
-        {
-          /* LISTENed with wildcard foreign address/port */
-          listen_pcb = pcb;
-        }
-      }
+      return -1;
+    }
+    size = MIN(table.size * 2, TCP_PCB_SIZE_MAX);
+    ids = memory_alloc(sizeof(*ids) * size);
+    if (!ids)
+    {
+      return -1;
+    }
+    memcpy(ids, table.ids, sizeof(*ids) * table.size);
+    memory_free(table.ids);
+    table.hint = table.size;
+    table.ids = ids;
+    table.size = size;
+  }
+  /* round-robin, so a closed ID is not handed out again right away */
+  for (i = 0; i < table.size; i++)
+  {
+    id = (table.hint + i) % table.size;
+    if (!table.ids[id])
+    {
+      table.ids[id] = pcb;
+      table.count++;
+      table.hint = id + 1;
+      return id;
     }
   }
-  return listen_pcb;
+  return -1;
 }
 
 static struct tcp_pcb *
-tcp_pcb_get(int id)
+tcp_pcb_alloc(void)
 {
   struct tcp_pcb *pcb;
 
-  if (id < 0 || id >= (int)countof(pcbs))
+  pcb = memory_alloc(sizeof(*pcb));
+  if (!pcb)
   {
-    /* out of range */
+    errorf("memory_alloc() failure");
     return NULL;
   }
-  pcb = &pcbs[id];
-  if (pcb->state == TCP_PCB_STATE_FREE)
+  mutex_init(&pcb->mutex);
+  pcb->ref = 2; /* the table and the caller */
+  pcb->state = TCP_PCB_STATE_CLOSED;
+  pcb->rtt.rto = TCP_RTO_INIT;
+  pcb->sndbuf.size = TCP_SNDBUF_INIT;
+  pcb->cc.ops = &tcp_newreno;
+  sched_ctx_init(&pcb->ctx);
+  net_timer_init(&pcb->timer, tcp_retransmit_timer, pcb);
+  net_timer_init(&pcb->pacer, tcp_pacing_timer, pcb);
+  net_timer_init(&pcb->acker, tcp_delack_timer, pcb);
+  pcb->delack.timeout = TCP_DELACK_TIMEOUT;
+  pcb->delack.quick = TCP_QUICKACKS;
+  mutex_lock(&pcb->mutex);
+  mutex_lock(&table.mutex);
+  pcb->id = tcp_pcb_id_alloc(pcb);
+  mutex_unlock(&table.mutex);
+  if (pcb->id == -1)
   {
+    errorf("no more connections, max=%u", TCP_PCB_SIZE_MAX);
+    mutex_unlock(&pcb->mutex);
+    sched_ctx_destroy(&pcb->ctx);
+    tcp_pcb_free(pcb);
     return NULL;
   }
   return pcb;
 }
 
-static int
-tcp_pcb_id(struct tcp_pcb *pcb)
+/* the timer holds a reference while armed, the handler drops it */
+static void
+tcp_pcb_timer_arm(struct tcp_pcb *pcb, struct net_timer *timer, unsigned int msec)
 {
-  return indexof(pcbs, pcb);
+  tcp_pcb_hold(pcb);
+  if (net_timer_arm(timer, msec, 0))
+  {
+    /* replaced the pending one, which already holds a reference */
+    tcp_pcb_drop(pcb);
+  }
 }
 
-static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+static void
+tcp_pcb_timer_cancel(struct tcp_pcb *pcb, struct net_timer *timer)
 {
-  uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
-  struct tcp_hdr *hdr;
-  struct pseudo_hdr pseudo;
-  uint16_t psum;
-  uint16_t total;
-  char ep1[IP_ENDPOINT_STR_LEN];
-  char ep2[IP_ENDPOINT_STR_LEN];
-
-  hdr = (struct tcp_hdr *)buf;
-  hdr->src = local->port;
-  hdr->dst = foreign->port;
-  hdr->seq = hton32(seq);
-  hdr->ack = hton32(ack);
-  hdr->off = (sizeof(*hdr) >> 2) << 4;
-  hdr->flg = flg;
-  hdr->wnd = hton16(wnd);
-  hdr->sum = 0;
-  hdr->up = 0;
-  memcpy(hdr + 1, data, len);
-  pseudo.src = local->addr;
-  pseudo.dst = foreign->addr;
-  pseudo.zero = 0;
-  pseudo.protocol = IP_PROTOCOL_TCP;
-  total = sizeof(*hdr) + len;
-  pseudo.len = hton16(total);
-  psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-  hdr->sum = cksum16((uint16_t *)hdr, total, psum);
-  debugf("%s => %s, len=%u (payload=%zu)",
-         ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
-  tcp_dump((uint8_t *)hdr, total);
-  if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1)
+  if (net_timer_cancel(timer))
   {
-    return -1;
+    tcp_pcb_drop(pcb);
   }
-  return len;
 }
 
-/*
- * TCP Retransmit
- *
- * NOTE: TCP Retransmit functions must be called after mutex locked
- */
-
-static int
-tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *data, size_t len)
+static void
+tcp_pcb_release(struct tcp_pcb *pcb)
 {
   struct tcp_queue_entry *entry;
+  char ep1[IP_ENDPOINT_STR_LEN];
+  char ep2[IP_ENDPOINT_STR_LEN];
 
-  entry = memory_alloc(sizeof(*entry) + len);
-  if (!entry)
+  if (pcb->parent)
   {
-    errorf("memory_alloc() failure");
-    return -1;
+    /* never established, its room in the backlog is given back */
+    __atomic_sub_fetch(&pcb->parent->backlog.syn, 1, __ATOMIC_RELAXED);
+    tcp_pcb_drop(pcb->parent);
+    pcb->parent = NULL;
   }
-  entry->rto = TCP_DEFAULT_RTO;
-  entry->seq = seq;
-  entry->flg = flg;
-  entry->len = len;
-  memcpy(entry + 1, data, entry->len);
-  gettimeofday(&entry->first, NULL);
-  entry->last = entry->first;
-  if (!queue_push(&pcb->queue, entry))
+  // if there is task using PCB, can't release at this timing
+  // so wakeup another task
+  if (sched_ctx_destroy(&pcb->ctx) == -1)
+  {
+    sched_wakeup(&pcb->ctx);
+    return;
+  }
+  /* a running handler finds the PCB freed and does nothing */
+  tcp_pcb_timer_cancel(pcb, &pcb->timer);
+  tcp_pcb_timer_cancel(pcb, &pcb->pacer);
+  tcp_pcb_timer_cancel(pcb, &pcb->acker);
+  while ((entry = queue_data(queue_pop(&pcb->queue), struct tcp_queue_entry, link)))
   {
-    errorf("queue_push() failure");
     memory_free(entry);
-    return -1;
   }
-  return 0;
+  tcp_ooo_purge(pcb);
+  tcp_rcvbuf_free(pcb);
+  tcp_sndbuf_free(pcb);
+  debugf("released, id=%d, local=%s, foreign=%s", pcb->id,
+         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+  pcb->state = TCP_PCB_STATE_FREE;
+  mutex_lock(&table.mutex);
+  tcp_pcb_unlink(pcb);
+  table.ids[pcb->id] = NULL;
+  table.count--;
+  mutex_unlock(&table.mutex);
+  /* the one of the table, the caller still holds its own */
+  tcp_pcb_drop(pcb);
 }
 
-static void
-tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb)
+/* NOTE: must be called after table.mutex locked */
+static struct tcp_pcb *
+tcp_pcb_lookup(struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-  struct tcp_queue_entry *entry;
+  struct tcp_pcb *pcb;
+  ip_addr_t addr;
 
+  pcb = table.established.buckets[tcp_pcb_hash(local->addr, local->port, foreign->addr, foreign->port) & (table.established.size - 1)];
+  for (; pcb; pcb = pcb->hnext)
+  {
+    if (pcb->local.addr == local->addr && pcb->local.port == local->port &&
+        pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port)
+    {
+      return pcb;
+    }
+  }
+  /* the exact address first, then the wildcard */
+  addr = local->addr;
   while (1)
   {
-    entry = queue_peek(&pcb->queue);
-    if (!entry)
+    pcb = table.listen[tcp_pcb_hash(addr, local->port, IP_ADDR_ANY, 0) & (TCP_LISTEN_HASH_SIZE - 1)];
+    for (; pcb; pcb = pcb->hnext)
     {
-      break;
+      if (pcb->local.addr == addr && pcb->local.port == local->port &&
+          ((pcb->foreign.addr == IP_ADDR_ANY && pcb->foreign.port == 0) ||
+           (pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port)))
+      {
+        return pcb;
+      }
     }
-    if (entry->seq >= pcb->snd.una)
+    if (addr == IP_ADDR_ANY)
     {
-      // if not gain ACK response, break loop
       break;
     }
-    entry = queue_pop(&pcb->queue);
-    debugf("remove, seq=%u, flags=%s, len=%zu", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
-    memory_free(entry);
+    addr = IP_ADDR_ANY;
+  }
+  return NULL;
+}
+
+static struct tcp_pcb *
+tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  struct tcp_pcb *pcb;
+
+  while (1)
+  {
+    mutex_lock(&table.mutex);
+    pcb = tcp_pcb_lookup(local, foreign);
+    if (!pcb)
+    {
+      mutex_unlock(&table.mutex);
+      return NULL;
+    }
+    tcp_pcb_hold(pcb);
+    mutex_unlock(&table.mutex);
+    mutex_lock(&pcb->mutex);
+    /* may have been changed while unlocked, check it again */
+    if (pcb->state == TCP_PCB_STATE_LISTEN)
+    {
+      if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port)
+      {
+        return pcb;
+      }
+    }
+    else if (pcb->state != TCP_PCB_STATE_FREE &&
+             pcb->local.addr == local->addr && pcb->local.port == local->port &&
+             pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port)
+    {
+      return pcb;
+    }
+    tcp_pcb_unlock(pcb);
+  }
+}
+
+static struct tcp_pcb *
+tcp_pcb_get(int id)
+{
+  struct tcp_pcb *pcb;
+
+  mutex_lock(&table.mutex);
+  if (id < 0 || id >= (int)table.size || !table.ids[id])
+  {
+    /* out of range or not in use */
+    mutex_unlock(&table.mutex);
+    return NULL;
+  }
+  pcb = table.ids[id];
+  tcp_pcb_hold(pcb);
+  mutex_unlock(&table.mutex);
+  mutex_lock(&pcb->mutex);
+  if (pcb->state == TCP_PCB_STATE_FREE)
+  {
+    tcp_pcb_unlock(pcb);
+    return NULL;
+  }
+  return pcb;
+}
+
+static int
+tcp_pcb_id(struct tcp_pcb *pcb)
+{
+  return pcb->id;
+}
+
+/*
+ * TCP Options
+ *
+ * MSS, window scale and SACK-permitted are exchanged in SYN only, timestamps in every
+ * segment once both sides have offered them. The ones not offered by both sides are
+ * off for the connection. SACK blocks go with every segment while data is held out of
+ * order.
+ *
+ * NOTE: TCP Options functions taking a PCB must be called after pcb->mutex locked
+ */
+
+// unknown options are skipped, returns -1 if the length of one is broken
+static int
+tcp_options_parse(const uint8_t *p, size_t len, struct tcp_options *opt)
+{
+  size_t i = 0;
+  uint8_t olen;
+  uint16_t v16;
+  uint32_t v32;
+
+  opt->flags = 0;
+  while (i < len)
+  {
+    if (p[i] == TCP_OPT_EOL)
+    {
+      break;
+    }
+    if (p[i] == TCP_OPT_NOP)
+    {
+      i++;
+      continue;
+    }
+    if (i + 1 >= len)
+    {
+      return -1;
+    }
+    olen = p[i + 1];
+    if (olen < 2 || i + olen > len)
+    {
+      return -1;
+    }
+    switch (p[i])
+    {
+    case TCP_OPT_MSS:
+      if (olen == 4)
+      {
+        memcpy(&v16, p + i + 2, sizeof(v16));
+        opt->mss = ntoh16(v16);
+        opt->flags |= TCP_OPT_F_MSS;
+      }
+      break;
+    case TCP_OPT_WSCALE:
+      if (olen == 3)
+      {
+        opt->wscale = p[i + 2];
+        opt->flags |= TCP_OPT_F_WSCALE;
+      }
+      break;
+    case TCP_OPT_SACK_PERM:
+      if (olen == 2)
+      {
+        opt->flags |= TCP_OPT_F_SACK_PERM;
+      }
+      break;
+    case TCP_OPT_TS:
+      if (olen == 10)
+      {
+        memcpy(&v32, p + i + 2, sizeof(v32));
+        opt->tsval = ntoh32(v32);
+        memcpy(&v32, p + i + 6, sizeof(v32));
+        opt->tsecr = ntoh32(v32);
+        opt->flags |= TCP_OPT_F_TS;
+      }
+      break;
+    case TCP_OPT_SACK:
+      if (olen >= 10 && (olen - 2) % 8 == 0)
+      {
+        for (opt->nsack = 0; opt->nsack < (olen - 2) / 8 && opt->nsack < TCP_SACK_BLOCKS_MAX; opt->nsack++)
+        {
+          memcpy(&v32, p + i + 2 + opt->nsack * 8, sizeof(v32));
+          opt->sack[opt->nsack].left = ntoh32(v32);
+          memcpy(&v32, p + i + 6 + opt->nsack * 8, sizeof(v32));
+          opt->sack[opt->nsack].right = ntoh32(v32);
+        }
+        opt->flags |= TCP_OPT_F_SACK;
+      }
+      break;
+    }
+    i += olen;
+  }
+  return 0;
+}
+
+// in the layouts padded with NOPs to 32-bit boundaries (RFC 7323 Appendix A), returns the length
+static size_t
+tcp_options_build(uint8_t *p, const struct tcp_options *opt)
+{
+  size_t n = 0;
+  int i;
+  uint16_t v16;
+  uint32_t v32;
+
+  if (opt->flags & TCP_OPT_F_MSS)
+  {
+    p[n++] = TCP_OPT_MSS;
+    p[n++] = 4;
+    v16 = hton16(opt->mss);
+    memcpy(p + n, &v16, sizeof(v16));
+    n += sizeof(v16);
+  }
+  if (opt->flags & TCP_OPT_F_SACK_PERM)
+  {
+    if (!(opt->flags & TCP_OPT_F_TS))
+    {
+      p[n++] = TCP_OPT_NOP;
+      p[n++] = TCP_OPT_NOP;
+    }
+    p[n++] = TCP_OPT_SACK_PERM;
+    p[n++] = 2;
+  }
+  else if (opt->flags & TCP_OPT_F_TS)
+  {
+    p[n++] = TCP_OPT_NOP;
+    p[n++] = TCP_OPT_NOP;
+  }
+  if (opt->flags & TCP_OPT_F_TS)
+  {
+    p[n++] = TCP_OPT_TS;
+    p[n++] = 10;
+    v32 = hton32(opt->tsval);
+    memcpy(p + n, &v32, sizeof(v32));
+    n += sizeof(v32);
+    v32 = hton32(opt->tsecr);
+    memcpy(p + n, &v32, sizeof(v32));
+    n += sizeof(v32);
+  }
+  if (opt->flags & TCP_OPT_F_WSCALE)
+  {
+    p[n++] = TCP_OPT_NOP;
+    p[n++] = TCP_OPT_WSCALE;
+    p[n++] = 3;
+    p[n++] = opt->wscale;
+  }
+  if (opt->flags & TCP_OPT_F_SACK)
+  {
+    p[n++] = TCP_OPT_NOP;
+    p[n++] = TCP_OPT_NOP;
+    p[n++] = TCP_OPT_SACK;
+    p[n++] = 2 + opt->nsack * 8;
+    for (i = 0; i < opt->nsack; i++)
+    {
+      v32 = hton32(opt->sack[i].left);
+      memcpy(p + n, &v32, sizeof(v32));
+      n += sizeof(v32);
+      v32 = hton32(opt->sack[i].right);
+      memcpy(p + n, &v32, sizeof(v32));
+      n += sizeof(v32);
+    }
+  }
+  return n;
+}
+
+// milli seconds, the clock of the timestamps
+static uint32_t
+tcp_ts_now(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (uint32_t)((uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000);
+}
+
+// the largest segment (without the headers) the interface of the local address carries
+static uint16_t
+tcp_mss_local(ip_addr_t addr)
+{
+  struct ip_iface *iface;
+
+  iface = ip_route_get_iface(addr);
+  if (!iface)
+  {
+    return TCP_MSS_DEFAULT;
+  }
+  return NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+}
+
+// all we support, offered in SYN (active open) or to be answered in SYN/ACK
+static void
+tcp_options_offer(struct tcp_pcb *pcb)
+{
+  pcb->options = TCP_OPT_F_WSCALE | TCP_OPT_F_SACK_PERM | TCP_OPT_F_TS;
+  pcb->rcv.wscale = TCP_WSCALE;
+}
+
+// on SYN from the peer, keep the ones offered by both sides
+static void
+tcp_options_negotiate(struct tcp_pcb *pcb, const struct tcp_options *opt)
+{
+  pcb->options &= opt->flags;
+  pcb->mss_peer = (opt->flags & TCP_OPT_F_MSS) ? opt->mss : TCP_MSS_DEFAULT;
+  if (pcb->options & TCP_OPT_F_WSCALE)
+  {
+    pcb->snd.wscale = MIN(opt->wscale, TCP_WSCALE_MAX);
+  }
+  else
+  {
+    /* both sides or neither */
+    pcb->snd.wscale = 0;
+    pcb->rcv.wscale = 0;
+  }
+  if (pcb->options & TCP_OPT_F_TS)
+  {
+    pcb->ts_recent = opt->tsval;
+  }
+}
+
+// the options to put in an outgoing segment of the connection with len bytes of text
+static void
+tcp_options_fill(struct tcp_pcb *pcb, uint8_t flg, size_t len, struct tcp_options *opt)
+{
+  int max;
+
+  opt->flags = 0;
+  if (TCP_FLG_ISSET(flg, TCP_FLG_SYN))
+  {
+    opt->flags = TCP_OPT_F_MSS | (pcb->options & (TCP_OPT_F_WSCALE | TCP_OPT_F_SACK_PERM));
+    opt->mss = tcp_mss_local(pcb->local.addr);
+    opt->wscale = pcb->rcv.wscale;
+  }
+  if (pcb->options & TCP_OPT_F_TS)
+  {
+    opt->flags |= TCP_OPT_F_TS;
+    opt->tsval = tcp_ts_now();
+    opt->tsecr = pcb->ts_recent;
+  }
+  if (!TCP_FLG_ISSET(flg, TCP_FLG_SYN) && (pcb->options & TCP_OPT_F_SACK_PERM) && pcb->ooo.head)
+  {
+    max = (opt->flags & TCP_OPT_F_TS) ? TCP_SACK_BLOCKS_MAX - 1 : TCP_SACK_BLOCKS_MAX;
+    if (len)
+    {
+      /* as many as the room left by the text (MSS accounts only for the timestamps) */
+      max = MIN(max, pcb->mss > len + 4 ? (int)(pcb->mss - len - 4) / 8 : 0);
+    }
+    opt->nsack = max ? tcp_ooo_sack(pcb, opt->sack, max) : 0;
+    if (opt->nsack)
+    {
+      opt->flags |= TCP_OPT_F_SACK;
+    }
+  }
+}
+
+// prepend the header (with the options, if any) to the payload in pb and send it (the caller still owns pb)
+static ssize_t
+tcp_output_pbuf(struct pbuf *pb, uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, const struct tcp_options *opt, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  struct tcp_hdr *hdr;
+  struct pseudo_hdr pseudo;
+  uint8_t options[TCP_OPT_LEN_MAX];
+  size_t optlen = 0;
+  uint16_t psum;
+  uint16_t total;
+  size_t len;
+  char ep1[IP_ENDPOINT_STR_LEN];
+  char ep2[IP_ENDPOINT_STR_LEN];
+
+  len = pb->len;
+  if (opt)
+  {
+    optlen = tcp_options_build(options, opt);
+  }
+  hdr = (struct tcp_hdr *)pbuf_push(pb, sizeof(*hdr) + optlen);
+  if (!hdr)
+  {
+    return -1;
+  }
+  memcpy(hdr + 1, options, optlen);
+  hdr->src = local->port;
+  hdr->dst = foreign->port;
+  hdr->seq = hton32(seq);
+  hdr->ack = hton32(ack);
+  hdr->off = ((sizeof(*hdr) + optlen) >> 2) << 4;
+  hdr->flg = flg;
+  hdr->wnd = hton16(wnd);
+  hdr->sum = 0;
+  hdr->up = 0;
+  pseudo.src = local->addr;
+  pseudo.dst = foreign->addr;
+  pseudo.zero = 0;
+  pseudo.protocol = IP_PROTOCOL_TCP;
+  total = sizeof(*hdr) + optlen + len;
+  pseudo.len = hton16(total);
+  psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+  hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+  debugf("%s => %s, len=%u (payload=%zu)",
+         ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
+  tcp_dump((uint8_t *)hdr, total);
+  if (ip_output_pbuf(IP_PROTOCOL_TCP, pb, local->addr, foreign->addr) == -1)
+  {
+    return -1;
+  }
+  return len;
+}
+
+static ssize_t
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, const struct tcp_options *opt, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  struct pbuf *pb;
+  ssize_t ret;
+
+  pb = pbuf_alloc(PBUF_HEADROOM, len);
+  if (!pb)
+  {
+    errorf("pbuf_alloc() failure");
+    return -1;
+  }
+  if (len)
+  {
+    memcpy(pb->data, data, len);
+  }
+  ret = tcp_output_pbuf(pb, seq, ack, flg, wnd, opt, local, foreign);
+  pbuf_free(pb);
+  return ret;
+}
+
+/*
+ * TCP Receive Buffer
+ *
+ * A ring which holds memory only while it is in use, so idle connections pin none (a
+ * receiver keeping up with a bulk transfer keeps it across the reads which drain it).
+ * Its size (the window offered) is auto-tuned to about twice the data the user reads
+ * per RTT, which keeps the window ahead of the bandwidth-delay product. The RTT is
+ * measured on the receiver side, as the time the peer takes to fill a window.
+ *
+ * NOTE: TCP Receive Buffer functions must be called after pcb->mutex locked
+ */
+
+static size_t rcvbuf_mem; /* bytes allocated for all receive buffers (atomic) */
+
+static int
+tcp_rcvbuf_charge(size_t size)
+{
+  if (__atomic_add_fetch(&rcvbuf_mem, size, __ATOMIC_RELAXED) > TCP_RCVBUF_MEM_MAX)
+  {
+    __atomic_sub_fetch(&rcvbuf_mem, size, __ATOMIC_RELAXED);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+tcp_rcvbuf_uncharge(size_t size)
+{
+  __atomic_sub_fetch(&rcvbuf_mem, size, __ATOMIC_RELAXED);
+}
+
+static void
+tcp_rcvbuf_init(struct tcp_pcb *pcb)
+{
+  pcb->rcvbuf.size = TCP_RCVBUF_INIT;
+  pcb->rcvbuf.target = TCP_RCVBUF_INIT;
+  gettimeofday(&pcb->rcvbuf.time, NULL);
+  pcb->rcv.wnd = pcb->rcvbuf.size;
+}
+
+static int
+tcp_rcvbuf_alloc(struct tcp_pcb *pcb)
+{
+  if (pcb->rcvbuf.data)
+  {
+    return 0;
+  }
+  if (tcp_rcvbuf_charge(pcb->rcvbuf.size) == -1)
+  {
+    warnf("memory pressure, total=%zu, size=%zu", __atomic_load_n(&rcvbuf_mem, __ATOMIC_RELAXED), pcb->rcvbuf.size);
+    pcb->rcvbuf.target = TCP_RCVBUF_INIT;
+    return -1;
+  }
+  pcb->rcvbuf.data = memory_alloc_raw(pcb->rcvbuf.size);
+  if (!pcb->rcvbuf.data)
+  {
+    errorf("memory_alloc_raw() failure");
+    tcp_rcvbuf_uncharge(pcb->rcvbuf.size);
+    return -1;
+  }
+  pcb->rcvbuf.head = 0;
+  return 0;
+}
+
+static void
+tcp_rcvbuf_free(struct tcp_pcb *pcb)
+{
+  if (pcb->rcvbuf.data)
+  {
+    memory_free(pcb->rcvbuf.data);
+    tcp_rcvbuf_uncharge(pcb->rcvbuf.size);
+    pcb->rcvbuf.data = NULL;
+  }
+  pcb->rcvbuf.head = 0;
+  pcb->rcvbuf.len = 0;
+}
+
+static int
+tcp_rcvbuf_resize(struct tcp_pcb *pcb, size_t size)
+{
+  uint8_t *data;
+  size_t n;
+
+  if (!pcb->rcvbuf.data)
+  {
+    pcb->rcvbuf.size = size;
+    return 0;
+  }
+  if (size > pcb->rcvbuf.size && tcp_rcvbuf_charge(size - pcb->rcvbuf.size) == -1)
+  {
+    return -1;
+  }
+  data = memory_alloc_raw(size);
+  if (!data)
+  {
+    errorf("memory_alloc_raw() failure");
+    if (size > pcb->rcvbuf.size)
+    {
+      tcp_rcvbuf_uncharge(size - pcb->rcvbuf.size);
+    }
+    return -1;
+  }
+  /* linearize, the data starts at the head of the new one */
+  n = MIN(pcb->rcvbuf.len, pcb->rcvbuf.size - pcb->rcvbuf.head);
+  memcpy(data, pcb->rcvbuf.data + pcb->rcvbuf.head, n);
+  memcpy(data + n, pcb->rcvbuf.data, pcb->rcvbuf.len - n);
+  memory_free(pcb->rcvbuf.data);
+  if (size < pcb->rcvbuf.size)
+  {
+    tcp_rcvbuf_uncharge(pcb->rcvbuf.size - size);
+  }
+  pcb->rcvbuf.data = data;
+  pcb->rcvbuf.size = size;
+  pcb->rcvbuf.head = 0;
+  return 0;
+}
+
+// store as much as the free space allows, returns the stored length (-1: no memory)
+static ssize_t
+tcp_rcvbuf_write(struct tcp_pcb *pcb, const uint8_t *data, size_t len)
+{
+  size_t tail, n;
+
+  len = MIN(len, pcb->rcvbuf.size - pcb->rcvbuf.len);
+  if (!len)
+  {
+    return 0;
+  }
+  if (tcp_rcvbuf_alloc(pcb) == -1)
+  {
+    return -1;
+  }
+  tail = (pcb->rcvbuf.head + pcb->rcvbuf.len) % pcb->rcvbuf.size;
+  n = MIN(len, pcb->rcvbuf.size - tail);
+  memcpy(pcb->rcvbuf.data + tail, data, n);
+  memcpy(pcb->rcvbuf.data, data + n, len - n);
+  pcb->rcvbuf.len += len;
+  return len;
+}
+
+static size_t
+tcp_rcvbuf_read(struct tcp_pcb *pcb, uint8_t *buf, size_t size)
+{
+  size_t len, n;
+
+  len = MIN(size, pcb->rcvbuf.len);
+  n = MIN(len, pcb->rcvbuf.size - pcb->rcvbuf.head);
+  memcpy(buf, pcb->rcvbuf.data + pcb->rcvbuf.head, n);
+  memcpy(buf + n, pcb->rcvbuf.data, len - n);
+  pcb->rcvbuf.head = (pcb->rcvbuf.head + len) % pcb->rcvbuf.size;
+  pcb->rcvbuf.len -= len;
+  if (!pcb->rcvbuf.len && pcb->rcvbuf.space * 4 < pcb->rcvbuf.size)
+  {
+    /* drained and not streaming, give the memory back until the next data */
+    tcp_rcvbuf_free(pcb);
+  }
+  return len;
+}
+
+// on arrival of in-sequence data
+static void
+tcp_rcvbuf_rtt_measure(struct tcp_pcb *pcb)
+{
+  struct timeval now, diff;
+  unsigned int sample;
+
+  gettimeofday(&now, NULL);
+  if (pcb->rcvrtt.time.tv_sec)
+  {
+    if ((int32_t)(pcb->rcv.nxt - pcb->rcvrtt.seq) < 0)
+    {
+      /* the window is not filled yet */
+      return;
+    }
+    timersub(&now, &pcb->rcvrtt.time, &diff);
+    sample = MAX(diff.tv_sec * 1000000 + diff.tv_usec, 1);
+    if (!pcb->rcvrtt.rtt)
+    {
+      pcb->rcvrtt.rtt = sample;
+    }
+    else
+    {
+      /* upper bound while the peer is not window limited, smoothed with gain 1/8 */
+      pcb->rcvrtt.rtt += ((int)sample - (int)pcb->rcvrtt.rtt) / 8;
+    }
+  }
+  pcb->rcvrtt.seq = pcb->rcv.nxt + pcb->rcv.wnd;
+  pcb->rcvrtt.time = now;
+}
+
+// once per RTT, fit the size to the data read by the user in it
+static void
+tcp_rcvbuf_tune(struct tcp_pcb *pcb, size_t copied)
+{
+  struct timeval now, diff;
+  size_t target;
+
+  pcb->rcvbuf.copied += copied;
+  if (!pcb->rcvrtt.rtt)
+  {
+    return;
+  }
+  gettimeofday(&now, NULL);
+  timersub(&now, &pcb->rcvbuf.time, &diff);
+  if ((unsigned int)(diff.tv_sec * 1000000 + diff.tv_usec) < pcb->rcvrtt.rtt)
+  {
+    return;
+  }
+  copied = pcb->rcvbuf.copied;
+  target = MIN(MAX(copied * 2, TCP_RCVBUF_INIT), pcb->rcv.wscale ? TCP_RCVBUF_MAX : TCP_RCVBUF_MAX_NOSCALE);
+  if (copied > pcb->rcvbuf.space && target > pcb->rcvbuf.size)
+  {
+    /* room for the sender to grow for one more RTT */
+    if (tcp_rcvbuf_resize(pcb, target) == 0)
+    {
+      debugf("grow, size=%zu, copied=%zu, rtt=%u", target, copied, pcb->rcvrtt.rtt);
+    }
+    pcb->rcvbuf.target = pcb->rcvbuf.size;
+  }
+  else if (copied * 4 < pcb->rcvbuf.size)
+  {
+    pcb->rcvbuf.target = target;
+  }
+  pcb->rcvbuf.space = copied;
+  pcb->rcvbuf.copied = 0;
+  pcb->rcvbuf.time = now;
+}
+
+// the window field of an outgoing segment (scaled except in SYN), its right edge is remembered
+static uint16_t
+tcp_rcvbuf_advertise(struct tcp_pcb *pcb, uint8_t flg)
+{
+  uint32_t wnd;
+  uint8_t shift;
+
+  shift = TCP_FLG_ISSET(flg, TCP_FLG_SYN) ? 0 : pcb->rcv.wscale;
+  wnd = MIN(pcb->rcv.wnd >> shift, 0xffff);
+  if ((int32_t)(pcb->rcv.nxt + (wnd << shift) - pcb->rcv.adv) > 0)
+  {
+    pcb->rcv.adv = pcb->rcv.nxt + (wnd << shift);
+  }
+  return wnd;
+}
+
+// offer the free space as the window, shrinking towards the target as far as the advertised edge allows
+static void
+tcp_rcvbuf_window(struct tcp_pcb *pcb)
+{
+  size_t size;
+
+  if (pcb->rcvbuf.target < pcb->rcvbuf.size)
+  {
+    size = MAX(pcb->rcvbuf.target, pcb->rcvbuf.len + (uint32_t)(pcb->rcv.adv - pcb->rcv.nxt));
+    if (size < pcb->rcvbuf.size && !pcb->rcvbuf.len)
+    {
+      /* the transfer has slowed down, the memory goes back (allocated again in the new size) */
+      tcp_rcvbuf_free(pcb);
+    }
+    if (size < pcb->rcvbuf.size && tcp_rcvbuf_resize(pcb, size) == 0)
+    {
+      debugf("shrink, size=%zu", size);
+    }
+  }
+  pcb->rcv.wnd = pcb->rcvbuf.size - pcb->rcvbuf.len;
+}
+
+// the window opened by the user is worth an update of its own, from zero or by two segments (RFC 1122 4.2.3.3)
+static int
+tcp_rcvbuf_update_due(struct tcp_pcb *pcb)
+{
+  int32_t gain;
+
+  gain = pcb->rcv.nxt + pcb->rcv.wnd - pcb->rcv.adv;
+  if (gain <= 0)
+  {
+    return 0;
+  }
+  return pcb->rcv.adv == pcb->rcv.nxt || (size_t)gain >= MIN(2 * (size_t)MAX(pcb->mss, TCP_MSS_DEFAULT), pcb->rcvbuf.size / 2);
+}
+
+/*
+ * TCP Reassembly
+ *
+ * Segments beyond RCV.NXT are held in a queue of sorted, non-overlapping sequence
+ * ranges (overlaps are trimmed off on insertion, and a segment continuing a range is
+ * appended to it). When the gap at RCV.NXT is filled, the ranges which became
+ * contiguous are moved into the receive buffer at once. Only the data within the
+ * window is held, bounded by bytes per connection, and it is charged to the same
+ * memory cap as the receive buffers.
+ *
+ * NOTE: TCP Reassembly functions must be called after pcb->mutex locked
+ */
+
+static int
+tcp_ooo_charge(struct tcp_pcb *pcb, size_t size)
+{
+  if (pcb->ooo.mem + size > pcb->rcvbuf.size * TCP_OOO_MEM_RATIO || tcp_rcvbuf_charge(size) == -1)
+  {
+    return -1;
+  }
+  pcb->ooo.mem += size;
+  return 0;
+}
+
+static void
+tcp_ooo_free(struct tcp_pcb *pcb, struct tcp_ooo_entry *entry)
+{
+  tcp_rcvbuf_uncharge(sizeof(*entry) + entry->size);
+  pcb->ooo.mem -= sizeof(*entry) + entry->size;
+  memory_free(entry);
+}
+
+static void
+tcp_ooo_purge(struct tcp_pcb *pcb)
+{
+  struct tcp_ooo_entry *entry;
+
+  while ((entry = pcb->ooo.head))
+  {
+    pcb->ooo.head = entry->next;
+    tcp_ooo_free(pcb, entry);
+  }
+}
+
+// make room for len more bytes at the tail of the range (*pp), it is moved when grown
+static struct tcp_ooo_entry *
+tcp_ooo_reserve(struct tcp_pcb *pcb, struct tcp_ooo_entry **pp, size_t len)
+{
+  struct tcp_ooo_entry *entry, *grown;
+  size_t size;
+
+  entry = *pp;
+  if (entry->size - entry->len >= len)
+  {
+    return entry;
+  }
+  /* doubled so that each byte is copied only a few times, but never beyond the window */
+  size = MAX(entry->size * 2, entry->len + len);
+  size = MIN(size, MAX((size_t)(pcb->rcv.nxt + pcb->rcv.wnd - entry->seq), entry->len + len));
+  if (tcp_ooo_charge(pcb, size - entry->size) == -1)
+  {
+    return NULL;
+  }
+  grown = memory_alloc_raw(sizeof(*grown) + size);
+  if (!grown)
+  {
+    errorf("memory_alloc_raw() failure");
+    tcp_rcvbuf_uncharge(size - entry->size);
+    pcb->ooo.mem -= size - entry->size;
+    return NULL;
+  }
+  *grown = *entry;
+  grown->size = size;
+  memcpy(grown->data, entry->data, entry->len);
+  *pp = grown;
+  memory_free(entry);
+  return grown;
+}
+
+// hold a segment beyond RCV.NXT
+static void
+tcp_ooo_insert(struct tcp_pcb *pcb, uint32_t seq, const uint8_t *data, size_t len, int fin)
+{
+  struct tcp_ooo_entry **pp, **prevp = NULL, *next, *entry;
+  size_t skip;
+
+  /* skip the ranges ending before it, and trim the front off which overlaps the previous one */
+  for (pp = &pcb->ooo.head; *pp && TCP_SEQ_LEQ((*pp)->seq + (*pp)->len, seq); pp = &(*pp)->next)
+  {
+    if ((*pp)->fin)
+    {
+      /* beyond FIN, nothing to hold */
+      return;
+    }
+    prevp = pp;
+  }
+  if (*pp && TCP_SEQ_LEQ((*pp)->seq, seq))
+  {
+    skip = (*pp)->seq + (*pp)->len - seq;
+    if (skip >= len || (*pp)->fin)
+    {
+      /* duplicate, or beyond FIN */
+      return;
+    }
+    seq += skip;
+    data += skip;
+    len -= skip;
+    prevp = pp;
+    pp = &(*pp)->next;
+  }
+  /* drop the ranges it covers, and trim the tail off which overlaps the next one */
+  while ((next = *pp) && TCP_SEQ_LEQ(next->seq + next->len, seq + len) && !next->fin)
+  {
+    *pp = next->next;
+    tcp_ooo_free(pcb, next);
+  }
+  if (next && TCP_SEQ_LT(next->seq, seq + len))
+  {
+    len = next->seq - seq;
+    fin = 0;
+  }
+  if (!len && !fin)
+  {
+    return;
+  }
+  if (prevp && (*prevp)->seq + (*prevp)->len == seq)
+  {
+    /* continues the previous range, appended to it */
+    entry = tcp_ooo_reserve(pcb, prevp, len);
+    if (!entry)
+    {
+      debugf("too much held, mem=%zu", pcb->ooo.mem);
+      return;
+    }
+    memcpy(entry->data + entry->len, data, len);
+    entry->len += len;
+    entry->fin = fin;
+    pp = prevp;
+  }
+  else
+  {
+    if (tcp_ooo_charge(pcb, sizeof(*entry) + len) == -1)
+    {
+      debugf("too much held, mem=%zu", pcb->ooo.mem);
+      return;
+    }
+    entry = memory_alloc_raw(sizeof(*entry) + len);
+    if (!entry)
+    {
+      errorf("memory_alloc_raw() failure");
+      tcp_rcvbuf_uncharge(sizeof(*entry) + len);
+      pcb->ooo.mem -= sizeof(*entry) + len;
+      return;
+    }
+    entry->seq = seq;
+    entry->len = len;
+    entry->size = len;
+    entry->fin = fin;
+    memcpy(entry->data, data, len);
+    entry->next = next;
+    *pp = entry;
+  }
+  /* the gap to the next range is filled, they become one */
+  if (next && !entry->fin && entry->seq + entry->len == next->seq)
+  {
+    entry = tcp_ooo_reserve(pcb, pp, next->len);
+    if (entry)
+    {
+      memcpy(entry->data + entry->len, next->data, next->len);
+      entry->len += next->len;
+      entry->fin = next->fin;
+      entry->next = next->next;
+      tcp_ooo_free(pcb, next);
+    }
+  }
+  debugf("held, seq=%u, len=%zu, mem=%zu", seq, len, pcb->ooo.mem);
+}
+
+// the held ranges as SACK blocks (RFC 2018), the one with the latest segment first, returns the number
+static int
+tcp_ooo_sack(struct tcp_pcb *pcb, struct tcp_sack_block *blocks, int max)
+{
+  struct tcp_ooo_entry *entry;
+  uint32_t left, right;
+  int num = 0, pass, latest;
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    entry = pcb->ooo.head;
+    while (entry && num < max)
+    {
+      /* adjacent entries make one block */
+      left = entry->seq;
+      right = entry->seq + entry->len;
+      for (entry = entry->next; entry && entry->seq == right; entry = entry->next)
+      {
+        right += entry->len;
+      }
+      latest = TCP_SEQ_LEQ(left, pcb->ooo.last) && TCP_SEQ_LT(pcb->ooo.last, right);
+      if (left == right || latest == pass)
+      {
+        /* the latest one in the first pass, the rest in the second */
+        continue;
+      }
+      blocks[num].left = left;
+      blocks[num].right = right;
+      num++;
+    }
+  }
+  return num;
+}
+
+/*
+ * store the text of a segment, trimmed to the window
+ * *fin: in: the segment carries FIN, out: FIN is at RCV.NXT (i.e. all the text before it is stored)
+ */
+static int
+tcp_reass(struct tcp_pcb *pcb, uint32_t seq, const uint8_t *data, size_t len, int *fin)
+{
+  struct tcp_ooo_entry *entry;
+  uint32_t right;
+  size_t skip;
+  ssize_t stored;
+
+  if (TCP_SEQ_LT(seq, pcb->rcv.nxt))
+  {
+    skip = MIN(pcb->rcv.nxt - seq, len);
+    seq += skip;
+    data += skip;
+    len -= skip;
+  }
+  right = pcb->rcv.nxt + pcb->rcv.wnd;
+  if (TCP_SEQ_LT(right, seq + len))
+  {
+    len = TCP_SEQ_LT(seq, right) ? right - seq : 0;
+    *fin = 0; /* beyond the window */
+  }
+  if (seq != pcb->rcv.nxt)
+  {
+    pcb->ooo.last = seq;
+    tcp_ooo_insert(pcb, seq, data, len, *fin);
+    *fin = 0;
+    return 0;
+  }
+  stored = tcp_rcvbuf_write(pcb, data, len);
+  if (stored == -1)
+  {
+    *fin = 0;
+    return -1;
+  }
+  pcb->rcv.nxt += stored;
+  /* the gap is filled, pull the ranges which became contiguous */
+  while ((entry = pcb->ooo.head) && TCP_SEQ_LEQ(entry->seq, pcb->rcv.nxt) && !*fin)
+  {
+    skip = MIN(pcb->rcv.nxt - entry->seq, entry->len);
+    stored = tcp_rcvbuf_write(pcb, entry->data + skip, entry->len - skip);
+    if (stored == -1)
+    {
+      /* keep it, the rest is retried with the next segment */
+      break;
+    }
+    pcb->rcv.nxt += stored;
+    *fin = entry->fin;
+    pcb->ooo.head = entry->next;
+    debugf("merged, seq=%u, len=%zu", entry->seq, entry->len);
+    tcp_ooo_free(pcb, entry);
+  }
+  if (*fin)
+  {
+    pcb->rcv.nxt++; /* FIN consumes one sequence number */
+  }
+  return 0;
+}
+
+/*
+ * TCP Send Buffer
+ *
+ * A ring holding the data from SND.UNA on, in flight or not sent yet. The user only
+ * copies into it, segments are cut from it as the window allows (on send and on every
+ * ACK), and retransmitted from it. So the data is copied once more, into the pbuf.
+ * Like the receive buffer, it holds memory only while it is in use, but is kept
+ * across drains as long as the connection is streaming. It starts small and is doubled
+ * whenever the user finds it full while the window could take more than half of it.
+ *
+ * NOTE: TCP Send Buffer functions must be called after pcb->mutex locked
+ */
+
+static size_t sndbuf_mem; /* bytes the send buffers have grown beyond TCP_SNDBUF_INIT (atomic) */
+
+static int
+tcp_sndbuf_charge(size_t size)
+{
+  if (__atomic_add_fetch(&sndbuf_mem, size, __ATOMIC_RELAXED) > TCP_SNDBUF_MEM_MAX)
+  {
+    __atomic_sub_fetch(&sndbuf_mem, size, __ATOMIC_RELAXED);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+tcp_sndbuf_uncharge(size_t size)
+{
+  __atomic_sub_fetch(&sndbuf_mem, size, __ATOMIC_RELAXED);
+}
+
+static void
+tcp_sndbuf_free(struct tcp_pcb *pcb)
+{
+  if (pcb->sndbuf.data)
+  {
+    memory_free(pcb->sndbuf.data);
+    tcp_sndbuf_uncharge(pcb->sndbuf.size - TCP_SNDBUF_INIT);
+    pcb->sndbuf.data = NULL;
+  }
+  pcb->sndbuf.size = TCP_SNDBUF_INIT;
+  pcb->sndbuf.head = 0;
+  pcb->sndbuf.len = 0;
+}
+
+// the ring holds the sender back when it cannot take two windows, one in flight and the next one (-1: not grown)
+static int
+tcp_sndbuf_expand(struct tcp_pcb *pcb)
+{
+  uint8_t *data;
+  size_t size, n;
+
+  if (pcb->sndbuf.size >= TCP_SNDBUF_MAX || 2 * (size_t)MIN(pcb->cc.cwnd, pcb->snd.wnd) <= pcb->sndbuf.size)
+  {
+    return -1;
+  }
+  size = MIN(pcb->sndbuf.size * 2, TCP_SNDBUF_MAX);
+  if (tcp_sndbuf_charge(size - pcb->sndbuf.size) == -1)
+  {
+    warnf("memory pressure, total=%zu, size=%zu", __atomic_load_n(&sndbuf_mem, __ATOMIC_RELAXED), pcb->sndbuf.size);
+    return -1;
+  }
+  data = memory_alloc_raw(size);
+  if (!data)
+  {
+    errorf("memory_alloc_raw() failure");
+    tcp_sndbuf_uncharge(size - pcb->sndbuf.size);
+    return -1;
+  }
+  /* linearize, SND.UNA at the head of the new one */
+  n = MIN(pcb->sndbuf.len, pcb->sndbuf.size - pcb->sndbuf.head);
+  memcpy(data, pcb->sndbuf.data + pcb->sndbuf.head, n);
+  memcpy(data + n, pcb->sndbuf.data, pcb->sndbuf.len - n);
+  memory_free(pcb->sndbuf.data);
+  pcb->sndbuf.data = data;
+  pcb->sndbuf.size = size;
+  pcb->sndbuf.head = 0;
+  debugf("grow, size=%zu, cwnd=%u, wnd=%u", size, pcb->cc.cwnd, pcb->snd.wnd);
+  return 0;
+}
+
+// copy as much as the free space allows, returns the copied length (-1: no memory)
+static ssize_t
+tcp_sndbuf_write(struct tcp_pcb *pcb, const uint8_t *data, size_t len)
+{
+  size_t tail, n;
+
+  if (!pcb->sndbuf.data)
+  {
+    pcb->sndbuf.data = memory_alloc_raw(pcb->sndbuf.size);
+    if (!pcb->sndbuf.data)
+    {
+      errorf("memory_alloc_raw() failure");
+      return -1;
+    }
+    pcb->sndbuf.head = 0;
+  }
+  len = MIN(len, pcb->sndbuf.size - pcb->sndbuf.len);
+  tail = (pcb->sndbuf.head + pcb->sndbuf.len) % pcb->sndbuf.size;
+  n = MIN(len, pcb->sndbuf.size - tail);
+  memcpy(pcb->sndbuf.data + tail, data, n);
+  memcpy(pcb->sndbuf.data, data + n, len - n);
+  pcb->sndbuf.len += len;
+  return len;
+}
+
+// copy len bytes at offset (from SND.UNA) out
+static void
+tcp_sndbuf_peek(struct tcp_pcb *pcb, size_t offset, uint8_t *buf, size_t len)
+{
+  size_t pos, n;
+
+  pos = (pcb->sndbuf.head + offset) % pcb->sndbuf.size;
+  n = MIN(len, pcb->sndbuf.size - pos);
+  memcpy(buf, pcb->sndbuf.data + pos, n);
+  memcpy(buf + n, pcb->sndbuf.data, len - n);
+}
+
+// once per RTT, the data acknowledged in it tells whether the connection is streaming
+static void
+tcp_sndbuf_measure(struct tcp_pcb *pcb, size_t acked)
+{
+  struct timeval now, diff;
+
+  pcb->sndbuf.acked += acked;
+  gettimeofday(&now, NULL);
+  timersub(&now, &pcb->sndbuf.time, &diff);
+  if ((unsigned int)(diff.tv_sec * 1000000 + diff.tv_usec) < pcb->rtt.srtt)
+  {
+    return;
+  }
+  pcb->sndbuf.space = pcb->sndbuf.acked;
+  pcb->sndbuf.acked = 0;
+  pcb->sndbuf.time = now;
+}
+
+// SND.UNA advances to ack, drop the acknowledged data
+static void
+tcp_sndbuf_ack(struct tcp_pcb *pcb, uint32_t ack)
+{
+  size_t acked;
+
+  acked = ack - pcb->snd.una;
+  if (pcb->snd.una == pcb->iss)
+  {
+    acked--; /* SYN */
+  }
+  acked = MIN(acked, pcb->sndbuf.len); /* the rest is FIN */
+  pcb->snd.una = ack;
+  if (!acked)
+  {
+    return;
+  }
+  pcb->sndbuf.head = (pcb->sndbuf.head + acked) % pcb->sndbuf.size;
+  pcb->sndbuf.len -= acked;
+  tcp_sndbuf_measure(pcb, acked);
+  if (!pcb->sndbuf.len && pcb->sndbuf.space * 4 < pcb->sndbuf.size)
+  {
+    /* drained and not streaming, give the memory back until the next data */
+    tcp_sndbuf_free(pcb);
+  }
+  /* space for the senders */
+  sched_wakeup(&pcb->ctx);
+}
+
+// send len bytes of the data from seq (the part already acknowledged is skipped)
+static ssize_t
+tcp_output_data(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, size_t len)
+{
+  struct pbuf *pb;
+  struct tcp_options opt;
+  size_t skip;
+  ssize_t ret;
+
+  skip = (int32_t)(pcb->snd.una - seq) > 0 ? pcb->snd.una - seq : 0;
+  if (skip >= len)
+  {
+    return 0;
+  }
+  seq += skip;
+  len -= skip;
+  pb = pbuf_alloc(PBUF_HEADROOM, len);
+  if (!pb)
+  {
+    errorf("pbuf_alloc() failure");
+    return -1;
+  }
+  tcp_sndbuf_peek(pcb, seq - pcb->snd.una, pb->data, len);
+  tcp_options_fill(pcb, flg, len, &opt);
+  tcp_delack_sent(pcb);
+  ret = tcp_output_pbuf(pb, seq, pcb->rcv.nxt, flg, tcp_rcvbuf_advertise(pcb, flg), &opt, &pcb->local, &pcb->foreign);
+  pbuf_free(pb);
+  return ret;
+}
+
+// sequence space of the segment (SYN and FIN take one each), counted in cc.lost as the bytes
+static uint32_t
+tcp_queue_entry_seqlen(struct tcp_queue_entry *entry)
+{
+  return entry->len + TCP_FLG_ISSET(entry->flg, TCP_FLG_SYN) + TCP_FLG_ISSET(entry->flg, TCP_FLG_FIN);
+}
+
+/*
+ * TCP SACK Scoreboard (RFC 6675)
+ *
+ * The segments in the retransmit queue reported by SACK blocks are marked, so that
+ * only the holes are retransmitted. A hole is considered lost when enough data has
+ * arrived beyond it, and is then sent again by the ACK clock like the lost ones after
+ * RTO.
+ *
+ * NOTE: TCP SACK Scoreboard functions must be called after pcb->mutex locked
+ */
+
+// mark the segments covered by the SACK blocks of an incoming ACK
+static void
+tcp_sack_update(struct tcp_pcb *pcb, const struct tcp_options *opt)
+{
+  struct queue_entry *e;
+  struct tcp_queue_entry *entry;
+  const struct tcp_sack_block *block;
+  int i;
+
+  if (!(pcb->options & TCP_OPT_F_SACK_PERM) || !(opt->flags & TCP_OPT_F_SACK))
+  {
+    return;
+  }
+  for (i = 0; i < opt->nsack; i++)
+  {
+    block = &opt->sack[i];
+    if (!TCP_SEQ_LT(block->left, block->right) || TCP_SEQ_LT(block->left, pcb->snd.una) || TCP_SEQ_LT(pcb->snd.nxt, block->right))
+    {
+      /* broken, or already acknowledged (D-SACK) */
+      continue;
+    }
+    for (e = pcb->queue.head; e; e = e->next)
+    {
+      entry = queue_data(e, struct tcp_queue_entry, link);
+      if (TCP_SEQ_LEQ(block->right, entry->seq))
+      {
+        break;
+      }
+      if (entry->sacked || !entry->len || TCP_SEQ_LT(entry->seq, block->left) || TCP_SEQ_LT(block->right, entry->seq + entry->len))
+      {
+        continue;
+      }
+      entry->sacked = 1;
+      pcb->cc.sacked += entry->len;
+      if (entry->lost)
+      {
+        /* the original has arrived after all */
+        entry->lost = 0;
+        pcb->cc.lost -= tcp_queue_entry_seqlen(entry);
+      }
+    }
+  }
+}
+
+// the hole at SND.UNA has more than (DupThresh - 1) * SMSS bytes SACKed beyond it (IsLost)
+static int
+tcp_sack_head_lost(struct tcp_pcb *pcb)
+{
+  return (pcb->options & TCP_OPT_F_SACK_PERM) && pcb->cc.sacked > (TCP_DUPACK_THRESH - 1) * pcb->mss;
+}
+
+// mark the holes considered lost and not retransmitted in the recovery yet
+static void
+tcp_sack_mark_lost(struct tcp_pcb *pcb)
+{
+  struct queue_entry *e;
+  struct tcp_queue_entry *entry;
+  size_t sacked = 0;
+
+  for (e = pcb->queue.head; e; e = e->next)
+  {
+    entry = queue_data(e, struct tcp_queue_entry, link);
+    if (entry->sacked)
+    {
+      sacked += entry->len;
+      continue;
+    }
+    if (pcb->cc.sacked - sacked <= (TCP_DUPACK_THRESH - 1) * pcb->mss)
+    {
+      /* not enough beyond this one, nor the later ones */
+      break;
+    }
+    if (!entry->lost && TCP_SEQ_LEQ(pcb->cc.high_rxt, entry->seq))
+    {
+      entry->lost = 1;
+      pcb->cc.lost += tcp_queue_entry_seqlen(entry);
+    }
+  }
+}
+
+/*
+ * TCP Congestion Control
+ *
+ * The window is kept in bytes (RFC 5681). The algorithms only decide how cwnd
+ * grows and how far it is reduced on a loss, the bookkeeping around them (the
+ * initial window, the loss window after RTO, the pipe) is common.
+ *
+ * NOTE: TCP Congestion Control functions must be called after pcb->mutex locked
+ */
+
+// micro seconds
+static uint64_t
+tcp_cc_now(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static uint32_t
+tcp_cc_flight_half(struct tcp_pcb *pcb)
+{
+  return MAX((pcb->snd.nxt - pcb->snd.una) / 2, 2 * pcb->mss);
+}
+
+// bytes in flight and not considered lost (RFC 6675 "pipe")
+static size_t
+tcp_cc_pipe(struct tcp_pcb *pcb)
+{
+  size_t flight;
+
+  flight = pcb->snd.nxt - pcb->snd.una;
+  return flight > pcb->cc.lost + pcb->cc.sacked ? flight - pcb->cc.lost - pcb->cc.sacked : 0;
+}
+
+// NewReno (RFC 5681, RFC 6582)
+
+struct tcp_newreno
+{
+  uint32_t acked; /* bytes acknowledged in congestion avoidance, toward the next increment */
+};
+
+static void
+tcp_newreno_init(struct tcp_pcb *pcb)
+{
+  struct tcp_newreno *ca = (struct tcp_newreno *)pcb->cc.priv;
+
+  ca->acked = 0;
+}
+
+static void
+tcp_newreno_ack(struct tcp_pcb *pcb, const struct tcp_rate_sample *rs)
+{
+  struct tcp_newreno *ca = (struct tcp_newreno *)pcb->cc.priv;
+  uint32_t acked = rs->acked;
+
+  if (pcb->cc.cwnd < pcb->cc.ssthresh)
+  {
+    /* slow start */
+    pcb->cc.cwnd += MIN(acked, TCP_ABC_LIMIT * pcb->mss);
+    return;
+  }
+  /* congestion avoidance, one segment per window */
+  ca->acked += acked;
+  if (ca->acked >= pcb->cc.cwnd)
+  {
+    ca->acked -= pcb->cc.cwnd;
+    pcb->cc.cwnd += pcb->mss;
+  }
+}
+
+static void
+tcp_newreno_loss(struct tcp_pcb *pcb)
+{
+  pcb->cc.ssthresh = tcp_cc_flight_half(pcb);
+}
+
+static const struct tcp_congestion_ops tcp_newreno = {
+    .name = "newreno",
+    .init = tcp_newreno_init,
+    .ack = tcp_newreno_ack,
+    .loss = tcp_newreno_loss,
+    .timeout = tcp_newreno_loss,
+};
+
+// CUBIC (RFC 9438) with HyStart++ slow start exit (RFC 9406, delay increase, then conservative slow start)
+
+#define TCP_CUBIC_C 0.4
+#define TCP_CUBIC_BETA 0.7
+#define TCP_HYSTART_MIN_SAMPLES 8
+#define TCP_HYSTART_LOW_WINDOW 16 /* segments */
+#define TCP_HYSTART_DELAY_MIN 4000 /* micro seconds */
+#define TCP_HYSTART_DELAY_MAX 16000
+#define TCP_HYSTART_CSS_GROWTH_DIVISOR 4
+#define TCP_HYSTART_CSS_ROUNDS 5
+
+struct tcp_cubic
+{
+  uint64_t epoch;   /* start of the congestion avoidance (micro seconds, 0: not started) */
+  double w_est;     /* Reno-friendly window (bytes) */
+  uint32_t w_max;   /* window before the last reduction (bytes) */
+  uint32_t origin;  /* window at the plateau of the curve (bytes) */
+  uint32_t k;       /* time to reach the origin (micro seconds) */
+  uint32_t acked;   /* bytes acknowledged, toward the next increment */
+  uint32_t rtt_min; /* micro seconds */
+  /* HyStart */
+  uint32_t round_end;
+  uint32_t round_rtt;      /* the minimum in the current round */
+  uint32_t last_round_rtt; /* the minimum in the last round */
+  uint32_t samples;
+  uint32_t css_baseline; /* the minimum when the increase was found (0: not in conservative slow start) */
+  uint32_t css_rounds;
+};
+
+static double
+tcp_cubic_cbrt(double x)
+{
+  double y = 1.0;
+  int i;
+
+  if (x <= 0.0)
+  {
+    return 0.0;
+  }
+  while (y * y * y < x)
+  {
+    y *= 2.0;
+  }
+  /* Newton's method, converges quickly from above */
+  for (i = 0; i < 32; i++)
+  {
+    y -= (y - x / (y * y)) / 3.0;
+  }
+  return y;
+}
+
+static void
+tcp_cubic_init(struct tcp_pcb *pcb)
+{
+  struct tcp_cubic *ca = (struct tcp_cubic *)pcb->cc.priv;
+
+  ca->w_max = pcb->cc.cwnd;
+  ca->round_end = pcb->snd.nxt;
+  ca->round_rtt = UINT32_MAX;
+  ca->last_round_rtt = UINT32_MAX;
+}
+
+// leave slow start before overshooting, when the RTT starts growing with the queue
+static void
+tcp_cubic_hystart(struct tcp_pcb *pcb, unsigned int rtt)
+{
+  struct tcp_cubic *ca = (struct tcp_cubic *)pcb->cc.priv;
+  uint32_t thresh;
+
+  if (TCP_SEQ_LEQ(ca->round_end, pcb->snd.una))
+  {
+    /* a new round */
+    ca->round_end = pcb->snd.nxt;
+    ca->last_round_rtt = ca->round_rtt;
+    ca->round_rtt = UINT32_MAX;
+    ca->samples = 0;
+    if (ca->css_baseline && ++ca->css_rounds >= TCP_HYSTART_CSS_ROUNDS)
+    {
+      /* the RTT has stayed up, the queue is real */
+      pcb->cc.ssthresh = pcb->cc.cwnd;
+      ca->css_baseline = 0;
+      debugf("exit slow start, cwnd=%u, rtt=%u", pcb->cc.cwnd, ca->last_round_rtt);
+      return;
+    }
+  }
+  if (!rtt)
+  {
+    return;
+  }
+  ca->round_rtt = MIN(ca->round_rtt, rtt);
+  ca->samples++;
+  if (ca->samples < TCP_HYSTART_MIN_SAMPLES || ca->last_round_rtt == UINT32_MAX)
+  {
+    return;
+  }
+  if (ca->css_baseline)
+  {
+    if (ca->round_rtt < ca->css_baseline)
+    {
+      /* the increase was by a burst, not a queue */
+      ca->css_baseline = 0;
+      debugf("resume slow start, cwnd=%u, rtt=%u", pcb->cc.cwnd, ca->round_rtt);
+    }
+    return;
+  }
+  if (pcb->cc.cwnd < TCP_HYSTART_LOW_WINDOW * pcb->mss)
+  {
+    return;
+  }
+  thresh = MIN(MAX(ca->last_round_rtt / 8, TCP_HYSTART_DELAY_MIN), TCP_HYSTART_DELAY_MAX);
+  if (ca->round_rtt >= ca->last_round_rtt + thresh)
+  {
+    /* not left at once, it may be spurious (RFC 9406 4.2) */
+    ca->css_baseline = ca->round_rtt;
+    ca->css_rounds = 0;
+    debugf("conservative slow start, cwnd=%u, rtt=%u", pcb->cc.cwnd, ca->round_rtt);
+  }
+}
+
+static void
+tcp_cubic_ack(struct tcp_pcb *pcb, const struct tcp_rate_sample *rs)
+{
+  struct tcp_cubic *ca = (struct tcp_cubic *)pcb->cc.priv;
+  uint64_t now;
+  double t, w_cubic, mss;
+  uint32_t acked = rs->acked, target, inc;
+  unsigned int rtt = rs->rtt;
+
+  if (rtt && (!ca->rtt_min || rtt < ca->rtt_min))
+  {
+    ca->rtt_min = rtt;
+  }
+  if (pcb->cc.cwnd < pcb->cc.ssthresh)
+  {
+    tcp_cubic_hystart(pcb, rtt);
+    pcb->cc.cwnd += MIN(acked, TCP_ABC_LIMIT * pcb->mss) / (ca->css_baseline ? TCP_HYSTART_CSS_GROWTH_DIVISOR : 1);
+    return;
+  }
+  mss = pcb->mss;
+  now = tcp_cc_now();
+  if (!ca->epoch)
+  {
+    ca->epoch = now;
+    if (pcb->cc.cwnd < ca->w_max)
+    {
+      ca->k = tcp_cubic_cbrt((ca->w_max - pcb->cc.cwnd) / mss / TCP_CUBIC_C) * 1000000;
+      ca->origin = ca->w_max;
+    }
+    else
+    {
+      ca->k = 0;
+      ca->origin = pcb->cc.cwnd;
+    }
+    ca->w_est = pcb->cc.cwnd;
+    ca->acked = 0;
+  }
+  /* where the curve will be an RTT later */
+  t = (double)(now - ca->epoch + ca->rtt_min) / 1000000 - (double)ca->k / 1000000;
+  w_cubic = TCP_CUBIC_C * t * t * t * mss + ca->origin;
+  target = MIN(MAX(w_cubic, pcb->cc.cwnd), pcb->cc.cwnd * 1.5);
+  /* TCP-friendly region, never slower than Reno would be */
+  ca->w_est += 3.0 * (1.0 - TCP_CUBIC_BETA) / (1.0 + TCP_CUBIC_BETA) * acked * mss / pcb->cc.cwnd;
+  if (ca->w_est > target)
+  {
+    target = ca->w_est;
+  }
+  ca->acked += acked;
+  inc = (uint64_t)(target - pcb->cc.cwnd) * ca->acked / pcb->cc.cwnd;
+  if (inc)
+  {
+    pcb->cc.cwnd += inc;
+    ca->acked = 0;
+  }
+}
+
+static void
+tcp_cubic_loss(struct tcp_pcb *pcb)
+{
+  struct tcp_cubic *ca = (struct tcp_cubic *)pcb->cc.priv;
+
+  if (pcb->cc.cwnd < ca->w_max)
+  {
+    /* fast convergence, release bandwidth for the new flows */
+    ca->w_max = pcb->cc.cwnd * (1.0 + TCP_CUBIC_BETA) / 2.0;
+  }
+  else
+  {
+    ca->w_max = pcb->cc.cwnd;
+  }
+  pcb->cc.ssthresh = MAX(pcb->cc.cwnd * TCP_CUBIC_BETA, 2 * pcb->mss);
+  ca->epoch = 0;
+  ca->css_baseline = 0;
+}
+
+static void
+tcp_cubic_timeout(struct tcp_pcb *pcb)
+{
+  struct tcp_cubic *ca = (struct tcp_cubic *)pcb->cc.priv;
+
+  tcp_cubic_loss(pcb);
+  /* slow start again, HyStart from scratch */
+  ca->round_end = pcb->snd.nxt;
+  ca->round_rtt = UINT32_MAX;
+  ca->last_round_rtt = UINT32_MAX;
+}
+
+static const struct tcp_congestion_ops tcp_cubic = {
+    .name = "cubic",
+    .init = tcp_cubic_init,
+    .ack = tcp_cubic_ack,
+    .loss = tcp_cubic_loss,
+    .timeout = tcp_cubic_timeout,
+};
+
+// BBR (model based: bottleneck bandwidth and min RTT from the delivery rate, sent with pacing)
+
+#define TCP_BBR_UNIT 256 /* gains are in 1/256 */
+#define TCP_BBR_HIGH_GAIN 739 /* 2/ln(2), doubles the delivery rate every round */
+#define TCP_BBR_DRAIN_GAIN 88 /* 1/HIGH_GAIN */
+#define TCP_BBR_CWND_GAIN 512
+#define TCP_BBR_BW_ROUNDS 10
+#define TCP_BBR_FULL_BW_ROUNDS 3
+#define TCP_BBR_MIN_RTT_WINDOW 10000000 /* micro seconds */
+#define TCP_BBR_PROBE_RTT_TIME 200000   /* micro seconds */
+#define TCP_BBR_MIN_CWND 4 /* segments */
+
+#define TCP_BBR_STARTUP 0
+#define TCP_BBR_DRAIN 1
+#define TCP_BBR_PROBE_BW 2
+#define TCP_BBR_PROBE_RTT 3
+
+static const uint16_t tcp_bbr_cycle[] = {320, 192, 256, 256, 256, 256, 256, 256};
+
+struct tcp_bbr
+{
+  uint64_t next_round_delivered; /* a round ends when the data sent at this point is acknowledged */
+  uint64_t min_rtt_stamp;
+  uint64_t cycle_stamp;
+  uint64_t probe_rtt_done;           /* 0: the inflight has not drained yet */
+  uint32_t bw[TCP_BBR_BW_ROUNDS];    /* max delivery rate of the recent rounds (bytes per second) */
+  uint32_t full_bw;
+  uint32_t full_bw_count;
+  uint32_t min_rtt; /* micro seconds (0: no sample yet) */
+  uint32_t round;
+  uint32_t prior_cwnd;
+  uint16_t pacing_gain;
+  uint16_t cwnd_gain;
+  uint8_t mode;
+  uint8_t cycle;
+  uint8_t filled; /* the bottleneck bandwidth has been reached */
+};
+
+static uint32_t
+tcp_bbr_bw(struct tcp_bbr *ca)
+{
+  uint32_t bw = 0;
+  int i;
+
+  for (i = 0; i < TCP_BBR_BW_ROUNDS; i++)
+  {
+    bw = MAX(bw, ca->bw[i]);
+  }
+  return bw;
+}
+
+// bandwidth-delay product scaled by gain (bytes)
+static uint32_t
+tcp_bbr_bdp(struct tcp_pcb *pcb, struct tcp_bbr *ca, unsigned int gain)
+{
+  uint64_t bdp;
+
+  if (!ca->min_rtt || !tcp_bbr_bw(ca))
+  {
+    /* no model yet */
+    return MIN(10 * pcb->mss, MAX(2 * pcb->mss, 14600)) * gain / TCP_BBR_UNIT;
+  }
+  bdp = (uint64_t)tcp_bbr_bw(ca) * ca->min_rtt / 1000000;
+  return MIN(bdp * gain / TCP_BBR_UNIT, UINT32_MAX);
+}
+
+static void
+tcp_bbr_pacing(struct tcp_pcb *pcb, struct tcp_bbr *ca)
+{
+  uint64_t rate;
+  unsigned int rtt;
+
+  if (tcp_bbr_bw(ca))
+  {
+    rate = (uint64_t)tcp_bbr_bw(ca) * ca->pacing_gain / TCP_BBR_UNIT;
+  }
+  else
+  {
+    /* the initial window over the RTT of the handshake */
+    rtt = pcb->rtt.srtt ? pcb->rtt.srtt : 1000;
+    rate = (uint64_t)pcb->cc.cwnd * 1000000 / rtt * ca->pacing_gain / TCP_BBR_UNIT;
+  }
+  if (ca->filled || rate > pcb->cc.pacing_rate)
+  {
+    /* never slower in STARTUP, the estimate may lag behind */
+    pcb->cc.pacing_rate = MAX(rate, pcb->mss);
+  }
+}
+
+static void
+tcp_bbr_probe_bw(struct tcp_bbr *ca, uint64_t now)
+{
+  ca->mode = TCP_BBR_PROBE_BW;
+  ca->cwnd_gain = TCP_BBR_CWND_GAIN;
+  ca->cycle = (now / 1000) % countof(tcp_bbr_cycle); /* desynchronize the flows */
+  if (ca->cycle == 1)
+  {
+    ca->cycle = 2; /* not draining right after entering */
+  }
+  ca->pacing_gain = tcp_bbr_cycle[ca->cycle];
+  ca->cycle_stamp = now;
+}
+
+static void
+tcp_bbr_init(struct tcp_pcb *pcb)
+{
+  struct tcp_bbr *ca = (struct tcp_bbr *)pcb->cc.priv;
+
+  ca->mode = TCP_BBR_STARTUP;
+  ca->pacing_gain = TCP_BBR_HIGH_GAIN;
+  ca->cwnd_gain = TCP_BBR_HIGH_GAIN;
+  ca->min_rtt = pcb->rtt.srtt;
+  ca->min_rtt_stamp = tcp_cc_now();
+  ca->next_round_delivered = pcb->cc.delivered;
+  ca->prior_cwnd = pcb->cc.cwnd;
+  tcp_bbr_pacing(pcb, ca);
+}
+
+static void
+tcp_bbr_ack(struct tcp_pcb *pcb, const struct tcp_rate_sample *rs)
+{
+  struct tcp_bbr *ca = (struct tcp_bbr *)pcb->cc.priv;
+  uint64_t now, bw;
+  uint32_t target, min_cwnd;
+  int round_start = 0, expired;
+
+  now = tcp_cc_now();
+  /* the model: the max delivery rate of the recent rounds and the min RTT of the recent seconds */
+  if (rs->delivered && rs->prior_delivered >= ca->next_round_delivered)
+  {
+    ca->next_round_delivered = pcb->cc.delivered;
+    ca->round++;
+    ca->bw[ca->round % TCP_BBR_BW_ROUNDS] = 0;
+    round_start = 1;
+  }
+  if (rs->delivered && rs->interval)
+  {
+    bw = MIN(rs->delivered * 1000000 / rs->interval, UINT32_MAX);
+    ca->bw[ca->round % TCP_BBR_BW_ROUNDS] = MAX(ca->bw[ca->round % TCP_BBR_BW_ROUNDS], bw);
+  }
+  expired = now - ca->min_rtt_stamp > TCP_BBR_MIN_RTT_WINDOW;
+  if (rs->rtt && (!ca->min_rtt || rs->rtt <= ca->min_rtt || expired))
+  {
+    ca->min_rtt = rs->rtt;
+    ca->min_rtt_stamp = now;
+  }
+  /* the pipe is full when the bandwidth stops growing by 25% for a few rounds */
+  if (!ca->filled && round_start)
+  {
+    if (tcp_bbr_bw(ca) >= (uint64_t)ca->full_bw * 5 / 4)
+    {
+      ca->full_bw = tcp_bbr_bw(ca);
+      ca->full_bw_count = 0;
+    }
+    else if (++ca->full_bw_count >= TCP_BBR_FULL_BW_ROUNDS)
+    {
+      ca->filled = 1;
+      debugf("pipe filled, bw=%u, min_rtt=%u", tcp_bbr_bw(ca), ca->min_rtt);
+    }
+  }
+  /* the state machine */
+  switch (ca->mode)
+  {
+  case TCP_BBR_STARTUP:
+    if (ca->filled)
+    {
+      ca->mode = TCP_BBR_DRAIN;
+      ca->pacing_gain = TCP_BBR_DRAIN_GAIN;
+    }
+    break;
+  case TCP_BBR_DRAIN:
+    if (tcp_cc_pipe(pcb) <= tcp_bbr_bdp(pcb, ca, TCP_BBR_UNIT))
+    {
+      tcp_bbr_probe_bw(ca, now);
+    }
+    break;
+  case TCP_BBR_PROBE_BW:
+    if (now - ca->cycle_stamp > ca->min_rtt)
+    {
+      ca->cycle = (ca->cycle + 1) % countof(tcp_bbr_cycle);
+      ca->pacing_gain = tcp_bbr_cycle[ca->cycle];
+      ca->cycle_stamp = now;
+    }
+    break;
+  case TCP_BBR_PROBE_RTT:
+    if (!ca->probe_rtt_done && tcp_cc_pipe(pcb) <= TCP_BBR_MIN_CWND * pcb->mss)
+    {
+      ca->probe_rtt_done = now + TCP_BBR_PROBE_RTT_TIME;
+    }
+    else if (ca->probe_rtt_done && now >= ca->probe_rtt_done)
+    {
+      ca->min_rtt_stamp = now;
+      pcb->cc.cwnd = MAX(pcb->cc.cwnd, ca->prior_cwnd);
+      if (ca->filled)
+      {
+        tcp_bbr_probe_bw(ca, now);
+      }
+      else
+      {
+        ca->mode = TCP_BBR_STARTUP;
+        ca->pacing_gain = TCP_BBR_HIGH_GAIN;
+        ca->cwnd_gain = TCP_BBR_HIGH_GAIN;
+      }
+    }
+    break;
+  }
+  if (expired && ca->mode != TCP_BBR_PROBE_RTT)
+  {
+    /* drain the queue to see the real min RTT */
+    ca->mode = TCP_BBR_PROBE_RTT;
+    ca->pacing_gain = TCP_BBR_UNIT;
+    ca->prior_cwnd = MAX(ca->prior_cwnd, pcb->cc.cwnd);
+    ca->probe_rtt_done = 0;
+  }
+  tcp_bbr_pacing(pcb, ca);
+  /* cwnd only bounds the inflight to a few BDPs, the rate is controlled by the pacing */
+  min_cwnd = TCP_BBR_MIN_CWND * pcb->mss;
+  if (ca->mode == TCP_BBR_PROBE_RTT)
+  {
+    pcb->cc.cwnd = min_cwnd;
+    return;
+  }
+  target = tcp_bbr_bdp(pcb, ca, ca->cwnd_gain) + 3 * pcb->mss;
+  if (ca->filled)
+  {
+    pcb->cc.cwnd = MIN(pcb->cc.cwnd + rs->acked, target);
+  }
+  else if (pcb->cc.cwnd < target)
+  {
+    pcb->cc.cwnd += rs->acked;
+  }
+  pcb->cc.cwnd = MAX(pcb->cc.cwnd, min_cwnd);
+}
+
+// the model does not react to a loss itself, the window lost is rebuilt by the ACKs
+static void
+tcp_bbr_loss(struct tcp_pcb *pcb)
+{
+  struct tcp_bbr *ca = (struct tcp_bbr *)pcb->cc.priv;
+
+  ca->prior_cwnd = pcb->cc.cwnd;
+  pcb->cc.ssthresh = pcb->cc.cwnd;
+}
+
+static const struct tcp_congestion_ops tcp_bbr = {
+    .name = "bbr",
+    .init = tcp_bbr_init,
+    .ack = tcp_bbr_ack,
+    .loss = tcp_bbr_loss,
+    .timeout = tcp_bbr_loss,
+};
+
+static const struct tcp_congestion_ops *tcp_congestion_ops_list[] = {
+    &tcp_newreno,
+    &tcp_cubic,
+    &tcp_bbr,
+};
+
+static const struct tcp_congestion_ops *
+tcp_cc_lookup(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < countof(tcp_congestion_ops_list); i++)
+  {
+    if (strcmp(tcp_congestion_ops_list[i]->name, name) == 0)
+    {
+      return tcp_congestion_ops_list[i];
+    }
+  }
+  return NULL;
+}
+
+// once MSS is known, the window is kept across a change of the algorithm
+static void
+tcp_cc_init(struct tcp_pcb *pcb)
+{
+  if (!pcb->cc.cwnd)
+  {
+    /* initial window (RFC 6928) */
+    pcb->cc.cwnd = MIN(10 * pcb->mss, MAX(2 * pcb->mss, 14600));
+    pcb->cc.ssthresh = UINT32_MAX;
+  }
+  memset(pcb->cc.priv, 0, sizeof(pcb->cc.priv));
+  pcb->cc.pacing_rate = 0; /* only by the algorithms which pace */
+  if (pcb->cc.ops->init)
+  {
+    pcb->cc.ops->init(pcb);
+  }
+}
+
+static uint32_t
+tcp_cc_cwnd(struct tcp_pcb *pcb)
+{
+  return pcb->cc.ops->cwnd ? pcb->cc.ops->cwnd(pcb) : pcb->cc.cwnd;
+}
+
+static void
+tcp_cc_ack(struct tcp_pcb *pcb, const struct tcp_rate_sample *rs)
+{
+  struct tcp_queue_entry *entry;
+
+  pcb->cc.dupacks = 0;
+  if (pcb->cc.state == TCP_CA_RECOVERY)
+  {
+    if (TCP_SEQ_LT(pcb->snd.una, pcb->cc.high))
+    {
+      if (pcb->options & TCP_OPT_F_SACK_PERM)
+      {
+        /* partial ACK, the hole at SND.UNA and the ones the scoreboard tells go by the pipe */
+        entry = queue_data(queue_peek(&pcb->queue), struct tcp_queue_entry, link);
+        if (entry && !entry->lost && !entry->sacked && TCP_SEQ_LEQ(pcb->cc.high_rxt, entry->seq))
+        {
+          entry->lost = 1;
+          pcb->cc.lost += tcp_queue_entry_seqlen(entry);
+        }
+        tcp_sack_mark_lost(pcb);
+        return;
+      }
+      /* partial ACK, the next hole is sent right away and the window deflated by the amount acknowledged */
+      tcp_retransmit_fast(pcb);
+      pcb->cc.cwnd = MAX(pcb->cc.cwnd > rs->acked ? pcb->cc.cwnd - rs->acked : 0, pcb->mss) + pcb->mss;
+      return;
+    }
+    /* full ACK */
+    pcb->cc.cwnd = MIN(pcb->cc.ssthresh, MAX(tcp_cc_pipe(pcb), pcb->mss) + pcb->mss);
+    pcb->cc.state = TCP_CA_OPEN;
+    debugf("recovered, cwnd=%u", pcb->cc.cwnd);
+    return;
+  }
+  if (pcb->cc.state == TCP_CA_LOSS && TCP_SEQ_LT(pcb->cc.high, pcb->snd.una))
+  {
+    /* beyond the recovery point, the duplicates of the data sent again after RTO ack at most it (RFC 6582 4.1) */
+    pcb->cc.state = TCP_CA_OPEN;
+  }
+  pcb->cc.ops->ack(pcb, rs);
+}
+
+// fast retransmit on the third duplicate ACK, then keep the ACK clock going until the loss is repaired
+static void
+tcp_cc_dupack(struct tcp_pcb *pcb)
+{
+  if (pcb->cc.state == TCP_CA_RECOVERY)
+  {
+    if (pcb->options & TCP_OPT_F_SACK_PERM)
+    {
+      /* the SACKed segments have left the pipe, no inflation */
+      tcp_sack_mark_lost(pcb);
+      return;
+    }
+    /* one more segment has left the network */
+    pcb->cc.cwnd += pcb->mss;
+    return;
+  }
+  if (pcb->cc.state == TCP_CA_LOSS)
+  {
+    /* after RTO, the duplicates are caused by the retransmissions */
+    return;
+  }
+  if (++pcb->cc.dupacks < TCP_DUPACK_THRESH && !tcp_sack_head_lost(pcb))
+  {
+    return;
+  }
+  pcb->cc.ops->loss(pcb);
+  pcb->cc.state = TCP_CA_RECOVERY;
+  pcb->cc.high = pcb->snd.nxt;
+  pcb->cc.high_rxt = pcb->snd.una;
+  if (pcb->options & TCP_OPT_F_SACK_PERM)
+  {
+    /* the pipe is counted from the scoreboard (RFC 6675) */
+    pcb->cc.cwnd = pcb->cc.ssthresh;
+    tcp_sack_mark_lost(pcb);
+  }
+  else
+  {
+    pcb->cc.cwnd = pcb->cc.ssthresh + TCP_DUPACK_THRESH * pcb->mss;
+  }
+  debugf("fast retransmit, una=%u, cwnd=%u, ssthresh=%u", pcb->snd.una, pcb->cc.cwnd, pcb->cc.ssthresh);
+  tcp_retransmit_fast(pcb);
+}
+
+// the segment may go now, otherwise the pacer is armed for it
+static int
+tcp_pacing_ready(struct tcp_pcb *pcb)
+{
+  uint64_t now;
+
+  if (!pcb->cc.pacing_rate)
+  {
+    return 1;
+  }
+  now = tcp_cc_now();
+  if (pcb->cc.pacing_next <= now + TCP_PACING_SLACK)
+  {
+    return 1;
+  }
+  if (!net_timer_pending(&pcb->pacer))
+  {
+    tcp_pcb_timer_arm(pcb, &pcb->pacer, (pcb->cc.pacing_next - now + 999) / 1000);
+  }
+  return 0;
+}
+
+static void
+tcp_pacing_sent(struct tcp_pcb *pcb, size_t len)
+{
+  uint64_t now;
+
+  if (!pcb->cc.pacing_rate)
+  {
+    return;
+  }
+  now = tcp_cc_now();
+  /* no credit is saved while idle */
+  pcb->cc.pacing_next = MAX(pcb->cc.pacing_next, now) + len * 1000000 / pcb->cc.pacing_rate;
+}
+
+static void
+tcp_cc_timeout(struct tcp_pcb *pcb)
+{
+  pcb->cc.dupacks = 0;
+  if (pcb->cc.state != TCP_CA_LOSS)
+  {
+    /* only once per loss episode, the retransmissions of the same data back off the RTO */
+    pcb->cc.ops->timeout(pcb);
+    pcb->cc.state = TCP_CA_LOSS;
+    pcb->cc.high = pcb->snd.nxt;
+  }
+  pcb->cc.cwnd = pcb->mss; /* loss window */
+  debugf("cwnd=%u, ssthresh=%u", pcb->cc.cwnd, pcb->cc.ssthresh);
+}
+
+/*
+ * TCP Retransmit
+ *
+ * NOTE: TCP Retransmit functions must be called after pcb->mutex locked
+ */
+
+// RTO = SRTT + max(G, 4*RTTVAR), bounded (RFC 6298 2.3), G raised to TCP_RTO_MIN
+static void
+tcp_rtt_rto(struct tcp_pcb *pcb)
+{
+  unsigned int rto;
+
+  if (!pcb->rtt.srtt)
+  {
+    pcb->rtt.rto = TCP_RTO_INIT;
+    return;
+  }
+  /*
+   * the floor is on the margin, not the RTO: RTTVAR sampled on every ACK shrinks to nothing while
+   * a queue builds up smoothly, and the RTO would fire just behind the growing RTT (a spurious one is not undone)
+   */
+  rto = pcb->rtt.srtt + MAX(4 * pcb->rtt.rttvar, TCP_RTO_MIN);
+  pcb->rtt.rto = MIN(rto, TCP_RTO_MAX);
+}
+
+// a sample from a segment which was sent only once (RFC 6298 2.2, 2.3)
+static void
+tcp_rtt_sample(struct tcp_pcb *pcb, unsigned int rtt)
+{
+  unsigned int delta;
+
+  if (!pcb->rtt.srtt)
+  {
+    pcb->rtt.srtt = MAX(rtt, 1);
+    pcb->rtt.rttvar = rtt / 2;
+  }
+  else
+  {
+    delta = rtt > pcb->rtt.srtt ? rtt - pcb->rtt.srtt : pcb->rtt.srtt - rtt;
+    /* beta = 1/4, alpha = 1/8 */
+    pcb->rtt.rttvar = pcb->rtt.rttvar - pcb->rtt.rttvar / 4 + delta / 4;
+    pcb->rtt.srtt = MAX(pcb->rtt.srtt - pcb->rtt.srtt / 8 + rtt / 8, 1);
+  }
+  debugf("rtt=%u, srtt=%u, rttvar=%u", rtt, pcb->rtt.srtt, pcb->rtt.rttvar);
+}
+
+/*
+ * arm the RTO timer on the retransmission time of the head (or stop it if nothing is left)
+ * the entries are in the order sent and share the RTO, so no other one is due earlier
+ * (except after the head has been sent again, which restarts the timer as in RFC 6298 5.3)
+ */
+static void
+tcp_retransmit_timer_update(struct tcp_pcb *pcb)
+{
+  struct tcp_queue_entry *entry;
+  struct timeval now, timeout, diff;
+
+  entry = queue_data(queue_peek(&pcb->queue), struct tcp_queue_entry, link);
+  if (!entry || pcb->state == TCP_PCB_STATE_CLOSED)
+  {
+    tcp_pcb_timer_cancel(pcb, &pcb->timer);
+    return;
+  }
+  timeout = entry->last;
+  timeval_add_usec(&timeout, pcb->rtt.rto);
+  gettimeofday(&now, NULL);
+  if (timercmp(&timeout, &now, <))
+  {
+    timeout = now;
+  }
+  timersub(&timeout, &now, &diff);
+  /* round up, must not fire before the RTO */
+  tcp_pcb_timer_arm(pcb, &pcb->timer, diff.tv_sec * 1000 + (diff.tv_usec + 999) / 1000);
+}
+
+static int
+tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, size_t len)
+{
+  struct tcp_queue_entry *entry;
+
+  entry = memory_alloc_raw(sizeof(*entry));
+  if (!entry)
+  {
+    errorf("memory_alloc_raw() failure");
+    return -1;
+  }
+  if (!pcb->queue.head)
+  {
+    /* nothing in flight, the interval of a delivery rate starts here (not at the ACK before idle) */
+    pcb->cc.delivered_time = tcp_cc_now();
+  }
+  entry->retries = 0;
+  entry->lost = 0;
+  entry->sacked = 0;
+  entry->delivered = pcb->cc.delivered;
+  entry->delivered_time = pcb->cc.delivered_time;
+  entry->seq = seq;
+  entry->flg = flg;
+  entry->len = len;
+  gettimeofday(&entry->first, NULL);
+  entry->last = entry->first;
+  queue_push(&pcb->queue, &entry->link);
+  if (!net_timer_pending(&pcb->timer))
+  {
+    /* the queue was empty, this is the oldest unacknowledged segment */
+    tcp_pcb_timer_arm(pcb, &pcb->timer, (pcb->rtt.rto + 999) / 1000);
+  }
+  return 0;
+}
+
+// remove the acknowledged ones, and take samples from the latest of them (rs may be NULL)
+static void
+tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb, struct tcp_rate_sample *rs)
+{
+  struct tcp_queue_entry *entry;
+  struct timeval now, last, diff;
+  int removed = 0, ambiguous = 0;
+  unsigned int rtt = 0;
+  uint64_t delivered = 0, delivered_time = 0;
+
+  while (1)
+  {
+    entry = queue_data(queue_peek(&pcb->queue), struct tcp_queue_entry, link);
+    if (!entry)
+    {
+      break;
+    }
+    if ((int32_t)(entry->seq + tcp_queue_entry_seqlen(entry) - pcb->snd.una) > 0)
+    {
+      // not acknowledged (entirely) yet
+      break;
+    }
+    queue_pop(&pcb->queue);
+    debugf("remove, seq=%u, flags=%s, len=%zu", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
+    if (entry->retries)
+    {
+      ambiguous = 1;
+    }
+    if (entry->lost)
+    {
+      /* the original has arrived after all */
+      pcb->cc.lost -= tcp_queue_entry_seqlen(entry);
+    }
+    if (entry->sacked)
+    {
+      pcb->cc.sacked -= entry->len;
+    }
+    last = entry->last;
+    delivered = entry->delivered;
+    delivered_time = entry->delivered_time;
+    pcb->cc.delivered += entry->len;
+    memory_free(entry);
+    removed++;
+  }
+  if (removed)
+  {
+    gettimeofday(&now, NULL);
+    if (!ambiguous)
+    {
+      /* the latest one acknowledged, sent only once */
+      timersub(&now, &last, &diff);
+      rtt = MAX(diff.tv_sec * 1000000 + diff.tv_usec, 1);
+      tcp_rtt_sample(pcb, rtt);
+    }
+    pcb->cc.delivered_time = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+    if (rs)
+    {
+      rs->rtt = rtt;
+      rs->prior_delivered = delivered;
+      rs->delivered = pcb->cc.delivered - delivered;
+      rs->interval = pcb->cc.delivered_time - delivered_time;
+    }
+    /* new data acknowledged, the backoff is cleared and the timer restarts for the remaining ones */
+    pcb->rtt.backoffs = 0;
+    tcp_rtt_rto(pcb);
+    tcp_retransmit_timer_update(pcb);
+  }
+}
+
+static void
+tcp_retransmit_entry(struct tcp_pcb *pcb, struct tcp_queue_entry *entry, struct timeval *now)
+{
+  struct tcp_options opt;
+
+  if (entry->len)
+  {
+    tcp_output_data(pcb, entry->seq, entry->flg, entry->len);
+  }
+  else
+  {
+    tcp_options_fill(pcb, entry->flg, 0, &opt);
+    tcp_delack_sent(pcb);
+    tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, tcp_rcvbuf_advertise(pcb, entry->flg), &opt, NULL, 0, &pcb->local, &pcb->foreign);
+  }
+  if (entry->lost)
+  {
+    entry->lost = 0;
+    pcb->cc.lost -= tcp_queue_entry_seqlen(entry);
+  }
+  if (pcb->cc.state == TCP_CA_RECOVERY && TCP_SEQ_LT(pcb->cc.high_rxt, entry->seq + entry->len))
+  {
+    pcb->cc.high_rxt = entry->seq + entry->len;
+  }
+  entry->last = *now;
+  entry->retries++;
+  entry->delivered = pcb->cc.delivered;
+  entry->delivered_time = pcb->cc.delivered_time;
+  tcp_pacing_sent(pcb, entry->len);
+}
+
+// send the earliest unacknowledged segment again without waiting for RTO
+static void
+tcp_retransmit_fast(struct tcp_pcb *pcb)
+{
+  struct tcp_queue_entry *entry;
+  struct timeval now;
+
+  entry = queue_data(queue_peek(&pcb->queue), struct tcp_queue_entry, link);
+  if (!entry)
+  {
+    return;
+  }
+  gettimeofday(&now, NULL);
+  tcp_retransmit_entry(pcb, entry, &now);
+  tcp_retransmit_timer_update(pcb);
+}
+
+// the peer has answered the zero window probe, it is probed for as long as it keeps answering (RFC 1122 4.2.2.17)
+static void
+tcp_retransmit_persist(struct tcp_pcb *pcb)
+{
+  /* the retries count from the last answer */
+  pcb->rtt.backoffs = 0;
+}
+
+// expiration of the RTO timer (on the interrupt thread)
+static void
+tcp_retransmit_timer(struct net_timer *timer, void *arg)
+{
+  struct tcp_pcb *pcb;
+  struct queue_entry *e;
+  struct tcp_queue_entry *entry;
+  struct timeval now, timeout;
+
+  pcb = (struct tcp_pcb *)arg;
+  mutex_lock(&pcb->mutex);
+  if (pcb->state == TCP_PCB_STATE_FREE || pcb->state == TCP_PCB_STATE_CLOSED)
+  {
+    tcp_pcb_unlock(pcb);
+    return;
+  }
+  /* the head has been outstanding the longest, and is the first one due */
+  entry = queue_data(queue_peek(&pcb->queue), struct tcp_queue_entry, link);
+  if (!entry)
+  {
+    tcp_pcb_unlock(pcb);
+    return;
+  }
+  gettimeofday(&now, NULL);
+  timeout = entry->last;
+  timeval_add_usec(&timeout, pcb->rtt.rto);
+  if (!timercmp(&now, &timeout, <))
+  {
+    if (pcb->rtt.backoffs >= (TCP_FLG_ISSET(entry->flg, TCP_FLG_SYN) ? TCP_RETRIES_SYN : TCP_RETRIES))
+    {
+      /* given up (RFC 1122 4.2.3.5 R2) */
+      pcb->state = TCP_PCB_STATE_CLOSED;
+      if (pcb->parent)
+      {
+        /* a child not established, nobody else will release it */
+        tcp_pcb_release(pcb);
+      }
+      sched_wakeup(&pcb->ctx);
+      tcp_pcb_unlock(pcb);
+      return;
+    }
+    if (pcb->mss && pcb->snd.wnd)
+    {
+      /* not by a zero window probe */
+      tcp_cc_timeout(pcb);
+    }
+    /*
+     * everything outstanding is considered lost, the earliest is sent again right now (RFC 6298 5.4) and the rest by the ACK clock,
+     * the SACKed ones as well since the receiver may have discarded them (RFC 2018 8)
+     */
+    for (e = pcb->queue.head; e; e = e->next)
+    {
+      entry = queue_data(e, struct tcp_queue_entry, link);
+      entry->sacked = 0;
+      if (!entry->lost)
+      {
+        entry->lost = 1;
+        pcb->cc.lost += tcp_queue_entry_seqlen(entry);
+      }
+    }
+    pcb->cc.sacked = 0;
+    tcp_retransmit_entry(pcb, queue_data(pcb->queue.head, struct tcp_queue_entry, link), &now);
+    /* back off (RFC 6298 5.5) */
+    pcb->rtt.rto = MIN(pcb->rtt.rto * 2, TCP_RTO_MAX);
+    pcb->rtt.backoffs++;
+    debugf("backoff, rto=%u, backoffs=%u", pcb->rtt.rto, pcb->rtt.backoffs);
+  }
+  tcp_retransmit_timer_update(pcb);
+  tcp_pcb_unlock(pcb);
+}
+
+// send a segment without text (the control ones are retransmitted)
+static ssize_t
+tcp_output(struct tcp_pcb *pcb, uint8_t flg)
+{
+  struct tcp_options opt;
+  uint32_t seq;
+
+  seq = pcb->snd.nxt;
+  if (TCP_FLG_ISSET(flg, TCP_FLG_SYN))
+  {
+    seq = pcb->iss;
+  }
+  if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN))
+  {
+    tcp_retransmit_queue_add(pcb, seq, flg, 0);
+  }
+  tcp_options_fill(pcb, flg, 0, &opt);
+  tcp_delack_sent(pcb);
+  return tcp_output_segment(seq, pcb->rcv.nxt, flg, tcp_rcvbuf_advertise(pcb, flg), &opt, NULL, 0, &pcb->local, &pcb->foreign);
+}
+
+// send the data not sent yet as far as the window allows, then FIN if requested
+static void
+tcp_transmit(struct tcp_pcb *pcb)
+{
+  struct queue_entry *e;
+  struct tcp_queue_entry *entry;
+  struct timeval now;
+  size_t flight, unsent, cap, len, pipe;
+  uint32_t cwnd;
+
+  if (!pcb->mss)
+  {
+    /* the smaller of both sides, less the timestamps carried in every segment */
+    pcb->mss = MIN(tcp_mss_local(pcb->local.addr), pcb->mss_peer ? pcb->mss_peer : TCP_MSS_DEFAULT);
+    if (pcb->options & TCP_OPT_F_TS)
+    {
+      pcb->mss -= 12;
+    }
+    tcp_cc_init(pcb);
+  }
+  cwnd = tcp_cc_cwnd(pcb);
+  pipe = tcp_cc_pipe(pcb);
+  if (pcb->cc.lost)
+  {
+    /* the lost ones first */
+    gettimeofday(&now, NULL);
+    for (e = pcb->queue.head; e && pipe < cwnd; e = e->next)
+    {
+      entry = queue_data(e, struct tcp_queue_entry, link);
+      if (entry->lost)
+      {
+        if (!tcp_pacing_ready(pcb))
+        {
+          break;
+        }
+        tcp_retransmit_entry(pcb, entry, &now);
+        pipe += tcp_queue_entry_seqlen(entry);
+      }
+    }
+    tcp_retransmit_timer_update(pcb);
+    if (pcb->cc.lost)
+    {
+      /* no new data until they have been sent */
+      return;
+    }
+  }
+  if (pcb->snd.una == pcb->iss || pcb->fin == TCP_FIN_SENT)
+  {
+    /* SYN not acknowledged yet, or all the data has been sent (followed by FIN) */
+    return;
+  }
+  while (1)
+  {
+    flight = pcb->snd.nxt - pcb->snd.una;
+    unsent = pcb->sndbuf.len - flight;
+    if (!unsent)
+    {
+      break;
+    }
+    cap = pcb->snd.wnd > flight ? pcb->snd.wnd - flight : 0;
+    if (cap && pipe >= cwnd)
+    {
+      /* wait for the ACK to open the congestion window */
+      break;
+    }
+    cap = MIN(cap, cwnd - pipe);
+    if (!cap)
+    {
+      if (flight)
+      {
+        /* wait for the ACK to open the window */
+        break;
+      }
+      /* zero window probe, retransmitted (with backoff) until the window opens, never given up while answered */
+      cap = 1;
+    }
+    if (!tcp_pacing_ready(pcb))
+    {
+      /* the pacer resumes */
+      break;
+    }
+    len = MIN(MIN(pcb->mss, unsent), cap);
+    tcp_retransmit_queue_add(pcb, pcb->snd.nxt, TCP_FLG_ACK | TCP_FLG_PSH, len);
+    /* an error is recovered by the retransmission */
+    tcp_output_data(pcb, pcb->snd.nxt, TCP_FLG_ACK | TCP_FLG_PSH, len);
+    tcp_pacing_sent(pcb, len);
+    pcb->snd.nxt += len;
+    pipe += len;
+  }
+  if (pcb->fin == TCP_FIN_REQUESTED && pcb->snd.nxt - pcb->snd.una == pcb->sndbuf.len)
+  {
+    tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN);
+    pcb->snd.nxt++;
+    pcb->fin = TCP_FIN_SENT;
   }
-  return;
 }
 
+// the time of a paced segment has come (on the interrupt thread)
 static void
-tcp_retransmit_queue_emit(void *arg, void *data)
+tcp_pacing_timer(struct net_timer *timer, void *arg)
+{
+  struct tcp_pcb *pcb;
+
+  pcb = (struct tcp_pcb *)arg;
+  mutex_lock(&pcb->mutex);
+  if (pcb->state != TCP_PCB_STATE_FREE && pcb->state != TCP_PCB_STATE_CLOSED)
+  {
+    tcp_transmit(pcb);
+  }
+  tcp_pcb_unlock(pcb);
+}
+
+/*
+ * TCP Delayed ACK (RFC 1122 4.2.3.2, RFC 5681 4.2)
+ *
+ * In-sequence data is acknowledged for every second full-sized segment, or when the
+ * timeout expires, unless a segment carries the ACK before. Data out of order or
+ * filling a hole is acknowledged right away, and so are the first segments of the
+ * connection (and the ones after a hole) while the sender is likely in slow start.
+ *
+ * NOTE: TCP Delayed ACK functions must be called after pcb->mutex locked
+ */
+
+// any segment of the connection carries the ACK
+static void
+tcp_delack_sent(struct tcp_pcb *pcb)
+{
+  if (pcb->delack.pending)
+  {
+    pcb->delack.pending = 0;
+    tcp_pcb_timer_cancel(pcb, &pcb->acker);
+  }
+}
+
+// the next segments are acknowledged right away
+static void
+tcp_delack_quick(struct tcp_pcb *pcb)
+{
+  pcb->delack.quick = TCP_QUICKACKS;
+}
+
+// on arrival of in-sequence data
+static void
+tcp_delack_schedule(struct tcp_pcb *pcb, size_t len)
+{
+  pcb->delack.rcv_mss = MAX(pcb->delack.rcv_mss, len);
+  pcb->delack.pending += len;
+  if (!pcb->delack.timeout || pcb->delack.quick || pcb->delack.pending >= 2 * pcb->delack.rcv_mss)
+  {
+    if (pcb->delack.quick)
+    {
+      pcb->delack.quick--;
+    }
+    tcp_output(pcb, TCP_FLG_ACK);
+    return;
+  }
+  if (!net_timer_pending(&pcb->acker))
+  {
+    tcp_pcb_timer_arm(pcb, &pcb->acker, pcb->delack.timeout);
+  }
+}
+
+// expiration of the delayed ACK timer (on the interrupt thread)
+static void
+tcp_delack_timer(struct net_timer *timer, void *arg)
 {
   struct tcp_pcb *pcb;
-  struct tcp_queue_entry *entry;
-  struct timeval now, diff, timeout;
 
   pcb = (struct tcp_pcb *)arg;
-  entry = (struct tcp_queue_entry *)data;
+  mutex_lock(&pcb->mutex);
+  if (pcb->state != TCP_PCB_STATE_FREE && pcb->state != TCP_PCB_STATE_CLOSED && pcb->delack.pending)
+  {
+    tcp_output(pcb, TCP_FLG_ACK);
+  }
+  tcp_pcb_unlock(pcb);
+}
+
+// SYN in LISTEN, answered with SYN/ACK
+static void
+tcp_pcb_syn_received(struct tcp_pcb *pcb, struct tcp_segment_info *seg, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  pcb->local = *local;
+  pcb->foreign = *foreign;
+  tcp_rcvbuf_init(pcb);
+  /* answer with the ones the peer has offered */
+  tcp_options_offer(pcb);
+  tcp_options_negotiate(pcb, &seg->opt);
+  pcb->snd.wnd = seg->wnd; /* not scaled in SYN */
+  pcb->snd.wl1 = seg->seq;
+  pcb->rcv.nxt = seg->seq + 1;                         // expected next recieve seq num(used in ACK)
+  pcb->rcv.adv = pcb->rcv.nxt;
+  pcb->irs = seg->seq;                                 // initial recived seq num
+  pcb->iss = random();                                 // get initial seq num
+  tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK); // output SYN/ACK
+  pcb->snd.nxt = pcb->iss + 1;
+  pcb->snd.una = pcb->iss;
+  pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
+  tcp_pcb_rehash(pcb); /* moves from the listeners to the connections */
+}
+
+// reset the connection and release it
+static void
+tcp_pcb_abort(struct tcp_pcb *pcb)
+{
+  if (pcb->state == TCP_PCB_STATE_FREE)
+  {
+    return;
+  }
+  if (pcb->state != TCP_PCB_STATE_CLOSED)
+  {
+    tcp_output_segment(pcb->snd.nxt, 0, TCP_FLG_RST, 0, NULL, NULL, 0, &pcb->local, &pcb->foreign);
+    pcb->state = TCP_PCB_STATE_CLOSED;
+  }
+  tcp_pcb_release(pcb);
+}
+
+// a connection of the listener, returned locked (NULL: no more PCBs)
+static struct tcp_pcb *
+tcp_listen_child(struct tcp_pcb *pcb)
+{
+  struct tcp_pcb *child;
+
+  child = tcp_pcb_alloc();
+  if (!child)
+  {
+    return NULL;
+  }
+  tcp_pcb_hold(pcb);
+  child->parent = pcb;
+  __atomic_add_fetch(&pcb->backlog.syn, 1, __ATOMIC_RELAXED);
+  /* inherits the settings of the listener */
+  child->busy_poll = pcb->busy_poll;
+  child->cc.ops = pcb->cc.ops;
+  child->delack.timeout = pcb->delack.timeout;
+  return child;
+}
+
+/*
+ * TCP SYN Cookies (RFC 4987)
+ *
+ * When the SYN-RECEIVED queue of a listener is full (or no PCB is left), SYN is
+ * answered without any state: the ISN of SYN/ACK is a MAC of the connection, the
+ * time and the peer's ISN, with the MSS encoded in it. The window scale and SACK
+ * offered by the peer are encoded in the low bits of TSval, which come back in
+ * TSecr (they are off without timestamps). A PCB is created only for the ACK which
+ * returns a valid cookie.
+ *
+ * NOTE: TCP SYN Cookies functions must be called after the listener locked
+ */
+
+static const uint16_t tcp_cookie_mss[] = {536, 1300, 1440, 1460};
+
+static uint64_t tcp_cookie_key[2];
+
+#define TCP_SIPROUND(v0, v1, v2, v3) \
+  do                                 \
+  {                                  \
+    v0 += v1;                        \
+    v1 = v1 << 13 | v1 >> 51;        \
+    v1 ^= v0;                        \
+    v0 = v0 << 32 | v0 >> 32;        \
+    v2 += v3;                        \
+    v3 = v3 << 16 | v3 >> 48;        \
+    v3 ^= v2;                        \
+    v0 += v3;                        \
+    v3 = v3 << 21 | v3 >> 43;        \
+    v3 ^= v0;                        \
+    v2 += v1;                        \
+    v1 = v1 << 17 | v1 >> 47;        \
+    v1 ^= v2;                        \
+    v2 = v2 << 32 | v2 >> 32;        \
+  } while (0)
+
+// SipHash-2-4 of the words, keyed with the secret of the cookies
+static uint64_t
+tcp_cookie_siphash(const uint64_t *m, int n)
+{
+  uint64_t v0, v1, v2, v3, b;
+  int i;
+
+  v0 = tcp_cookie_key[0] ^ 0x736f6d6570736575ULL;
+  v1 = tcp_cookie_key[1] ^ 0x646f72616e646f6dULL;
+  v2 = tcp_cookie_key[0] ^ 0x6c7967656e657261ULL;
+  v3 = tcp_cookie_key[1] ^ 0x7465646279746573ULL;
+  for (i = 0; i < n; i++)
+  {
+    v3 ^= m[i];
+    TCP_SIPROUND(v0, v1, v2, v3);
+    TCP_SIPROUND(v0, v1, v2, v3);
+    v0 ^= m[i];
+  }
+  b = (uint64_t)(n * 8) << 56;
+  v3 ^= b;
+  TCP_SIPROUND(v0, v1, v2, v3);
+  TCP_SIPROUND(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  for (i = 0; i < 4; i++)
+  {
+    TCP_SIPROUND(v0, v1, v2, v3);
+  }
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t
+tcp_cookie_mac(struct ip_endpoint *local, struct ip_endpoint *foreign, uint32_t irs, uint32_t count, unsigned int mss)
+{
+  uint64_t m[3];
+
+  m[0] = (uint64_t)local->addr << 32 | foreign->addr;
+  m[1] = (uint64_t)local->port << 48 | (uint64_t)foreign->port << 32 | irs;
+  m[2] = (uint64_t)count << 8 | mss;
+  return tcp_cookie_siphash(m, countof(m)) & 0x00ffffff;
+}
+
+static uint32_t
+tcp_cookie_count(void)
+{
+  struct timeval now;
+
   gettimeofday(&now, NULL);
-  timersub(&now, &entry->first, &diff);
-  if (diff.tv_sec >= TCP_RETRANSMIT_DEADLINE)
+  return now.tv_sec >> TCP_COOKIE_PERIOD_SHIFT;
+}
+
+// answer SYN with a cookie, nothing is kept
+static void
+tcp_cookie_syn(struct tcp_pcb *pcb, struct tcp_segment_info *seg, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  struct tcp_options opt = {};
+  uint32_t count, iss, now;
+  unsigned int mss, idx;
+
+  mss = (seg->opt.flags & TCP_OPT_F_MSS) ? seg->opt.mss : TCP_MSS_DEFAULT;
+  for (idx = countof(tcp_cookie_mss) - 1; idx && tcp_cookie_mss[idx] > mss; idx--)
+    ;
+  count = tcp_cookie_count();
+  iss = (count & 0x1f) << 27 | idx << 24 | tcp_cookie_mac(local, foreign, seg->seq, count, idx);
+  opt.flags = TCP_OPT_F_MSS;
+  opt.mss = tcp_mss_local(local->addr);
+  if (seg->opt.flags & TCP_OPT_F_TS)
+  {
+    /* window scale (0xf: none) and SACK-permitted, never ahead of the clock (PAWS on the peer) */
+    now = tcp_ts_now();
+    opt.flags |= TCP_OPT_F_TS | (seg->opt.flags & (TCP_OPT_F_WSCALE | TCP_OPT_F_SACK_PERM));
+    opt.tsval = (now & ~((1 << TCP_COOKIE_TS_BITS) - 1)) |
+                ((seg->opt.flags & TCP_OPT_F_WSCALE) ? MIN(seg->opt.wscale, TCP_WSCALE_MAX) : 0xf) |
+                ((seg->opt.flags & TCP_OPT_F_SACK_PERM) ? 0x10 : 0);
+    if (TCP_SEQ_LT(now, opt.tsval))
+    {
+      opt.tsval -= 1 << TCP_COOKIE_TS_BITS;
+    }
+    opt.tsecr = seg->opt.tsval;
+    opt.wscale = TCP_WSCALE;
+  }
+  pcb->backlog.cookie = time(NULL);
+  debugf("cookie, iss=%u, mss=%u", iss, tcp_cookie_mss[idx]);
+  tcp_output_segment(iss, seg->seq + 1, TCP_FLG_SYN | TCP_FLG_ACK, TCP_RCVBUF_INIT, &opt, NULL, 0, local, foreign);
+}
+
+// ACK to a listener, returns 0 if it returns a valid cookie (the connection goes to the accept queue)
+static int
+tcp_cookie_ack(struct tcp_pcb *pcb, struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  struct tcp_pcb *child;
+  uint32_t iss, irs, count, age;
+  unsigned int idx;
+
+  if (!pcb->backlog.cookie || time(NULL) - pcb->backlog.cookie > (TCP_COOKIE_AGE_MAX + 1) << TCP_COOKIE_PERIOD_SHIFT)
+  {
+    /* no cookie sent lately, not worth a guess */
+    return -1;
+  }
+  iss = seg->ack - 1;
+  irs = seg->seq - 1;
+  count = tcp_cookie_count();
+  age = (count - (iss >> 27)) & 0x1f;
+  idx = (iss >> 24) & 0x07;
+  if (age > TCP_COOKIE_AGE_MAX || idx >= countof(tcp_cookie_mss) ||
+      (iss & 0x00ffffff) != tcp_cookie_mac(local, foreign, irs, count - age, idx))
+  {
+    return -1;
+  }
+  if (pcb->backlog.accept.num >= pcb->backlog.max)
+  {
+    /* valid, but no room (dropped, the peer retransmits) */
+    debugf("accept queue full, num=%u", pcb->backlog.accept.num);
+    return 0;
+  }
+  child = tcp_listen_child(pcb);
+  if (!child)
+  {
+    errorf("tcp_listen_child() failure");
+    return 0;
+  }
+  /* rebuild the state of SYN-RECEIVED from the cookie */
+  child->local = *local;
+  child->foreign = *foreign;
+  tcp_rcvbuf_init(child);
+  child->mss_peer = tcp_cookie_mss[idx];
+  if (seg->opt.flags & TCP_OPT_F_TS)
+  {
+    child->options = TCP_OPT_F_TS;
+    child->ts_recent = seg->opt.tsval;
+    if ((seg->opt.tsecr & 0xf) != 0xf)
+    {
+      child->options |= TCP_OPT_F_WSCALE;
+      child->snd.wscale = seg->opt.tsecr & 0xf;
+      child->rcv.wscale = TCP_WSCALE;
+    }
+    if (seg->opt.tsecr & 0x10)
+    {
+      child->options |= TCP_OPT_F_SACK_PERM;
+    }
+  }
+  child->irs = irs;
+  child->rcv.nxt = seg->seq;
+  child->rcv.adv = seg->seq + TCP_RCVBUF_INIT;
+  child->iss = iss;
+  child->snd.una = iss;
+  child->snd.nxt = iss + 1;
+  child->snd.wl1 = irs;
+  child->state = TCP_PCB_STATE_SYN_RECEIVED;
+  tcp_pcb_rehash(child);
+  debugf("valid cookie, iss=%u, mss=%u, options=0x%02x", iss, child->mss_peer, child->options);
+  /* the ACK (and the data with it) is processed by the connection */
+  tcp_segment_arrives(child, seg, flags, data, len, local, foreign);
+  if (child->parent && child->state != TCP_PCB_STATE_SYN_RECEIVED)
+  {
+    /* established, goes to the accept queue right away (the listener is locked) */
+    child->parent = NULL;
+    __atomic_sub_fetch(&pcb->backlog.syn, 1, __ATOMIC_RELAXED);
+    tcp_pcb_drop(pcb);
+    queue_push(&pcb->backlog.accept, &child->alink);
+    sched_wakeup(&pcb->ctx);
+    mutex_unlock(&child->mutex); /* the reference goes with it */
+    return 0;
+  }
+  tcp_pcb_abort(child);
+  tcp_pcb_unlock(child);
+  return 0;
+}
+
+// SYN to a listener of tcp_listen, a child takes it (the listener stays)
+static void
+tcp_listen_syn(struct tcp_pcb *pcb, struct tcp_segment_info *seg, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  struct tcp_pcb *child;
+
+  if (pcb->backlog.accept.num >= pcb->backlog.max)
+  {
+    /* dropped without RST, the peer retries */
+    debugf("accept queue full, num=%u", pcb->backlog.accept.num);
+    return;
+  }
+  if (__atomic_load_n(&pcb->backlog.syn, __ATOMIC_RELAXED) >= pcb->backlog.max)
+  {
+    /* flooded (or a burst), no more state for the half-open ones */
+    tcp_cookie_syn(pcb, seg, local, foreign);
+    return;
+  }
+  child = tcp_listen_child(pcb);
+  if (!child)
+  {
+    tcp_cookie_syn(pcb, seg, local, foreign);
+    return;
+  }
+  tcp_pcb_syn_received(child, seg, local, foreign);
+  tcp_pcb_unlock(child);
+}
+
+/*
+ * hand an established child over to the accept queue of the listener, with the reference
+ * NOTE: must be called without any PCB locked
+ */
+static void
+tcp_listen_enqueue(struct tcp_pcb *pcb, struct tcp_pcb *child)
+{
+  mutex_lock(&pcb->mutex);
+  __atomic_sub_fetch(&pcb->backlog.syn, 1, __ATOMIC_RELAXED);
+  if (pcb->state != TCP_PCB_STATE_LISTEN)
+  {
+    /* closed meanwhile */
+    tcp_pcb_unlock(pcb);
+    mutex_lock(&child->mutex);
+    tcp_pcb_abort(child);
+    tcp_pcb_unlock(child);
+    return;
+  }
+  queue_push(&pcb->backlog.accept, &child->alink);
+  sched_wakeup(&pcb->ctx);
+  /* the one the child has held */
+  tcp_pcb_unlock(pcb);
+}
+
+/*
+ * TCP TIME-WAIT
+ *
+ * The side which closes first stays in TIME-WAIT for 2MSL, to acknowledge a retransmitted
+ * FIN and to keep old duplicates away from a new incarnation of the connection. The PCB
+ * is released on entering it, only what answering the peer needs is kept in a small
+ * entry. The entries are hashed by the 4-tuple (looked up after the connections), and
+ * reaped by one timer in the order they have entered.
+ *
+ * The 4-tuple is taken over before 2MSL by a SYN from the peer with a newer timestamp
+ * (RFC 6191) or a higher sequence number (RFC 1122 4.2.2.13), and by an active open if
+ * the connection has used timestamps (PAWS rejects old duplicates on the new one).
+ *
+ * NOTE: TCP TIME-WAIT functions (except enter/input/reuse and the reaper) must be called after table.mutex locked
+ */
+
+static struct tcp_timewait *
+tcp_timewait_lookup(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  struct tcp_timewait *tw;
+
+  tw = table.timewait.buckets[tcp_pcb_hash(local->addr, local->port, foreign->addr, foreign->port) & (table.timewait.size - 1)];
+  for (; tw; tw = tw->hnext)
+  {
+    if (tw->local.addr == local->addr && tw->local.port == local->port &&
+        tw->foreign.addr == foreign->addr && tw->foreign.port == foreign->port)
+    {
+      return tw;
+    }
+  }
+  return NULL;
+}
+
+static void
+tcp_timewait_link(struct tcp_timewait **buckets, unsigned int size, struct tcp_timewait *tw)
+{
+  struct tcp_timewait **bucket;
+
+  bucket = &buckets[tcp_pcb_hash(tw->local.addr, tw->local.port, tw->foreign.addr, tw->foreign.port) & (size - 1)];
+  tw->hnext = *bucket;
+  if (tw->hnext)
+  {
+    tw->hnext->hpprev = &tw->hnext;
+  }
+  tw->hpprev = bucket;
+  *bucket = tw;
+}
+
+// out of the hash, the entry itself stays in the queue until reaped
+static void
+tcp_timewait_unlink(struct tcp_timewait *tw)
+{
+  if (!tw->hpprev)
+  {
+    return;
+  }
+  *tw->hpprev = tw->hnext;
+  if (tw->hnext)
+  {
+    tw->hnext->hpprev = tw->hpprev;
+  }
+  tw->hnext = NULL;
+  tw->hpprev = NULL;
+  tw->flags |= TCP_TW_F_DEAD;
+  table.timewait.count--;
+}
+
+static void
+tcp_timewait_grow(void)
+{
+  struct tcp_timewait **buckets, *tw, *next;
+  unsigned int size, i;
+
+  size = table.timewait.size * 2;
+  buckets = memory_alloc(sizeof(*buckets) * size);
+  if (!buckets)
+  {
+    /* keep the current size, the chains just get longer */
+    return;
+  }
+  for (i = 0; i < table.timewait.size; i++)
+  {
+    for (tw = table.timewait.buckets[i]; tw; tw = next)
+    {
+      next = tw->hnext;
+      tcp_timewait_link(buckets, size, tw);
+    }
+  }
+  memory_free(table.timewait.buckets);
+  table.timewait.buckets = buckets;
+  table.timewait.size = size;
+  debugf("resized, buckets=%u", size);
+}
+
+static void
+tcp_timewait_reaper(struct net_timer *timer, void *arg)
+{
+  struct queue_entry *entry;
+  struct tcp_timewait *tw = NULL;
+  uint64_t now;
+  unsigned int reaped = 0;
+
+  now = net_timer_now();
+  mutex_lock(&table.mutex);
+  while ((entry = queue_peek(&table.timewait.queue)))
+  {
+    tw = queue_data(entry, struct tcp_timewait, link);
+    if (!(tw->flags & TCP_TW_F_DEAD) && tw->expire > now)
+    {
+      if (!(tw->flags & TCP_TW_F_RESTART))
+      {
+        break;
+      }
+      /* expires after all the others, goes behind them */
+      tw->flags &= ~TCP_TW_F_RESTART;
+      queue_pop(&table.timewait.queue);
+      queue_push(&table.timewait.queue, &tw->link);
+      continue;
+    }
+    queue_pop(&table.timewait.queue);
+    tcp_timewait_unlink(tw);
+    memory_free(tw);
+    reaped++;
+  }
+  if (entry)
+  {
+    net_timer_arm(timer, tw->expire - now + TCP_TIMEWAIT_REAP_SLACK, 0);
+  }
+  debugf("reaped=%u, remains=%u", reaped, table.timewait.count);
+  mutex_unlock(&table.mutex);
+}
+
+// the connection goes to TIME-WAIT, the PCB is released
+static void
+tcp_timewait_enter(struct tcp_pcb *pcb)
+{
+  struct tcp_timewait *tw;
+
+  tw = memory_alloc(sizeof(*tw));
+  if (tw)
+  {
+    tw->local = pcb->local;
+    tw->foreign = pcb->foreign;
+    tw->snd_nxt = pcb->snd.nxt;
+    tw->rcv_nxt = pcb->rcv.nxt;
+    tw->wnd = tcp_rcvbuf_advertise(pcb, TCP_FLG_ACK);
+    if (pcb->options & TCP_OPT_F_TS)
+    {
+      tw->flags |= TCP_TW_F_TS;
+      tw->ts_recent = pcb->ts_recent;
+    }
+    tw->ts_stamp = tcp_ts_now();
+    tw->expire = net_timer_now() + TCP_TIMEWAIT_TIMEOUT;
+  }
+  mutex_lock(&table.mutex);
+  /* replaced in one step, a segment finds either of them */
+  tcp_pcb_unlink(pcb);
+  if (tw && table.timewait.queue.num < TCP_TIMEWAIT_MAX)
+  {
+    if (table.timewait.count >= table.timewait.size)
+    {
+      tcp_timewait_grow();
+    }
+    tcp_timewait_link(table.timewait.buckets, table.timewait.size, tw);
+    table.timewait.count++;
+    if (!table.timewait.queue.num)
+    {
+      net_timer_arm(&table.timewait.reaper, TCP_TIMEWAIT_TIMEOUT, 0);
+    }
+    queue_push(&table.timewait.queue, &tw->link);
+    tw = NULL;
+  }
+  mutex_unlock(&table.mutex);
+  if (tw)
+  {
+    warnf("too many in TIME-WAIT, max=%u", TCP_TIMEWAIT_MAX);
+    memory_free(tw);
+  }
+  pcb->state = TCP_PCB_STATE_CLOSED;
+  tcp_pcb_release(pcb);
+}
+
+// SYN for a 4-tuple in TIME-WAIT, the old connection cannot be confused with the new one
+static int
+tcp_timewait_acceptable(struct tcp_timewait *tw, struct tcp_segment_info *seg)
+{
+  if ((tw->flags & TCP_TW_F_TS) && (seg->opt.flags & TCP_OPT_F_TS))
+  {
+    return TCP_SEQ_LT(tw->ts_recent, seg->opt.tsval);
+  }
+  return TCP_SEQ_LEQ(tw->rcv_nxt, seg->seq);
+}
+
+/*
+ * a segment for a 4-tuple in TIME-WAIT, returns -1 if there is none (or a listener takes it over)
+ * NOTE: listener (if any) must be locked
+ */
+static int
+tcp_timewait_input(struct tcp_pcb *listener, struct tcp_segment_info *seg, uint8_t flags, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+  struct tcp_timewait *tw;
+  struct tcp_options opt = {};
+  uint32_t seq, ack;
+  uint16_t wnd;
+
+  mutex_lock(&table.mutex);
+  tw = table.timewait.count ? tcp_timewait_lookup(local, foreign) : NULL;
+  if (!tw)
+  {
+    mutex_unlock(&table.mutex);
+    return -1;
+  }
+  if (TCP_FLG_ISSET(flags, TCP_FLG_RST))
+  {
+    /* ignored, not to be assassinated (RFC 1337) */
+    mutex_unlock(&table.mutex);
+    return 0;
+  }
+  if (TCP_FLG_IS(flags, TCP_FLG_SYN) && listener && tcp_timewait_acceptable(tw, seg))
+  {
+    /* a new incarnation, goes to the listener */
+    tcp_timewait_unlink(tw);
+    mutex_unlock(&table.mutex);
+    debugf("taken over by SYN, seq=%u", seg->seq);
+    return -1;
+  }
+  if (!seg->len && seg->seq == tw->rcv_nxt)
   {
-    pcb->state = TCP_PCB_STATE_CLOSED;
-    sched_wakeup(&pcb->ctx);
-    return;
+    /* an ACK (e.g. of a window probe), nothing to answer */
+    mutex_unlock(&table.mutex);
+    return 0;
   }
-  timeout = entry->last;
-  timeval_add_usec(&timeout, entry->rto);
-  if (timercmp(&now, &timeout, >))
+  if (TCP_FLG_ISSET(flags, TCP_FLG_FIN))
+  {
+    /* the peer has not got the last ACK, restart 2MSL */
+    tw->expire = net_timer_now() + TCP_TIMEWAIT_TIMEOUT;
+    tw->flags |= TCP_TW_F_RESTART;
+  }
+  seq = tw->snd_nxt;
+  ack = tw->rcv_nxt;
+  wnd = tw->wnd;
+  if (tw->flags & TCP_TW_F_TS)
   {
-    tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry + 1), entry->len, &pcb->local, &pcb->foreign);
-    entry->last = now;
-    entry->rto *= 2;
+    opt.flags = TCP_OPT_F_TS;
+    opt.tsval = tcp_ts_now();
+    opt.tsecr = tw->ts_recent;
   }
+  mutex_unlock(&table.mutex);
+  tcp_output_segment(seq, ack, TCP_FLG_ACK, wnd, &opt, NULL, 0, local, foreign);
+  return 0;
 }
 
-static ssize_t
-tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
+// an active open for a 4-tuple in TIME-WAIT, takes it over if safe (iss is set to go beyond the old one)
+static int
+tcp_timewait_reuse(struct ip_endpoint *local, struct ip_endpoint *foreign, uint32_t *iss)
 {
-  uint32_t seq;
+  struct tcp_timewait *tw;
+  int ret = 0;
 
-  seq = pcb->snd.nxt;
-  if (TCP_FLG_ISSET(flg, TCP_FLG_SYN))
-  {
-    seq = pcb->iss;
-  }
-  if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len)
+  mutex_lock(&table.mutex);
+  tw = table.timewait.count ? tcp_timewait_lookup(local, foreign) : NULL;
+  if (tw)
   {
-    tcp_retransmit_queue_add(pcb, seq, flg, data, len);
+    if ((tw->flags & TCP_TW_F_TS) && (int32_t)(tcp_ts_now() - tw->ts_stamp) >= TCP_TIMEWAIT_REUSE_DELAY)
+    {
+      *iss = tw->snd_nxt + 65535 + 2;
+      tcp_timewait_unlink(tw);
+    }
+    else
+    {
+      ret = -1;
+    }
   }
-  return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+  mutex_unlock(&table.mutex);
+  return ret;
 }
 
-/* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
+/*
+ * rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES]
+ * NOTE: pcb (if any) must be locked
+ */
 static void
-tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_segment_arrives(struct tcp_pcb *pcb, struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-  int acceptable = 0;
-  struct tcp_pcb *pcb;
+  int acceptable = 0, fin, hole;
+  uint32_t nxt, wnd;
+  struct tcp_rate_sample rs = {};
 
-  pcb = tcp_pcb_select(local, foreign);
   if (!pcb || pcb->state == TCP_PCB_STATE_CLOSED)
   {
     if (TCP_FLG_ISSET(flags, TCP_FLG_RST))
@@ -402,11 +3871,11 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     }
     if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK))
     {
-      tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
+      tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, NULL, 0, local, foreign);
     }
     else
     {
-      tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+      tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, NULL, 0, local, foreign);
     }
     return;
   }
@@ -425,7 +3894,11 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
      */
     if (TCP_FLG_ISSET(flags, TCP_FLG_ACK))
     {
-      tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+      if (pcb->backlog.max && !TCP_FLG_ISSET(flags, TCP_FLG_SYN) && tcp_cookie_ack(pcb, seg, flags, data, len, local, foreign) == 0)
+      {
+        return;
+      }
+      tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, NULL, 0, local, foreign);
     }
     /*
      * 3rd check for an SYN
@@ -434,16 +3907,12 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     /* ignore: precedence check */
     if (TCP_FLG_ISSET(flags, TCP_FLG_SYN))
     {
-      pcb->local = *local;
-      pcb->foreign = *foreign;
-      pcb->rcv.wnd = sizeof(pcb->buf);
-      pcb->rcv.nxt = seg->seq + 1;                         // expected next recieve seq num(used in ACK)
-      pcb->irs = seg->seq;                                 // initial recived seq num
-      pcb->iss = random();                                 // get initial seq num
-      tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0); // output SYN/ACK
-      pcb->snd.nxt = pcb->iss + 1;
-      pcb->snd.una = pcb->iss;
-      pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
+      if (pcb->backlog.max)
+      {
+        tcp_listen_syn(pcb, seg, local, foreign);
+        return;
+      }
+      tcp_pcb_syn_received(pcb, seg, local, foreign);
       /* ignore: Note that any other incoming control or data (combined with SYN) will be processed
                   in the SYN-RECEIVED state, but processing of SYN and ACK  should not be repeated */
       return;
@@ -461,7 +3930,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     {
       if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt)
       {
-        tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+        tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, NULL, 0, local, foreign);
         return;
       }
       if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt)
@@ -480,19 +3949,21 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
      */
     if (TCP_FLG_ISSET(flags, TCP_FLG_SYN))
     {
+      tcp_options_negotiate(pcb, &seg->opt);
       pcb->rcv.nxt = seg->seq + 1;
+      pcb->rcv.adv = pcb->rcv.nxt;
       pcb->irs = seg->seq;
       if (acceptable)
       {
         pcb->snd.una = seg->ack;
-        tcp_retransmit_queue_cleanup(pcb);
+        tcp_retransmit_queue_cleanup(pcb, NULL);
       }
       if (pcb->snd.una > pcb->iss)
       {
         pcb->state = TCP_PCB_STATE_ESTABLISHED;
-        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        tcp_output(pcb, TCP_FLG_ACK);
         /* NOTE: not specified in the RFC793, but send window initialization required */
-        pcb->snd.wnd = seg->wnd;
+        pcb->snd.wnd = seg->wnd; /* not scaled in SYN */
         pcb->snd.wl1 = seg->seq;
         pcb->snd.wl2 = seg->ack;
         sched_wakeup(&pcb->ctx);
@@ -502,7 +3973,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
       else
       {
         pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
-        tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+        tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK);
         /* ignore: If there are other controls or text in the segment, queue them for processing after the ESTABLISHED state has been reached */
         return;
       }
@@ -527,6 +3998,13 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
   case TCP_PCB_STATE_FIN_WAIT2:
   case TCP_PCB_STATE_CLOSE_WAIT:
   case TCP_PCB_STATE_LAST_ACK:
+    if ((pcb->options & TCP_OPT_F_TS) && (seg->opt.flags & TCP_OPT_F_TS) && !TCP_FLG_ISSET(flags, TCP_FLG_RST) &&
+        (int32_t)(seg->opt.tsval - pcb->ts_recent) < 0)
+    {
+      /* PAWS (RFC 7323 5.3), an old duplicate from a wrapped sequence space */
+      tcp_output(pcb, TCP_FLG_ACK);
+      return;
+    }
     if (!seg->len)
     {
       if (!pcb->rcv.wnd)
@@ -563,10 +4041,15 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     {
       if (!TCP_FLG_ISSET(flags, TCP_FLG_RST))
       {
-        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        tcp_output(pcb, TCP_FLG_ACK);
       }
       return;
     }
+    if ((pcb->options & TCP_OPT_F_TS) && (seg->opt.flags & TCP_OPT_F_TS) && (int32_t)(seg->seq - pcb->rcv.nxt) <= 0)
+    {
+      /* the one to echo (RFC 7323 4.3) */
+      pcb->ts_recent = seg->opt.tsval;
+    }
     /*
      * In the following it is assumed that the segment is the idealized
      * segment that begins at RCV.NXT and does not exceed the window.
@@ -604,7 +4087,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     }
     else
     {
-      tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+      tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, NULL, 0, local, foreign);
       return;
     }
     /* fall through */
@@ -612,32 +4095,58 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
   case TCP_PCB_STATE_FIN_WAIT1:
   case TCP_PCB_STATE_FIN_WAIT2:
   case TCP_PCB_STATE_CLOSE_WAIT:
+  case TCP_PCB_STATE_CLOSING:
+  case TCP_PCB_STATE_LAST_ACK:
+    wnd = (uint32_t)seg->wnd << pcb->snd.wscale;
     if (pcb->snd.una < seg->ack && seg->ack <= pcb->snd.nxt)
     {
-      pcb->snd.una = seg->ack;
-      tcp_retransmit_queue_cleanup(pcb);
-      /* ignore: Users should receive positive acknowledgments for buffers
-                  which have been SENT and fully acknowledged (i.e., SEND buffer should be returned with "ok" response) */
-      if (pcb->snd.wl1 < seg->seq || (pcb->snd.wl1 == seg->seq && pcb->snd.wl2 <= seg->ack))
+      /* the data acknowledged is dropped from the send buffer, and its space is given to the senders */
+      rs.acked = seg->ack - pcb->snd.una;
+      rs.interval = 0;
+      tcp_sndbuf_ack(pcb, seg->ack);
+      tcp_retransmit_queue_cleanup(pcb, &rs);
+      tcp_sack_update(pcb, &seg->opt);
+      if (pcb->mss)
       {
-        pcb->snd.wnd = seg->wnd;
-        pcb->snd.wl1 = seg->seq;
-        pcb->snd.wl2 = seg->ack;
+        tcp_cc_ack(pcb, &rs);
       }
     }
+    else if (seg->ack == pcb->snd.una && !len && !TCP_FLG_ISSET(flags, TCP_FLG_SYN | TCP_FLG_FIN) &&
+             wnd && wnd == pcb->snd.wnd && pcb->snd.nxt != pcb->snd.una && pcb->mss)
+    {
+      /* duplicate ACK (RFC 5681), a segment has arrived beyond a hole (an answer to a zero window probe is not) */
+      tcp_sack_update(pcb, &seg->opt);
+      tcp_cc_dupack(pcb);
+    }
     else if (seg->ack < pcb->snd.una)
     {
       /* ignore */
     }
     else if (seg->ack > pcb->snd.nxt)
     {
-      tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+      tcp_output(pcb, TCP_FLG_ACK);
       return;
     }
+    if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt)
+    {
+      /* also by a pure window update (the same ACK with a new window) */
+      if (pcb->snd.wl1 < seg->seq || (pcb->snd.wl1 == seg->seq && pcb->snd.wl2 <= seg->ack))
+      {
+        pcb->snd.wnd = wnd;
+        pcb->snd.wl1 = seg->seq;
+        pcb->snd.wl2 = seg->ack;
+      }
+      if (!pcb->snd.wnd && seg->ack == pcb->snd.una && pcb->snd.nxt != pcb->snd.una)
+      {
+        tcp_retransmit_persist(pcb);
+      }
+      /* ACK clocking, the window may have moved forward */
+      tcp_transmit(pcb);
+    }
     switch (pcb->state)
     {
     case TCP_PCB_STATE_FIN_WAIT1:
-      if (seg->ack == pcb->snd.nxt)
+      if (pcb->fin == TCP_FIN_SENT && seg->ack == pcb->snd.nxt)
       {
         pcb->state = TCP_PCB_STATE_FIN_WAIT2;
       }
@@ -648,15 +4157,22 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_CLOSE_WAIT:
       /* do nothing */
       break;
+    case TCP_PCB_STATE_CLOSING:
+      if (pcb->fin == TCP_FIN_SENT && seg->ack == pcb->snd.nxt)
+      {
+        tcp_timewait_enter(pcb);
+        return;
+      }
+      break;
+    case TCP_PCB_STATE_LAST_ACK:
+      if (pcb->fin == TCP_FIN_SENT && seg->ack == pcb->snd.nxt)
+      {
+        pcb->state = TCP_PCB_STATE_CLOSED;
+        tcp_pcb_release(pcb);
+      }
+      return;
     }
     break;
-  case TCP_PCB_STATE_LAST_ACK:
-    if (seg->ack == pcb->snd.nxt)
-    {
-      pcb->state = TCP_PCB_STATE_CLOSED;
-      tcp_pcb_release(pcb);
-    }
-    return;
   }
   /*
    * 6th, check the URG bit (ignore)
@@ -669,13 +4185,40 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
   case TCP_PCB_STATE_ESTABLISHED:
   case TCP_PCB_STATE_FIN_WAIT1:
   case TCP_PCB_STATE_FIN_WAIT2:
-    if (len)
+    if (len || TCP_FLG_ISSET(flags, TCP_FLG_FIN))
     {
-      memcpy(pcb->buf + (sizeof(pcb->buf) - pcb->rcv.wnd), data, len);
-      pcb->rcv.nxt = seg->seq + seg->len;
-      pcb->rcv.wnd -= len;
-      tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-      sched_wakeup(&pcb->ctx);
+      /* in sequence, or held until the gap is filled (FIN is processed when reached) */
+      fin = TCP_FLG_ISSET(flags, TCP_FLG_FIN);
+      nxt = pcb->rcv.nxt;
+      hole = pcb->ooo.head != NULL;
+      if (tcp_reass(pcb, seg->seq, data, len, &fin) == -1)
+      {
+        /* drop segment, the peer retransmits it */
+        return;
+      }
+      if (!fin)
+      {
+        flags &= ~TCP_FLG_FIN;
+      }
+      if (pcb->rcv.nxt != nxt)
+      {
+        tcp_rcvbuf_window(pcb);
+        tcp_rcvbuf_rtt_measure(pcb);
+        sched_wakeup(&pcb->ctx);
+      }
+      if (!fin)
+      {
+        if (!hole && !pcb->ooo.head && pcb->rcv.nxt - nxt == len)
+        {
+          tcp_delack_schedule(pcb, len);
+        }
+        else
+        {
+          /* a duplicate ACK if out of order, which tells the sender about the hole (and the filling of it) */
+          tcp_delack_quick(pcb);
+          tcp_output(pcb, TCP_FLG_ACK);
+        }
+      }
     }
     break;
   case TCP_PCB_STATE_CLOSE_WAIT:
@@ -695,8 +4238,8 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
       /* drop segment */
       return;
     }
-    pcb->rcv.nxt = seg->seq + 1;
-    tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+    /* RCV.NXT has been advanced over FIN with the text */
+    tcp_output(pcb, TCP_FLG_ACK);
     switch (pcb->state)
     {
     case TCP_PCB_STATE_SYN_RECEIVED:
@@ -705,10 +4248,9 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
       sched_wakeup(&pcb->ctx);
       break;
     case TCP_PCB_STATE_FIN_WAIT1:
-      if (seg->ack == pcb->snd.nxt)
+      if (pcb->fin == TCP_FIN_SENT && seg->ack == pcb->snd.nxt)
       {
-        pcb->state = TCP_PCB_STATE_TIME_WAIT;
-        // tcp_set_timewait_timer(pcb);
+        tcp_timewait_enter(pcb);
       }
       else
       {
@@ -716,8 +4258,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
       }
       break;
     case TCP_PCB_STATE_FIN_WAIT2:
-      pcb->state = TCP_PCB_STATE_TIME_WAIT;
-      // tcp_set_timewait_timer(pcb);
+      tcp_timewait_enter(pcb);
       break;
     case TCP_PCB_STATE_CLOSE_WAIT:
       /* Remain in the CLOSE-WAIT state */
@@ -732,8 +4273,10 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
 
 // tcp segment recieved
 static void
-tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+tcp_input(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
+  const uint8_t *data = pb->data;
+  size_t len = pb->len;
   struct tcp_hdr *hdr;
   struct pseudo_hdr pseudo;
   uint16_t psum;
@@ -742,6 +4285,7 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
   struct ip_endpoint local, foreign;
   uint16_t hlen;
   struct tcp_segment_info seg;
+  struct tcp_pcb *pcb, *listener;
 
   if (len < sizeof(*hdr))
   {
@@ -776,6 +4320,16 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
   foreign.addr = src;
   foreign.port = hdr->src;
   hlen = (hdr->off >> 4) << 2;
+  if (hlen < sizeof(*hdr) || hlen > len)
+  {
+    errorf("invalid data offset, hlen=%u, len=%zu", hlen, len);
+    return;
+  }
+  if (tcp_options_parse((uint8_t *)(hdr + 1), hlen - sizeof(*hdr), &seg.opt) == -1)
+  {
+    errorf("malformed options");
+    return;
+  }
   seg.seq = ntoh32(hdr->seq);
   seg.ack = ntoh32(hdr->ack);
   seg.len = len - hlen;
@@ -789,59 +4343,85 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
   }
   seg.wnd = ntoh16(hdr->wnd);
   seg.up = ntoh16(hdr->up);
-  mutex_lock(&mutex);
-  tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
-  mutex_unlock(&mutex);
-  return;
-}
-
-static void
-tcp_timer(void)
-{
-  struct tcp_pcb *pcb;
-
-  mutex_lock(&mutex);
-  for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
+  pcb = tcp_pcb_select(&local, &foreign);
+  if ((!pcb || pcb->state == TCP_PCB_STATE_LISTEN) && tcp_timewait_input(pcb, &seg, hdr->flg, &local, &foreign) == 0)
   {
-    if (pcb->state == TCP_PCB_STATE_FREE)
+    if (pcb)
     {
-      continue;
+      tcp_pcb_unlock(pcb);
+    }
+    return;
+  }
+  tcp_segment_arrives(pcb, &seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+  if (pcb)
+  {
+    if (pcb->parent && pcb->state != TCP_PCB_STATE_SYN_RECEIVED)
+    {
+      /* established child, goes to the listener with the reference of the lookup */
+      listener = pcb->parent;
+      pcb->parent = NULL;
+      mutex_unlock(&pcb->mutex);
+      tcp_listen_enqueue(listener, pcb);
+      return;
     }
-    queue_foreach(&pcb->queue, tcp_retransmit_queue_emit, pcb);
+    tcp_pcb_unlock(pcb);
   }
-  mutex_unlock(&mutex);
+  return;
 }
 
 static void
 event_handler(void *arg)
 {
   struct tcp_pcb *pcb;
-  mutex_lock(&mutex);
-  for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
+  int id, size;
+
+  mutex_lock(&table.mutex);
+  size = table.size;
+  mutex_unlock(&table.mutex);
+  for (id = 0; id < size; id++)
   {
-    if (pcb->state != TCP_PCB_STATE_FREE)
+    pcb = tcp_pcb_get(id);
+    if (pcb)
     {
       sched_interrupt(&pcb->ctx);
+      tcp_pcb_unlock(pcb);
     }
   }
-  mutex_unlock(&mutex);
 }
 
 int tcp_init(void)
 {
-  struct timeval interval = {0, 100000};
-
-  if (ip_protocol_register(IP_PROTOCOL_TCP, tcp_input) == -1)
+  /* unpredictable, the chains must not be flooded on purpose */
+  if (getrandom(&table.secret, sizeof(table.secret), 0) != sizeof(table.secret))
   {
-    errorf("ip_protocol_register() failure");
+    errorf("getrandom: %s", strerror(errno));
     return -1;
   }
-  net_event_subscribe(event_handler, NULL);
-  if (net_timer_register(interval, tcp_timer) == -1)
+  /* a predictable key would let anyone forge an ACK with a valid cookie */
+  if (getrandom(tcp_cookie_key, sizeof(tcp_cookie_key), 0) != sizeof(tcp_cookie_key))
+  {
+    errorf("getrandom: %s", strerror(errno));
+    return -1;
+  }
+  table.ids = memory_alloc(sizeof(*table.ids) * TCP_PCB_SIZE);
+  table.established.buckets = memory_alloc(sizeof(*table.established.buckets) * TCP_ESTABLISHED_HASH_SIZE);
+  table.timewait.buckets = memory_alloc(sizeof(*table.timewait.buckets) * TCP_TIMEWAIT_HASH_SIZE);
+  if (!table.ids || !table.established.buckets || !table.timewait.buckets)
+  {
+    errorf("memory_alloc() failure");
+    return -1;
+  }
+  table.size = TCP_PCB_SIZE;
+  table.established.size = TCP_ESTABLISHED_HASH_SIZE;
+  table.timewait.size = TCP_TIMEWAIT_HASH_SIZE;
+  queue_init(&table.timewait.queue);
+  net_timer_init(&table.timewait.reaper, tcp_timewait_reaper, NULL);
+  if (ip_protocol_register(IP_PROTOCOL_TCP, tcp_input) == -1)
   {
-    errorf("net_timer_register() failure");
+    errorf("ip_protocol_register() failure");
     return -1;
   }
+  net_event_subscribe(event_handler, NULL);
   return 0;
 }
 
@@ -852,37 +4432,63 @@ int tcp_init(void)
 int tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int active)
 {
   struct tcp_pcb *pcb;
+  struct ip_iface *iface;
   char ep1[IP_ENDPOINT_STR_LEN];
   char ep2[IP_ENDPOINT_STR_LEN];
   int state, id;
 
-  mutex_lock(&mutex);
   pcb = tcp_pcb_alloc();
   if (!pcb)
   {
     errorf("tcp_pcb_alloc() failure");
-    mutex_unlock(&mutex);
     return -1;
   }
   if (active)
   {
     debugf("active open: local=%s, foreign=%s, connecting...",
-           ip_endpoint_ntop(local, ep1, sizeof(ep1), ip_endpoint_ntop(foreign, ep2, sizeof(ep2))));
+           ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
     pcb->local = *local;
     pcb->foreign = *foreign;
-    pcb->rcv.wnd = sizeof(pcb->buf);
+    if (pcb->local.addr == IP_ADDR_ANY)
+    {
+      /* connections are demuxed by the exact 4-tuple, fix the source address */
+      iface = ip_route_get_iface(foreign->addr);
+      if (!iface)
+      {
+        errorf("no route to host, foreign=%s", ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
+        pcb->state = TCP_PCB_STATE_CLOSED;
+        tcp_pcb_release(pcb);
+        tcp_pcb_unlock(pcb);
+        return -1;
+      }
+      pcb->local.addr = iface->unicast;
+    }
+    tcp_rcvbuf_init(pcb);
+    tcp_options_offer(pcb);
     pcb->iss = random();
-    if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1)
+    if (tcp_timewait_reuse(&pcb->local, &pcb->foreign, &pcb->iss) == -1)
     {
-      errorf("tcp_output() failure");
+      errorf("in TIME-WAIT, local=%s, foreign=%s",
+             ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
       pcb->state = TCP_PCB_STATE_CLOSED;
       tcp_pcb_release(pcb);
-      mutex_unlock(&mutex);
+      tcp_pcb_unlock(pcb);
+      errno = EADDRINUSE;
       return -1;
     }
     pcb->snd.una = pcb->iss;
     pcb->snd.nxt = pcb->iss + 1;
     pcb->state = TCP_PCB_STATE_SYN_SENT;
+    /* hashed before sending, the SYN/ACK may be processed on another worker */
+    tcp_pcb_rehash(pcb);
+    if (tcp_output(pcb, TCP_FLG_SYN) == -1)
+    {
+      errorf("tcp_output() failure");
+      pcb->state = TCP_PCB_STATE_CLOSED;
+      tcp_pcb_release(pcb);
+      tcp_pcb_unlock(pcb);
+      return -1;
+    }
   }
   else
   {
@@ -893,18 +4499,19 @@ int tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int
       pcb->foreign = *foreign;
     }
     pcb->state = TCP_PCB_STATE_LISTEN;
+    tcp_pcb_rehash(pcb);
   }
 AGAIN:
   state = pcb->state;
   /* waiting for state changed */
   while (pcb->state == state)
   {
-    if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1)
+    if (sched_sleep(&pcb->ctx, &pcb->mutex, NULL) == -1)
     {
       debugf("interrupted");
       pcb->state = TCP_PCB_STATE_CLOSED;
       tcp_pcb_release(pcb);
-      mutex_unlock(&mutex);
+      tcp_pcb_unlock(pcb);
       errno = EINTR;
       return -1;
     }
@@ -918,43 +4525,136 @@ AGAIN:
     errorf("open error: %d", pcb->state);
     pcb->state = TCP_PCB_STATE_CLOSED;
     tcp_pcb_release(pcb);
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return -1;
   }
   id = tcp_pcb_id(pcb);
   debugf("connection established: local=%s, foreign=%s",
          ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-  mutex_unlock(&mutex);
+  tcp_pcb_unlock(pcb);
   return id;
 }
 
-int tcp_close(int id)
+// passive open which keeps listening, the connections are taken by tcp_accept()
+int tcp_listen(struct ip_endpoint *local, int backlog)
 {
   struct tcp_pcb *pcb;
+  char ep[IP_ENDPOINT_STR_LEN];
+  int id;
+
+  pcb = tcp_pcb_alloc();
+  if (!pcb)
+  {
+    errorf("tcp_pcb_alloc() failure");
+    return -1;
+  }
+  pcb->local = *local;
+  pcb->backlog.max = MIN(MAX(backlog, 1), TCP_BACKLOG_MAX);
+  queue_init(&pcb->backlog.accept);
+  pcb->state = TCP_PCB_STATE_LISTEN;
+  tcp_pcb_rehash(pcb);
+  id = tcp_pcb_id(pcb);
+  debugf("listen: local=%s, backlog=%u", ip_endpoint_ntop(local, ep, sizeof(ep)), pcb->backlog.max);
+  tcp_pcb_unlock(pcb);
+  return id;
+}
+
+// wait for an established connection on the listener, returns its ID
+int tcp_accept(int id)
+{
+  struct tcp_pcb *pcb, *child;
+  struct queue_entry *entry;
+  char ep1[IP_ENDPOINT_STR_LEN];
+  char ep2[IP_ENDPOINT_STR_LEN];
+  int cid;
+
+RETRY:
+  pcb = tcp_pcb_get(id);
+  if (!pcb)
+  {
+    errorf("pcb not found");
+    return -1;
+  }
+  if (pcb->state != TCP_PCB_STATE_LISTEN || !pcb->backlog.max)
+  {
+    errorf("not listening, id=%d", id);
+    tcp_pcb_unlock(pcb);
+    return -1;
+  }
+  while (!(entry = queue_pop(&pcb->backlog.accept)))
+  {
+    if (sched_sleep(&pcb->ctx, &pcb->mutex, NULL) == -1)
+    {
+      debugf("interrupted");
+      tcp_pcb_unlock(pcb);
+      errno = EINTR;
+      return -1;
+    }
+    if (pcb->state != TCP_PCB_STATE_LISTEN)
+    {
+      debugf("closed");
+      if (pcb->state == TCP_PCB_STATE_CLOSED)
+      {
+        tcp_pcb_release(pcb);
+      }
+      tcp_pcb_unlock(pcb);
+      return -1;
+    }
+  }
+  tcp_pcb_unlock(pcb);
+  /* the reference of the accept queue is taken over */
+  child = queue_data(entry, struct tcp_pcb, alink);
+  mutex_lock(&child->mutex);
+  if (child->state == TCP_PCB_STATE_FREE || child->state == TCP_PCB_STATE_CLOSED)
+  {
+    /* died in the queue */
+    if (child->state == TCP_PCB_STATE_CLOSED)
+    {
+      tcp_pcb_release(child);
+    }
+    tcp_pcb_unlock(child);
+    goto RETRY;
+  }
+  cid = tcp_pcb_id(child);
+  debugf("accepted: local=%s, foreign=%s, id=%d",
+         ip_endpoint_ntop(&child->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&child->foreign, ep2, sizeof(ep2)), cid);
+  tcp_pcb_unlock(child);
+  return cid;
+}
+
+int tcp_close(int id)
+{
+  struct tcp_pcb *pcb, *child;
+  struct queue_head accept = {};
+  struct queue_entry *entry;
 
-  mutex_lock(&mutex);
   pcb = tcp_pcb_get(id);
   if (!pcb)
   {
     errorf("pcb not found");
-    mutex_unlock(&mutex);
     return -1;
   }
   switch (pcb->state)
   {
   case TCP_PCB_STATE_ESTABLISHED:
-    tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-    pcb->snd.nxt++;
+    /* FIN goes after the data in the send buffer */
+    pcb->fin = TCP_FIN_REQUESTED;
     pcb->state = TCP_PCB_STATE_FIN_WAIT1;
+    tcp_transmit(pcb);
     break;
   case TCP_PCB_STATE_CLOSE_WAIT:
-    tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-    pcb->snd.nxt++;
+    pcb->fin = TCP_FIN_REQUESTED;
     pcb->state = TCP_PCB_STATE_LAST_ACK; /* RFC793 says "enter CLOSING state", but it seems to be LAST-ACK state */
+    tcp_transmit(pcb);
+    break;
+  case TCP_PCB_STATE_LISTEN:
+    /* the children not accepted yet are reset (after unlocking), the ones in SYN-RECEIVED find it closed */
+    pcb->state = TCP_PCB_STATE_CLOSED;
+    queue_splice(&accept, &pcb->backlog.accept);
     break;
   default:
     errorf("unknown state '%u'", pcb->state);
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return -1;
   }
   if (pcb->state == TCP_PCB_STATE_CLOSED)
@@ -965,7 +4665,14 @@ int tcp_close(int id)
   {
     sched_wakeup(&pcb->ctx);
   }
-  mutex_unlock(&mutex);
+  tcp_pcb_unlock(pcb);
+  while ((entry = queue_pop(&accept)))
+  {
+    child = queue_data(entry, struct tcp_pcb, alink);
+    mutex_lock(&child->mutex);
+    tcp_pcb_abort(child);
+    tcp_pcb_unlock(child);
+  }
   return 0;
 }
 
@@ -973,16 +4680,12 @@ ssize_t
 tcp_send(int id, uint8_t *data, size_t len)
 {
   struct tcp_pcb *pcb;
-  ssize_t sent = 0;
-  struct ip_iface *iface;
-  size_t mss, cap, slen;
+  ssize_t sent = 0, copied;
 
-  mutex_lock(&mutex);
   pcb = tcp_pcb_get(id);
   if (!pcb)
   {
     errorf("pcb not found");
-    mutex_unlock(&mutex);
     return -1;
   }
 RETRY:
@@ -990,25 +4693,17 @@ RETRY:
   {
   case TCP_PCB_STATE_ESTABLISHED:
   case TCP_PCB_STATE_CLOSE_WAIT:
-    iface = ip_route_get_iface(pcb->local.addr);
-    if (!iface)
-    {
-      errorf("iface not found");
-      mutex_unlock(&mutex);
-      return -1;
-    }
-    mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+    /* returns once the data is in the send buffer, the ACKs clock it out */
     while (sent < (ssize_t)len)
     {
-      cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
-      if (!cap)
+      if (pcb->sndbuf.len == pcb->sndbuf.size && tcp_sndbuf_expand(pcb) == -1)
       {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1)
+        if (sched_sleep(&pcb->ctx, &pcb->mutex, NULL) == -1)
         {
           debugf("interrupted");
           if (!sent)
           {
-            mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             errno = EINTR;
             return -1;
           }
@@ -1016,57 +4711,138 @@ RETRY:
         }
         goto RETRY;
       }
-      slen = MIN(MIN(mss, len - sent), cap);
-      if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen) == -1)
+      copied = tcp_sndbuf_write(pcb, data + sent, len - sent);
+      if (copied == -1)
       {
-        errorf("tcp_output() failure");
-        pcb->state = TCP_PCB_STATE_CLOSED;
-        tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
-        return -1;
+        if (!sent)
+        {
+          tcp_pcb_unlock(pcb);
+          return -1;
+        }
+        break;
       }
-      pcb->snd.nxt += slen;
-      sent += slen;
+      sent += copied;
+      tcp_transmit(pcb);
     }
     break;
   case TCP_PCB_STATE_LAST_ACK:
     errorf("connection closing");
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return -1;
   default:
     errorf("unknown state '%u'", pcb->state);
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return -1;
   }
-  mutex_unlock(&mutex);
+  tcp_pcb_unlock(pcb);
   return sent;
 }
 
+// poll the devices in the receiving thread for up to usec before sleeping (0: disabled)
+int tcp_set_busy_poll(int id, unsigned int usec)
+{
+  struct tcp_pcb *pcb;
+
+  pcb = tcp_pcb_get(id);
+  if (!pcb)
+  {
+    errorf("pcb not found");
+    return -1;
+  }
+  pcb->busy_poll = usec;
+  tcp_pcb_unlock(pcb);
+  return 0;
+}
+
+// delay the ACK of in-sequence data for up to msec (0: acknowledge every segment right away)
+int tcp_set_delack(int id, unsigned int msec)
+{
+  struct tcp_pcb *pcb;
+
+  if (msec > TCP_DELACK_TIMEOUT_MAX)
+  {
+    errorf("too long, msec=%u, max=%u", msec, TCP_DELACK_TIMEOUT_MAX);
+    return -1;
+  }
+  pcb = tcp_pcb_get(id);
+  if (!pcb)
+  {
+    errorf("pcb not found");
+    return -1;
+  }
+  pcb->delack.timeout = msec;
+  tcp_pcb_unlock(pcb);
+  return 0;
+}
+
+// select the congestion control algorithm of the connection (e.g. "newreno")
+int tcp_set_congestion(int id, const char *name)
+{
+  struct tcp_pcb *pcb;
+  const struct tcp_congestion_ops *ops;
+
+  ops = tcp_cc_lookup(name);
+  if (!ops)
+  {
+    errorf("unknown algorithm, name=%s", name);
+    return -1;
+  }
+  pcb = tcp_pcb_get(id);
+  if (!pcb)
+  {
+    errorf("pcb not found");
+    return -1;
+  }
+  pcb->cc.ops = ops;
+  if (pcb->mss)
+  {
+    tcp_cc_init(pcb);
+  }
+  tcp_pcb_unlock(pcb);
+  return 0;
+}
+
+static int
+tcp_receive_ready(void *arg)
+{
+  struct tcp_pcb *pcb;
+
+  pcb = (struct tcp_pcb *)arg;
+  return pcb->rcvbuf.len || pcb->state != TCP_PCB_STATE_ESTABLISHED;
+}
+
 ssize_t
 tcp_receive(int id, uint8_t *buf, size_t size)
 {
   struct tcp_pcb *pcb;
   size_t remain, len;
+  int polled = 0;
 
-  mutex_lock(&mutex);
   pcb = tcp_pcb_get(id);
   if (!pcb)
   {
     errorf("pcb not found");
-    mutex_unlock(&mutex);
     return -1;
   }
 RETRY:
   switch (pcb->state)
   {
   case TCP_PCB_STATE_ESTABLISHED:
-    remain = sizeof(pcb->buf) - pcb->rcv.wnd;
+    remain = pcb->rcvbuf.len;
     if (!remain)
     {
-      if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1)
+      if (pcb->busy_poll && !polled)
+      {
+        polled = 1;
+        if (net_busy_wait(pcb->busy_poll, &pcb->mutex, tcp_receive_ready, pcb))
+        {
+          goto RETRY;
+        }
+      }
+      if (sched_sleep(&pcb->ctx, &pcb->mutex, NULL) == -1)
       {
         debugf("interrupted");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         errno = EINTR;
         return -1;
       }
@@ -1074,23 +4850,27 @@ RETRY:
     }
     break;
   case TCP_PCB_STATE_CLOSE_WAIT:
-    remain = sizeof(pcb->buf) - pcb->rcv.wnd;
+    remain = pcb->rcvbuf.len;
     if (remain)
     {
       break;
     }
     debugf("connection closing");
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return 0;
   default:
     errorf("unknown state '%u'", pcb->state);
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return -1;
   }
-  len = MIN(size, remain);
-  memcpy(buf, pcb->buf, len);
-  memmove(pcb->buf, pcb->buf + len, remain - len);
-  pcb->rcv.wnd += len;
-  mutex_unlock(&mutex);
+  len = tcp_rcvbuf_read(pcb, buf, size);
+  tcp_rcvbuf_tune(pcb, len);
+  tcp_rcvbuf_window(pcb);
+  if (pcb->state == TCP_PCB_STATE_ESTABLISHED && tcp_rcvbuf_update_due(pcb))
+  {
+    /* the sender may be held back by the window we advertised, not to wait for its probe */
+    tcp_output(pcb, TCP_FLG_ACK);
+  }
+  tcp_pcb_unlock(pcb);
   return len;
 }
\ No newline at end of file
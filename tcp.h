@@ -9,10 +9,20 @@ tcp_init(void);
 extern int
 tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int active);
 extern int
+tcp_listen(struct ip_endpoint *local, int backlog);
+extern int
+tcp_accept(int id);
+extern int
 tcp_close(int id);
 extern ssize_t
 tcp_send(int id, uint8_t *data, size_t len);
 extern ssize_t
 tcp_receive(int id, uint8_t *buf, size_t size);
+extern int
+tcp_set_busy_poll(int id, unsigned int usec);
+extern int
+tcp_set_delack(int id, unsigned int msec);
+extern int
+tcp_set_congestion(int id, const char *name);
 
 #endif
\ No newline at end of file
@@ -116,7 +116,7 @@ int main(int argc, char *argv[])
   }
   while (!terminate)
   {
-    ret = tcp_recieve(soc, buf, sizeof(buf));
+    ret = tcp_receive(soc, buf, sizeof(buf));
     if (ret <= 0)
     {
       break;
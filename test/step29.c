@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "udp.h"
+#include "icmp.h"
+#include "tcp.h"
+
+#include "driver/loopback.h"
+#include "driver/ether_tap.h"
+
+#include "test.h"
+
+/*
+ * Bulk transfer benchmark for the congestion control
+ *
+ * usage: step29.exe [algorithm] [seconds]
+ *
+ * Sends to 192.0.2.1:10007 (e.g. `nc -l 10007 > /dev/null` on the host) and prints
+ * the throughput of every 100ms, then the steady rate (the average of the second half)
+ * and how long it took to reach 90% of it over a second. The throughput is the data
+ * accepted by tcp_send(), so the growth of the send buffer shows as bursts.
+ * A long fat pipe is emulated on the host side, where the data arrives on the ingress
+ * of tap0, e.g.
+ *
+ *   ip link add ifb0 type ifb && ip link set ifb0 up
+ *   tc qdisc add dev tap0 ingress
+ *   tc filter add dev tap0 parent ffff: matchall action mirred egress redirect dev ifb0
+ *   tc qdisc add dev ifb0 root netem delay 50ms rate 100mbit limit 10000
+ */
+
+#define BENCH_INTERVAL 100000 /* micro seconds */
+#define BENCH_WINDOW 10       /* intervals averaged for the time to reach */
+
+static volatile sig_atomic_t terminate;
+
+static void
+on_signal(int s)
+{
+  (void)s;
+  terminate = 1;
+  net_raise_event();
+}
+
+static int
+setup(void)
+{
+  struct net_device *dev;
+  struct ip_iface *iface;
+
+  signal(SIGINT, on_signal);
+  if (net_init() == -1)
+  {
+    errorf("net_init() failure");
+    return -1;
+  }
+  // add loopback device
+  dev = loopback_init();
+  if (!dev)
+  {
+    errorf("loopback_init() failure");
+    return -1;
+  }
+  iface = ip_iface_alloc(LOOPBACK_IP_ADDR, LOOPBACK_NETMASK);
+  if (!iface)
+  {
+    errorf("ip_iface_alloc() failure");
+    return -1;
+  }
+  if (ip_iface_register(dev, iface) == -1)
+  {
+    errorf("ip_iface_register() failure");
+    return -1;
+  }
+
+  // add ethernet device
+  dev = ether_tap_init(ETHER_TAP_NAME, ETHER_TAP_HW_ADDR);
+  if (!dev)
+  {
+    errorf("ether_tap_init() failure");
+    return -1;
+  }
+  iface = ip_iface_alloc(ETHER_TAP_IP_ADDR, ETHER_TAP_NETMASK);
+  if (!iface)
+  {
+    errorf("ip_iface_alloc() failure");
+    return -1;
+  }
+  if (ip_iface_register(dev, iface) == -1)
+  {
+    errorf("ip_iface_register() failure");
+    return -1;
+  }
+  if (ip_route_set_default_gateway(iface, DEFAULT_GATEWAY) == -1)
+  {
+    errorf("ip_route_set_default_gateway() failure");
+    return -1;
+  }
+  if (net_run() == -1)
+  {
+    errorf("net_run() failure");
+    return -1;
+  }
+  return 0;
+}
+
+static void
+cleanup(void)
+{
+  sleep(1);
+  net_shutdown();
+}
+
+static uint64_t
+now_usec(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+  struct ip_endpoint local, foreign;
+  int soc;
+  const char *algorithm = "cubic";
+  unsigned int seconds = 30, n = 0, i, j, reach = 0;
+  static uint8_t buf[65536];
+  static uint64_t bytes[1024];
+  uint64_t start, now, steady = 0, sum;
+  ssize_t ret;
+
+  if (argc > 1)
+  {
+    algorithm = argv[1];
+  }
+  if (argc > 2)
+  {
+    seconds = atoi(argv[2]);
+  }
+  if (setup() == -1)
+  {
+    errorf("setup() failure");
+    return -1;
+  }
+  ip_endpoint_pton("192.0.2.2:7", &local);
+  ip_endpoint_pton("192.0.2.1:10007", &foreign);
+  soc = tcp_open_rfc793(&local, &foreign, 1);
+  if (soc == -1)
+  {
+    errorf("tcp_open_rfc793() failure");
+    return -1;
+  }
+  if (tcp_set_congestion(soc, algorithm) == -1)
+  {
+    errorf("tcp_set_congestion() failure");
+    tcp_close(soc);
+    cleanup();
+    return -1;
+  }
+  start = now_usec();
+  while (!terminate)
+  {
+    ret = tcp_send(soc, buf, sizeof(buf));
+    if (ret <= 0)
+    {
+      break;
+    }
+    now = now_usec();
+    i = (now - start) / BENCH_INTERVAL;
+    if (i >= countof(bytes) || now - start >= seconds * 1000000ULL)
+    {
+      break;
+    }
+    bytes[i] += ret;
+    n = i + 1;
+  }
+  /* the last interval is partial */
+  n = n > 1 ? n - 1 : n;
+  for (i = 0; i < n; i++)
+  {
+    fprintf(stderr, "%6.1fs %8.2f Mbit/s\n", (i + 1) * BENCH_INTERVAL / 1000000.0,
+            bytes[i] * 8.0 / BENCH_INTERVAL);
+  }
+  for (i = n / 2; i < n; i++)
+  {
+    steady += bytes[i];
+  }
+  steady = n ? steady / (n - n / 2) : 0;
+  for (i = 0; i + BENCH_WINDOW <= n; i++)
+  {
+    sum = 0;
+    for (j = i; j < i + BENCH_WINDOW; j++)
+    {
+      sum += bytes[j];
+    }
+    if (sum * 10 >= steady * BENCH_WINDOW * 9)
+    {
+      reach = i + BENCH_WINDOW;
+      break;
+    }
+  }
+  fprintf(stderr, "%s: steady %.2f Mbit/s, 90%% reached in %.1fs\n", algorithm,
+          steady * 8.0 / BENCH_INTERVAL, reach * BENCH_INTERVAL / 1000000.0);
+  tcp_close(soc);
+  cleanup();
+  return 0;
+}
@@ -9,6 +9,7 @@
 #include "platform.h"
 
 #include "util.h"
+#include "pbuf.h"
 #include "ip.h"
 #include "udp.h"
 
@@ -41,20 +42,22 @@ struct udp_hdr
 
 struct udp_pcb
 {
+  mutex_t mutex; /* protects the members below */
   int state;
   struct ip_endpoint local;
   struct queue_head queue; /* receive queue */
   struct sched_ctx ctx;
+  unsigned int busy_poll; /* usec to poll before sleeping in receive (0: disabled) */
 };
 
 struct udp_queue_entry
 {
+  struct queue_entry link;
   struct ip_endpoint foreign;
-  uint16_t len;
-  uint8_t data[];
+  struct pbuf *pb; /* payload (without UDP header) */
 };
 
-static mutex_t mutex = MUTEX_INITIALIZER;
+static mutex_t mutex = MUTEX_INITIALIZER; /* serializes binding of local endpoints */
 static struct udp_pcb pcbs[UDP_PCB_SIZE];
 
 static void
@@ -77,7 +80,9 @@ udp_dump(const uint8_t *data, size_t len)
 /*
  * UDP Protocol Control Block (PCB)
  *
- * NOTE: UDP PCB functions must be called after mutex locked
+ * Each PCB has its own mutex, the functions returning a PCB return it locked.
+ *
+ * NOTE: UDP PCB functions (except alloc/select/get) must be called after pcb->mutex locked
  */
 
 static struct udp_pcb *
@@ -87,12 +92,15 @@ udp_pcb_alloc(void)
 
   for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
   {
+    mutex_lock(&pcb->mutex);
     if (pcb->state == UDP_PCB_STATE_FREE)
     {
       pcb->state = UDP_PCB_STATE_OPEN;
+      pcb->busy_poll = 0;
       sched_ctx_init(&pcb->ctx);
       return pcb;
     }
+    mutex_unlock(&pcb->mutex);
   }
   return NULL;
 }
@@ -100,7 +108,7 @@ udp_pcb_alloc(void)
 static void
 udp_pcb_release(struct udp_pcb *pcb)
 {
-  struct queue_entry *entry;
+  struct udp_queue_entry *entry;
 
   pcb->state = UDP_PCB_STATE_CLOSING;
   if (sched_ctx_destroy(&pcb->ctx) == -1)
@@ -113,11 +121,12 @@ udp_pcb_release(struct udp_pcb *pcb)
   pcb->local.port = 0;
   while (1)
   { // Discard the entries in the queue
-    entry = queue_pop(&pcb->queue);
+    entry = queue_data(queue_pop(&pcb->queue), struct udp_queue_entry, link);
     if (!entry)
     {
       break;
     }
+    pbuf_free(entry->pb);
     memory_free(entry);
   }
 }
@@ -129,6 +138,7 @@ udp_pcb_select(ip_addr_t addr, uint16_t port)
 
   for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
   {
+    mutex_lock(&pcb->mutex);
     if (pcb->state == UDP_PCB_STATE_OPEN)
     {
       // only target open status PCB
@@ -137,6 +147,35 @@ udp_pcb_select(ip_addr_t addr, uint16_t port)
         return pcb;
       }
     }
+    mutex_unlock(&pcb->mutex);
+  }
+  return NULL;
+}
+
+/*
+ * check if the endpoint is already bound by a PCB other than self
+ * NOTE: must be called after mutex (and self->mutex) locked
+ */
+static struct udp_pcb *
+udp_pcb_inuse(ip_addr_t addr, uint16_t port, struct udp_pcb *self)
+{
+  struct udp_pcb *pcb;
+  int found;
+
+  for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
+  {
+    if (pcb == self)
+    {
+      continue;
+    }
+    mutex_lock(&pcb->mutex);
+    found = pcb->state == UDP_PCB_STATE_OPEN &&
+            (pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == addr) && pcb->local.port == port;
+    mutex_unlock(&pcb->mutex);
+    if (found)
+    {
+      return pcb;
+    }
   }
   return NULL;
 }
@@ -152,8 +191,10 @@ udp_pcb_get(int id)
     return NULL;
   }
   pcb = &pcbs[id];
+  mutex_lock(&pcb->mutex);
   if (pcb->state != UDP_PCB_STATE_OPEN)
   {
+    mutex_unlock(&pcb->mutex);
     return NULL;
   }
   return pcb;
@@ -166,10 +207,10 @@ udp_pcb_id(struct udp_pcb *pcb)
 }
 
 // udp recieved
-// data is UDP header and data(without ip payload)
-// len is UDP header and data total length(without ip payload)
+// pb->data is UDP header and data(without ip header)
+// the payload is queued to the PCB without copy
 static void
-udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+udp_input(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
   struct pseudo_hdr pseudo;
   uint16_t psum = 0;
@@ -178,6 +219,8 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
   char addr2[IP_ADDR_STR_LEN];
   struct udp_pcb *pcb;
   struct udp_queue_entry *entry;
+  const uint8_t *data = pb->data;
+  size_t len = pb->len;
 
   if (len < sizeof(*hdr))
   {
@@ -207,40 +250,33 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
          ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
          len, len - sizeof(*hdr));
   udp_dump(data, len);
-  mutex_lock(&mutex);
   pcb = udp_pcb_select(dst, hdr->dst);
   if (!pcb)
   {
     // port is not in use
-    mutex_unlock(&mutex);
     return;
   }
-  entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
+  entry = memory_alloc_raw(sizeof(*entry));
   if (!entry)
   {
-    mutex_unlock(&mutex);
-    errorf("memory_alloc() failure");
+    mutex_unlock(&pcb->mutex);
+    errorf("memory_alloc_raw() failure");
     return;
   }
   entry->foreign.addr = src;
   entry->foreign.port = hdr->src;
-  entry->len = len - sizeof(*hdr);
-  memcpy(entry + 1, hdr + 1, entry->len);
-  if (!queue_push(&pcb->queue, entry))
-  {
-    mutex_unlock(&mutex);
-    errorf("queue_push() failure");
-    return;
-  }
+  pbuf_pull(pb, sizeof(*hdr));
+  entry->pb = pbuf_ref(pb);
+  queue_push(&pcb->queue, &entry->link);
   debugf("queue pushed: id=%d, num=%d", udp_pcb_id(pcb), pcb->queue.num);
   sched_wakeup(&pcb->ctx);
-  mutex_unlock(&mutex);
+  mutex_unlock(&pcb->mutex);
 }
 
 ssize_t
 udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data, size_t len)
 {
-  uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+  struct pbuf *pb;
   struct udp_hdr *hdr;
   struct pseudo_hdr pseudo;
   uint16_t total, psum = 0;
@@ -252,13 +288,20 @@ udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data
     errorf("too long");
     return -1;
   }
-  hdr = (struct udp_hdr *)buf;
+  // the only copy of the payload on the output path
+  pb = pbuf_alloc(PBUF_HEADROOM, len);
+  if (!pb)
+  {
+    errorf("pbuf_alloc() failure");
+    return -1;
+  }
+  memcpy(pb->data, data, len);
+  hdr = (struct udp_hdr *)pbuf_push(pb, sizeof(*hdr));
   hdr->src = src->port;
   hdr->dst = dst->port;
-  total = sizeof(*hdr) + len;
+  total = pb->len;
   hdr->len = hton16(total);
   hdr->sum = 0;
-  memcpy(hdr + 1, data, len);
   pseudo.src = src->addr;
   pseudo.dst = dst->addr;
   pseudo.zero = 0;
@@ -269,11 +312,13 @@ udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data
   debugf("%s => %s, len=%u (payload=%zu)",
          ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
   udp_dump((uint8_t *)hdr, total);
-  if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1)
+  if (ip_output_pbuf(IP_PROTOCOL_UDP, pb, src->addr, dst->addr) == -1)
   {
-    errorf("ip_output() failure");
+    errorf("ip_output_pbuf() failure");
+    pbuf_free(pb);
     return -1;
   }
+  pbuf_free(pb);
   return len;
 }
 
@@ -283,19 +328,25 @@ event_handler(void *arg)
   struct udp_pcb *pcb;
 
   (void)arg;
-  mutex_lock(&mutex);
   for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
   {
+    mutex_lock(&pcb->mutex);
     if (pcb->state == UDP_PCB_STATE_OPEN)
     {
       sched_interrupt(&pcb->ctx);
     }
+    mutex_unlock(&pcb->mutex);
   }
-  mutex_unlock(&mutex);
 }
 
 int udp_init(void)
 {
+  struct udp_pcb *pcb;
+
+  for (pcb = pcbs; pcb < tailof(pcbs); pcb++)
+  {
+    mutex_init(&pcb->mutex);
+  }
   if (ip_protocol_register(IP_PROTOCOL_UDP, udp_input) == -1)
   {
     errorf("ip_protocol_register() failure");
@@ -319,16 +370,14 @@ int udp_open(void)
   struct udp_pcb *pcb;
   int id;
 
-  mutex_lock(&mutex);
   pcb = udp_pcb_alloc();
   if (!pcb)
   {
     errorf("udp_pcb_alloc() failure");
-    mutex_unlock(&mutex);
     return -1;
   }
   id = udp_pcb_id(pcb);
-  mutex_unlock(&mutex);
+  mutex_unlock(&pcb->mutex);
   return id;
 }
 
@@ -336,16 +385,14 @@ int udp_close(int id)
 {
   struct udp_pcb *pcb;
 
-  mutex_lock(&mutex);
   pcb = udp_pcb_get(id);
   if (!pcb)
   {
     errorf("pcb not found, id=%d", id);
-    mutex_unlock(&mutex);
     return -1;
   }
   udp_pcb_release(pcb);
-  mutex_unlock(&mutex);
+  mutex_unlock(&pcb->mutex);
   return 0;
 }
 
@@ -365,16 +412,18 @@ int udp_bind(int id, struct ip_endpoint *local)
     mutex_unlock(&mutex);
     return -1;
   }
-  exist = udp_pcb_select(local->addr, local->port);
+  exist = udp_pcb_inuse(local->addr, local->port, pcb);
   if (exist)
   {
     errorf("already in use, id=%d, want=%s, exist=%s",
            id, ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(&exist->local, ep2, sizeof(ep2)));
+    mutex_unlock(&pcb->mutex);
     mutex_unlock(&mutex);
     return -1;
   }
   pcb->local = *local;
   debugf("bound, id=%d, local=%s", id, ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)));
+  mutex_unlock(&pcb->mutex);
   mutex_unlock(&mutex);
   return 0;
 }
@@ -404,6 +453,7 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
     {
       errorf("iface not found that can reach foreign address, addr=%s",
              ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
+      mutex_unlock(&pcb->mutex);
       mutex_unlock(&mutex);
       return -1;
     }
@@ -415,7 +465,7 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
     // auto selection of source port
     for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++)
     {
-      if (!udp_pcb_select(local.addr, hton16(p)))
+      if (!udp_pcb_inuse(local.addr, hton16(p), pcb))
       {
         pcb->local.port = hton16(p);
         debugf("dynamic assign local port, port=%d", p);
@@ -426,15 +476,42 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
     {
       // not found not used port
       debugf("failed to dynamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+      mutex_unlock(&pcb->mutex);
       mutex_unlock(&mutex);
       return -1;
     }
   }
   local.port = pcb->local.port;
+  mutex_unlock(&pcb->mutex);
   mutex_unlock(&mutex);
   return udp_output(&local, foreign, data, len);
 }
 
+// poll the devices in the receiving thread for up to usec before sleeping (0: disabled)
+int udp_set_busy_poll(int id, unsigned int usec)
+{
+  struct udp_pcb *pcb;
+
+  pcb = udp_pcb_get(id);
+  if (!pcb)
+  {
+    errorf("pcb not found, id=%d", id);
+    return -1;
+  }
+  pcb->busy_poll = usec;
+  mutex_unlock(&pcb->mutex);
+  return 0;
+}
+
+static int
+udp_recv_ready(void *arg)
+{
+  struct udp_pcb *pcb;
+
+  pcb = (struct udp_pcb *)arg;
+  return pcb->queue.head || pcb->state != UDP_PCB_STATE_OPEN;
+}
+
 // polling udp entry queue and if data come, copy to *buf
 ssize_t
 udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
@@ -442,30 +519,36 @@ udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
   struct udp_pcb *pcb;
   struct udp_queue_entry *entry;
   ssize_t len;
-  int err;
+  int err, polled = 0;
 
-  mutex_lock(&mutex);
   pcb = udp_pcb_get(id);
   if (!pcb)
   {
     errorf("pcb not found, id=%d", id);
-    mutex_unlock(&mutex);
     return -1;
   }
   while (1)
   {
-    entry = queue_pop(&pcb->queue);
+    entry = queue_data(queue_pop(&pcb->queue), struct udp_queue_entry, link);
     if (entry)
     {
       break;
     }
+    if (pcb->busy_poll && !polled)
+    {
+      polled = 1;
+      if (net_busy_wait(pcb->busy_poll, &pcb->mutex, udp_recv_ready, pcb))
+      {
+        continue;
+      }
+    }
     // Wait to be woken up by sched_wakeup() or sched_interruppt()
-    err = sched_sleep(&pcb->ctx, &mutex, NULL);
+    err = sched_sleep(&pcb->ctx, &pcb->mutex, NULL);
     if (err)
     {
       // this err is by sched_interrup()
       debugf("interrupted");
-      mutex_unlock(&mutex);
+      mutex_unlock(&pcb->mutex);
       errno = EINTR;
       return -1;
     }
@@ -473,17 +556,18 @@ udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
     {
       debugf("closing");
       udp_pcb_release(pcb);
-      mutex_unlock(&mutex);
+      mutex_unlock(&pcb->mutex);
       return -1;
     }
   }
-  mutex_unlock(&mutex);
+  mutex_unlock(&pcb->mutex);
   if (foreign)
   {
     *foreign = entry->foreign;
   }
-  len = MIN(size, entry->len); /* truncate */
-  memcpy(buf, entry + 1, len);
+  len = MIN(size, entry->pb->len); /* truncate */
+  memcpy(buf, entry->pb->data, len);
+  pbuf_free(entry->pb);
   memory_free(entry);
   return len;
 }
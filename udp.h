@@ -22,4 +22,6 @@ extern ssize_t
 udp_sendto(int id, uint8_t *buf, size_t len, struct ip_endpoint *foreign);
 extern ssize_t
 udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign);
+extern int
+udp_set_busy_poll(int id, unsigned int usec);
 #endif
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <limits.h>
 #include <ctype.h>
 #include <time.h>
+#include <sched.h>
 #include <sys/time.h>
 
 #include "platform.h"
@@ -88,12 +89,6 @@ void hexdump(FILE *fp, const void *data, size_t size)
  * Queue
  */
 
-struct queue_entry
-{
-  struct queue_entry *next;
-  void *data;
-};
-
 void queue_init(struct queue_head *queue)
 {
   queue->head = NULL;
@@ -101,23 +96,9 @@ void queue_init(struct queue_head *queue)
   queue->num = 0;
 }
 
-void *
-queue_push(struct queue_head *queue, void *data)
+void queue_push(struct queue_head *queue, struct queue_entry *entry)
 {
-  struct queue_entry *entry;
-
-  if (!queue)
-  {
-    return NULL;
-  }
-  entry = memory_alloc(sizeof(*entry));
-
-  if (!entry)
-  {
-    return NULL;
-  }
   entry->next = NULL;
-  entry->data = data;
   if (queue->tail)
   {
     queue->tail->next = entry;
@@ -128,14 +109,12 @@ queue_push(struct queue_head *queue, void *data)
     queue->head = entry;
   }
   queue->num++;
-  return data;
 }
 
-void *
+struct queue_entry *
 queue_pop(struct queue_head *queue)
 {
   struct queue_entry *entry;
-  void *data;
 
   if (!queue || !queue->head)
   {
@@ -148,35 +127,178 @@ queue_pop(struct queue_head *queue)
     queue->tail = NULL;
   }
   queue->num--;
-  data = entry->data;
-  memory_free(entry);
-  return data;
+  entry->next = NULL;
+  return entry;
 }
 
-void *
+struct queue_entry *
 queue_peek(struct queue_head *queue)
 {
-  if (!queue || !queue->head)
+  if (!queue)
   {
     return NULL;
   }
-  return queue->head->data;
+  return queue->head;
 }
 
-void queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg)
+// move all entries of src to the tail of dst, src becomes empty
+void queue_splice(struct queue_head *dst, struct queue_head *src)
 {
-  struct queue_entry *entry;
+  if (!src->head)
+  {
+    return;
+  }
+  if (dst->tail)
+  {
+    dst->tail->next = src->head;
+  }
+  else
+  {
+    dst->head = src->head;
+  }
+  dst->tail = src->tail;
+  dst->num += src->num;
+  queue_init(src);
+}
+
+void queue_foreach(struct queue_head *queue, void (*func)(void *arg, struct queue_entry *entry), void *arg)
+{
+  struct queue_entry *entry, *next;
 
   if (!queue || !func)
   {
     return;
   }
-  for (entry = queue->head; entry; entry = entry->next)
+  for (entry = queue->head; entry; entry = next)
   {
-    func(arg, entry->data);
+    next = entry->next;
+    func(arg, entry);
   }
 }
 
+/*
+ * Ring
+ */
+
+struct ring_headtail
+{
+  unsigned int head;
+  unsigned int tail;
+} __attribute__((aligned(RING_CACHELINE_SIZE)));
+
+struct ring
+{
+  void *raw; /* pointer returned by memory_alloc() (before alignment) */
+  unsigned int size;
+  unsigned int mask;
+  struct ring_headtail prod; /* written by producers */
+  struct ring_headtail cons; /* written by the consumer */
+  void *objs[] __attribute__((aligned(RING_CACHELINE_SIZE)));
+};
+
+struct ring *
+ring_alloc(unsigned int size)
+{
+  struct ring *ring;
+  void *raw;
+
+  if (!size || (size & (size - 1)))
+  {
+    errorf("size must be a power of two, size=%u", size);
+    return NULL;
+  }
+  raw = memory_alloc(sizeof(*ring) + sizeof(void *) * size + RING_CACHELINE_SIZE - 1);
+  if (!raw)
+  {
+    errorf("memory_alloc() failure");
+    return NULL;
+  }
+  // align to the cache line so that producer and consumer indexes never share a line
+  ring = (struct ring *)(((uintptr_t)raw + RING_CACHELINE_SIZE - 1) & ~(uintptr_t)(RING_CACHELINE_SIZE - 1));
+  ring->raw = raw;
+  ring->size = size;
+  ring->mask = size - 1;
+  return ring;
+}
+
+void ring_free(struct ring *ring)
+{
+  memory_free(ring->raw);
+}
+
+// enqueue up to num objects, returns the number of enqueued objects
+unsigned int
+ring_enqueue_burst(struct ring *ring, void *const *objs, unsigned int num)
+{
+  unsigned int head, next, room, n, i;
+
+  head = __atomic_load_n(&ring->prod.head, __ATOMIC_RELAXED);
+  do
+  {
+    room = ring->size - (head - __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE));
+    n = MIN(num, room);
+    if (!n)
+    {
+      return 0;
+    }
+    next = head + n;
+    /* reserve the slots [head, next) */
+  } while (!__atomic_compare_exchange_n(&ring->prod.head, &head, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  for (i = 0; i < n; i++)
+  {
+    ring->objs[(head + i) & ring->mask] = objs[i];
+  }
+  // wait for the preceding producers to publish their slots
+  while (__atomic_load_n(&ring->prod.tail, __ATOMIC_RELAXED) != head)
+  {
+    sched_yield(); /* the preceding producer may have been preempted */
+  }
+  __atomic_store_n(&ring->prod.tail, next, __ATOMIC_RELEASE);
+  return n;
+}
+
+// dequeue up to num objects, returns the number of dequeued objects
+// NOTE: must be called only from the single consumer
+unsigned int
+ring_dequeue_burst(struct ring *ring, void **objs, unsigned int num)
+{
+  unsigned int head, avail, n, i;
+
+  head = ring->cons.head;
+  avail = __atomic_load_n(&ring->prod.tail, __ATOMIC_ACQUIRE) - head;
+  n = MIN(num, avail);
+  if (!n)
+  {
+    return 0;
+  }
+  for (i = 0; i < n; i++)
+  {
+    objs[i] = ring->objs[(head + i) & ring->mask];
+  }
+  ring->cons.head = head + n;
+  __atomic_store_n(&ring->cons.tail, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+int ring_enqueue(struct ring *ring, void *obj)
+{
+  return ring_enqueue_burst(ring, &obj, 1) ? 0 : -1;
+}
+
+void *
+ring_dequeue(struct ring *ring)
+{
+  void *obj;
+
+  return ring_dequeue_burst(ring, &obj, 1) ? obj : NULL;
+}
+
+unsigned int
+ring_count(struct ring *ring)
+{
+  return __atomic_load_n(&ring->prod.tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE);
+}
+
 /*
  * Byteorder
  */
@@ -278,3 +400,35 @@ cksum16(uint16_t *addr, uint16_t count, uint32_t init)
   }
   return ~(uint16_t)sum;
 }
+
+/*
+ * Hash
+ */
+
+// Toeplitz hash (as used by NIC receive side scaling), key must be longer than data by 4 bytes
+uint32_t
+toeplitz_hash(const uint8_t *key, size_t keylen, const uint8_t *data, size_t len)
+{
+  uint32_t hash = 0, window;
+  size_t i;
+  int b;
+
+  if (keylen < len + 4)
+  {
+    return 0;
+  }
+  window = (uint32_t)key[0] << 24 | (uint32_t)key[1] << 16 | (uint32_t)key[2] << 8 | key[3];
+  for (i = 0; i < len; i++)
+  {
+    for (b = 7; b >= 0; b--)
+    {
+      if (data[i] & (1 << b))
+      {
+        hash ^= window;
+      }
+      /* slide the 32-bit window of the key by one bit */
+      window = window << 1 | ((key[i + 4] >> b) & 1);
+    }
+  }
+  return hash;
+}
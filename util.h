@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -70,9 +71,14 @@ hexdump(FILE *fp, const void *data, size_t size);
 
 /*
  * Queue
+ *
+ * NOTE: intrusive, the entry (link) is embedded in the queued object.
+ *       Use queue_data() to get the object from the entry.
  */
 
-struct queue_entry;
+struct queue_entry {
+    struct queue_entry *next;
+};
 
 struct queue_head {
     struct queue_entry *head;
@@ -80,16 +86,52 @@ struct queue_head {
     unsigned int num;
 };
 
+#define queue_data(x, type, member) ((type *)queue_data_offset((x), offsetof(type, member)))
+
+static inline void *
+queue_data_offset(struct queue_entry *entry, size_t offset)
+{
+    return entry ? (uint8_t *)entry - offset : NULL;
+}
+
 extern void
 queue_init(struct queue_head *queue);
-extern void *
-queue_push(struct queue_head *queue, void *data);
-extern void *
+extern void
+queue_push(struct queue_head *queue, struct queue_entry *entry);
+extern struct queue_entry *
 queue_pop(struct queue_head *queue);
-extern void *
+extern struct queue_entry *
 queue_peek(struct queue_head *queue);
 extern void
-queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg);
+queue_splice(struct queue_head *dst, struct queue_head *src);
+extern void
+queue_foreach(struct queue_head *queue, void (*func)(void *arg, struct queue_entry *entry), void *arg);
+
+/*
+ * Ring
+ *
+ * Bounded lock-free FIFO of pointers. The size must be a power of two.
+ * Consumer is always single, producers may be multiple (MPSC).
+ */
+
+#define RING_CACHELINE_SIZE 64
+
+struct ring;
+
+extern struct ring *
+ring_alloc(unsigned int size);
+extern void
+ring_free(struct ring *ring);
+extern unsigned int
+ring_enqueue_burst(struct ring *ring, void * const *objs, unsigned int num);
+extern unsigned int
+ring_dequeue_burst(struct ring *ring, void **objs, unsigned int num);
+extern int
+ring_enqueue(struct ring *ring, void *obj);
+extern void *
+ring_dequeue(struct ring *ring);
+extern unsigned int
+ring_count(struct ring *ring);
 
 /*
  * Byteorder
@@ -111,4 +153,11 @@ ntoh32(uint32_t n);
 extern uint16_t
 cksum16(uint16_t *addr, uint16_t count, uint32_t init);
 
+/*
+ * Hash
+ */
+
+extern uint32_t
+toeplitz_hash(const uint8_t *key, size_t keylen, const uint8_t *data, size_t len);
+
 #endif